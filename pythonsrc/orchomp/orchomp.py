@@ -12,6 +12,9 @@ import openravepy
 def bind(mod):
    mod.viewspheres = types.MethodType(viewspheres,mod)
    mod.computedistancefield = types.MethodType(computedistancefield,mod)
+   mod.mergedistancefields = types.MethodType(mergedistancefields,mod)
+   mod.updatedistancefield = types.MethodType(updatedistancefield,mod)
+   mod.pointcloud = types.MethodType(pointcloud,mod)
    mod.addfield_fromobsarray = types.MethodType(addfield_fromobsarray,mod)
    mod.create = types.MethodType(create,mod)
    mod.iterate = types.MethodType(iterate,mod)
@@ -38,7 +41,10 @@ def viewspheres(mod, robot=None, releasegil=False):
    return mod.SendCommand(cmd, releasegil)
 
 def computedistancefield(mod, kinbody=None, cube_extent=None, aabb_padding=None,
-                         cache_filename=None, releasegil=False):
+                         cache_filename=None, fill=None, n_threads=None,
+                         cache_dir=None, cache_max_mb=None, band=None,
+                         quantize=False, store_gradients=True,
+                         tiled=False, releasegil=False):
    cmd = 'computedistancefield'
    if kinbody is not None:
       if hasattr(kinbody,'GetName'):
@@ -51,9 +57,111 @@ def computedistancefield(mod, kinbody=None, cube_extent=None, aabb_padding=None,
       cmd += ' aabb_padding %f' % aabb_padding
    if cache_filename is not None:
       cmd += ' cache_filename %s' % cache_filename
+   if fill is not None:
+      cmd += ' fill %s' % fill
+   if n_threads is not None:
+      cmd += ' n_threads %d' % n_threads
+   if cache_dir is not None:
+      cmd += ' cache_dir %s' % cache_dir
+   if cache_max_mb is not None:
+      cmd += ' cache_max_mb %f' % cache_max_mb
+   if band is not None:
+      cmd += ' band %f' % band
+   if quantize:
+      cmd += ' quantize'
+   if not store_gradients:
+      cmd += ' nogradients'
+   if tiled:
+      cmd += ' tiled'
    print 'cmd:', cmd
    return mod.SendCommand(cmd, releasegil)
 
+def mergedistancefields(mod, kinbodies=None, cube_extent=None, band=None,
+                        quantize=False, store_gradients=True,
+                        tiled=False, releasegil=False):
+   cmd = 'mergedistancefields'
+   if kinbodies is None:
+      cmd += ' all'
+   else:
+      for kinbody in kinbodies:
+         if hasattr(kinbody,'GetName'):
+            cmd += ' kinbody %s' % kinbody.GetName()
+         else:
+            cmd += ' kinbody %s' % kinbody
+   if cube_extent is not None:
+      cmd += ' cube_extent %f' % cube_extent
+   if band is not None:
+      cmd += ' band %f' % band
+   if quantize:
+      cmd += ' quantize'
+   if not store_gradients:
+      cmd += ' nogradients'
+   if tiled:
+      cmd += ' tiled'
+   print 'cmd:', cmd
+   return mod.SendCommand(cmd, releasegil)
+
+def updatedistancefield(mod, kinbody=None, sdf=None, add=None, remove=None,
+                        band=None, releasegil=False):
+   cmd = 'updatedistancefield'
+   if kinbody is not None:
+      if hasattr(kinbody,'GetName'):
+         cmd += ' kinbody %s' % kinbody.GetName()
+      else:
+         cmd += ' kinbody %s' % kinbody
+   if sdf is not None:
+      cmd += ' sdf %d' % sdf
+   for name, bodies in (('add', add), ('remove', remove)):
+      if bodies is None:
+         continue
+      for body in bodies:
+         if hasattr(body,'GetName'):
+            cmd += ' %s %s' % (name, body.GetName())
+         else:
+            cmd += ' %s %s' % (name, body)
+   if band is not None:
+      cmd += ' band %f' % band
+   print 'cmd:', cmd
+   return mod.SendCommand(cmd, releasegil)
+
+def pointcloud(mod, start=False, lower=None, upper=None, cube_extent=None,
+               band=None, persistence=None, n_threads=None,
+               store_gradients=True, tiled=False, frame=None, count=None,
+               pose=None, wait=False, status=False, stop=False,
+               releasegil=False):
+   cmd = 'pointcloud'
+   if start:
+      cmd += ' start'
+   if lower is not None:
+      cmd += ' lower %f %f %f' % tuple(lower)
+   if upper is not None:
+      cmd += ' upper %f %f %f' % tuple(upper)
+   if cube_extent is not None:
+      cmd += ' cube_extent %f' % cube_extent
+   if band is not None:
+      cmd += ' band %f' % band
+   if persistence is not None:
+      cmd += ' persistence %d' % persistence
+   if n_threads is not None:
+      cmd += ' n_threads %d' % n_threads
+   if not store_gradients:
+      cmd += ' nogradients'
+   if tiled:
+      cmd += ' tiled'
+   if frame is not None:
+      cmd += ' frame %s' % frame
+   if count is not None:
+      cmd += ' count %d' % count
+   if pose is not None:
+      cmd += ' pose %f %f %f %f %f %f %f' % tuple(pose)
+   if wait:
+      cmd += ' wait'
+   if status:
+      cmd += ' status'
+   if stop:
+      cmd += ' stop'
+   return mod.SendCommand(cmd, releasegil)
+
 def addfield_fromobsarray(mod, kinbody=None, obsarray=None, sizes=None, lengths=None,
                           pose=None, releasegil=False):
    cmd = 'addfield_fromobsarray'
@@ -78,7 +186,8 @@ def create(mod, robot=None, adofgoal=None, lambda_=None,
    everyn_tsr=None,
    use_momentum=None, use_hmc=None, hmc_resample_lambda=None, seed=None,
    epsilon=None, epsilon_self=None, obs_factor=None, obs_factor_self=None,
-   no_report_cost=None, dat_filename=None, releasegil=False, **kwargs):
+   no_report_cost=None, dat_filename=None, n_threads=None,
+   use_native_fk=None, broadphase=None, releasegil=False, **kwargs):
    cmd = 'create'
    if robot is not None:
       if hasattr(robot,'GetName'):
@@ -119,6 +228,12 @@ def create(mod, robot=None, adofgoal=None, lambda_=None,
       cmd += ' no_report_cost'
    if dat_filename is not None:
       cmd += ' dat_filename %s' % dat_filename
+   if n_threads is not None:
+      cmd += ' n_threads %d' % n_threads
+   if use_native_fk is not None and use_native_fk:
+      cmd += ' use_native_fk'
+   if broadphase is not None:
+      cmd += ' broadphase %s' % broadphase
    print 'cmd:', cmd
    retval = mod.SendCommand(cmd, releasegil)
 
@@ -85,6 +85,8 @@ Chomp::Chomp(ConstraintFactory* f,
     minN = N;
     assert(maxN >= minN);
 
+    selectKernels();
+
 }
 
  //delete the mutex if one was used.
@@ -109,6 +111,31 @@ void Chomp::initMutex(){
 }
   
 
+void ChompWorkspace::reserve(int N, int M, int k, int k_max, int nc) {
+
+    // the constraint system has the M DOF and the multipliers of each
+    // timestep, and a row of it reaches back at most nc timesteps.
+    const int n = N*M + k;
+    const size_t entries = size_t(N*M) * nc * (M + k_max)
+                         + size_t(k) * (M + k_max);
+
+    if (Z.rows() < n) { Z.resize( n, 2 ); }
+    W.resize( N, M );
+    delta.resize( N, M );
+
+    constraint_system.reserve( n, entries );
+    system_start.reserve( N+1 );
+    system_row.reserve( k );
+    system_first.reserve( n );
+
+    if (y_t.rows() < k_max) { y_t.resize( k_max, 1 ); }
+    q_t.resize( 1, M );
+    h_t.resize( k_max, 1 );
+    H_t.resize( k_max, M );
+    delta_t.resize( 1, M );
+    local_system.reserve( k_max, k_max*(k_max+1)/2 );
+}
+
 void Chomp::prepareChomp() {
     
     debug << "Preparing Chomp" << std::endl;
@@ -124,6 +151,20 @@ void Chomp::prepareChomp() {
 
     gradient->prepareRun( N, use_goalset, subsample );
 
+    //size the workspace for the constraints of this level, so that
+    //  the iterations do not have to allocate.
+    int k = 0, k_max = 0;
+    if (factory) {
+        for (size_t t=0; t<factory->constraints.size(); t++) {
+            Constraint* c = factory->constraints[t];
+            const int k_t = c ? c->numOutputs() : 0;
+            if ( !subsample || t % 2 == 0 ){ k += k_t; }
+            k_max = std::max( k_max, k_t );
+        }
+    }
+    workspace.reserve( subsample ? (N+1)/2 : N, M, k, k_max,
+                       gradient->coeffs.size() );
+
     if( subsample ){
         N_sub = (N+1)/2;
         new (&xi_sub) SubMatMap( xi.data(), N_sub, M,
@@ -230,6 +271,8 @@ bool Chomp::iterateChomp( bool local ){
     
     debug << "Starting Iteration" << std::endl;
 
+    const size_t heap_start = heapAllocations();
+
     ChompEventType event;
     bool not_finished = true;
 
@@ -258,6 +301,8 @@ bool Chomp::iterateChomp( bool local ){
 
     //test for termination conditions
     double curObjective = gradient->evaluateObjective( xi );
+
+    allocations = heapAllocations() - heap_start;
     bool greater_than_min = cur_iter >
                             (local ? min_local_iter : min_global_iter);
     bool greater_than_max = cur_iter > 
@@ -331,11 +376,153 @@ void Chomp::upsample() {
   xi = xi_up;
   unlockTrajectory();
 
-  h = h_sub = H = H_sub = P = HP = Y = W = delta = MatX();
+  h = h_sub = MatX();
+  H = H_sub = ConstraintJacobian();
 
   N_sub = 0;
 }
 
+bool Chomp::factorConstraintSystem( const MatX& L,
+                                    const ConstraintJacobian& H_which )
+{
+    // The constrained update solves
+    //
+    //   [ A  H^T ] [ delta  ]   [ alpha * g ]
+    //   [ H  -e  ] [ lambda ] = [ h         ]
+    //
+    // where A is the smoothness matrix, applied to each DOF. Each
+    // row of H only touches one timestep, and A only couples
+    // timesteps less than nc apart, so with the unknowns of each
+    // timestep (its M DOF, then the multipliers of its constraints)
+    // kept together, the matrix fits in a narrow profile. e is a
+    // tiny regularization, which keeps the factorization going when
+    // the constraints of a timestep are redundant.
+    //
+    // The factorization does not pivot, so with redundant or nearly
+    // dependent constraints the pivot of a multiplier is down at the
+    // size of e, or of the rounding error. Such a pivot makes the
+    // solve meaningless, so it is reported instead, and the caller
+    // falls back to solveConstraintsDense.
+
+    const int N_which = H_which.timesteps();
+    const int o = L.cols()-1;
+
+    assert(L.rows() == N_which && H_which.blocks.cols() == M);
+
+    std::vector<int>& system_start = workspace.system_start;
+    std::vector<int>& system_row = workspace.system_row;
+    std::vector<int>& first = workspace.system_first;
+    SkylineLDLT& constraint_system = workspace.constraint_system;
+
+    system_start.resize( N_which+1 );
+    system_start[0] = 0;
+    for (int t=0; t<N_which; ++t) {
+      system_start[t+1] = system_start[t] + M
+                        + H_which.offset[t+1] - H_which.offset[t];
+    }
+
+    // a DOF couples to the same DOF of the o timesteps before it,
+    // and a multiplier to the DOF of its own timestep.
+    first.resize( system_start[N_which] );
+    for (int t=0; t<N_which; ++t) {
+      const int s0 = system_start[ std::max(0, t-o) ];
+      for (int j=0; j<M; ++j) { first[ system_start[t]+j ] = s0 + j; }
+      for (int i=system_start[t]+M; i<system_start[t+1]; ++i) {
+        first[i] = system_start[t];
+      }
+    }
+    constraint_system.resize( first );
+
+    for (int t=0; t<N_which; ++t) {
+      for (int s=std::max(0, t-o); s<=t; ++s) {
+        // A(t,s) from the rows of its cholesky factor.
+        double a = 0;
+        for (int m=std::max(0, t-o); m<=s; ++m) {
+          a += L(t, m-t+o) * L(s, m-s+o);
+        }
+        for (int j=0; j<M; ++j) {
+          constraint_system( system_start[t]+j, system_start[s]+j ) = a;
+        }
+      }
+    }
+
+    system_row.resize( H_which.rows() );
+    for (int t=0; t<N_which; ++t) {
+      for (int r=H_which.offset[t]; r<H_which.offset[t+1]; ++r) {
+        const int i = system_start[t] + M + r - H_which.offset[t];
+        system_row[r] = i;
+
+        double norm = 0;
+        for (int j=0; j<M; ++j) {
+          const double hj = H_which.blocks(r, j);
+          constraint_system( i, system_start[t]+j ) = hj;
+          norm += hj*hj;
+        }
+
+        // at most 1e-10 of the diagonal of H*A^-1*H^T.
+        const double a = constraint_system( system_start[t],
+                                            system_start[t] );
+        constraint_system( i, i ) = -1e-10 * norm / a;
+      }
+    }
+
+    // e is 1e-10 of the other terms of a pivot, so this leaves room
+    // for it and for some rounding error.
+    return constraint_system.factor( 1e-8 );
+}
+
+void Chomp::solveConstraintsDense( const MatX& L, const MatX& g,
+                                   const ConstraintJacobian& H_which,
+                                   const MatX& h_which )
+{
+    // Eliminates delta from the system in factorConstraintSystem,
+    // with P = A^-1 * H^T, and solves for the multipliers with a
+    // pivoting LDL^T of H * P, which copes with a singular H * P.
+    // This allocates, and costs O(k^2) for k constraints, so it is
+    // only used when the banded factorization fails.
+
+    const int N_which = H_which.timesteps();
+    const int k = H_which.rows();
+
+    // column block r of P is A^-1 times row r of H, placed at the
+    // timestep of constraint r.
+    MatX P = MatX::Zero( N_which, k*M );
+    for (int t=0; t<N_which; ++t) {
+      for (int r=H_which.offset[t]; r<H_which.offset[t+1]; ++r) {
+        P.block( t, r*M, 1, M ) = H_which.blocks.row(r);
+      }
+    }
+    skylineCholSolve( L, P );
+
+    MatX& W = workspace.W;
+    MatX& delta = workspace.delta;
+    W = g * alpha;
+    skylineCholSolve( L, W );
+
+    MatX HP( k, k );
+    MatX HW( k, 1 );
+    for (int t=0; t<N_which; ++t) {
+      for (int r=H_which.offset[t]; r<H_which.offset[t+1]; ++r) {
+        for (int s=0; s<k; ++s) {
+          HP(r, s) = H_which.blocks.row(r).dot( P.row(t).segment( s*M, M ) );
+        }
+        HW(r) = H_which.blocks.row(r).dot( W.row(t) );
+      }
+    }
+
+    Eigen::LDLT<MatX> cholSolver( HP );
+    const MatX Y_W = cholSolver.solve( HW );
+    const MatX Y_h = cholSolver.solve( h_which );
+
+    // W is projected onto the constraints, and delta corrects their
+    // violation.
+    delta = MatX::Zero( N_which, M );
+    for (int r=0; r<k; ++r) {
+      W -= Y_W(r) * P.middleCols( r*M, M );
+      delta += Y_h(r) * P.middleCols( r*M, M );
+    }
+}
+
 // single iteration of chomp
 void Chomp::chompGlobal() { 
     
@@ -344,10 +531,10 @@ void Chomp::chompGlobal() {
     // see if we're in our base case (not subsampling)
     bool subsample = N_sub != 0;
     
-    const MatX& g = (subsample ? gradient->g_sub : gradient->g );
+    MatX& g = (subsample ? gradient->g_sub : gradient->g );
     const MatX& L = gradient->getInvAMatrix( subsample );
 
-    const MatX& H_which = subsample ? H_sub : H;
+    const ConstraintJacobian& H_which = subsample ? H_sub : H;
     const MatX& h_which = subsample ? h_sub : h;
     const int   N_which = subsample ? N_sub : N;
     
@@ -357,7 +544,7 @@ void Chomp::chompGlobal() {
 
         assert( g.rows() == N_which ); 
       
-        skylineCholSolve(L, g);
+        (this->*smoothness_kernel)(L, g);
       
         //if we are using momentum, add the gradient into the
         //  momentum.
@@ -371,78 +558,120 @@ void Chomp::chompGlobal() {
     //chomp update with constraints
     } else {
 
-      P = H_which.transpose();
-      
-      // TODO: see if we can make this more efficient?
-      for (int i=0; i<P.cols(); i++){
-        skylineCholSolveMulti(L, P.col(i));
-      }
+      assert(g.rows() == N_which && g.cols() == M);
 
-      debug << "H = \n" << H << "\n";
-      debug << "P = \n" << P << "\n";
-  
-      HP = H_which*P;
+      MatX& W = workspace.W;
+      MatX& delta = workspace.delta;
 
-      cholSolver.compute(HP);
-      Y = cholSolver.solve(P.transpose());
+      if (!factorConstraintSystem( L, H_which )) {
 
-      debug << "HP*Y = \n" << HP*Y << "\n";
-      debug << "P.transpose() = \n" << P.transpose() << "\n";
-      debug_assert( P.transpose().isApprox( HP*Y ));
+        debug << "constraints are nearly dependent, "
+              << "using the dense solve\n";
+        solveConstraintsDense( L, g, H_which, h_which );
 
-      int newsize = H_which.cols();
-      assert(newsize == N_which * M);
+      } else {
 
-      assert(g.rows() == N_which && g.cols() == M);
-      
-      Eigen::Map<const MatX> g_flat(g.data(), newsize, 1);
-      W = (MatX::Identity(newsize,newsize) - H_which.transpose() * Y)
-          * g_flat * alpha;
-      skylineCholSolveMulti(L, W);
+        const std::vector<int>& system_start = workspace.system_start;
+        const std::vector<int>& system_row = workspace.system_row;
+        const int n = workspace.constraint_system.rows();
 
-      Y = cholSolver.solve(h_which);
+        assert(h_which.rows() == int(system_row.size()));
+
+        // the first column gets the step along the gradient, projected
+        // onto the constraints, and the second the step that corrects
+        // the constraint violation.
+        if (workspace.Z.rows() < n) { workspace.Z.resize( n, 2 ); }
+        Eigen::Block<ChompWorkspace::SystemRHS, Eigen::Dynamic, 2> Z =
+          workspace.Z.topRows( n );
+        Z.setZero();
+        for (int t=0; t<N_which; ++t) {
+          Z.block( system_start[t], 0, M, 1 ) = g.row(t).transpose() * alpha;
+        }
+        for (int r=0; r<h_which.rows(); ++r) {
+          Z( system_row[r], 1 ) = h_which(r);
+        }
+
+        workspace.constraint_system.solve( Z );
+
+        W.resize( N_which, M );
+        delta.resize( N_which, M );
+        for (int t=0; t<N_which; ++t) {
+          W.row(t) = Z.block( system_start[t], 0, M, 1 ).transpose();
+          delta.row(t) = Z.block( system_start[t], 1, M, 1 ).transpose();
+        }
+
+      }
 
-      //debug_assert( h_which.isApprox(HP*Y) );
-      
       //handle momentum if we need to.
       if (!subsample && use_momentum){
-        Eigen::Map<MatX> momentum_flat( momentum.data(), newsize, 1);
-        momentum_flat += W;
-        delta = momentum_flat + P * Y;
+        momentum += W;
+        delta += momentum;
       }else {
-        delta = W + P * Y;
+        delta += W;
       }
 
-      assert(delta.rows() == newsize && delta.cols() == 1);
-
-      Eigen::Map<const Eigen::MatrixXd> delta_rect(delta.data(),
-                                                   N_which, M);
-      
       debug << "delta = \n" << delta << "\n";
-      debug << "delta_rect = \n" << delta_rect << "\n";
-      
-      assert(delta_rect.rows() == N_which && 
-             delta_rect.cols() == M);
-      
-      updateTrajectory( delta_rect, subsample );
+
+      updateTrajectory( delta, subsample );
     }
 }
 
 
 
+template <int DOF>
+void Chomp::solveSmoothness( const MatX& L, MatX& g ) {
+    Eigen::Map< Eigen::Matrix<double, Eigen::Dynamic, DOF> >
+        g_fixed( g.data(), g.rows(), M );
+    skylineCholSolve( L, g_fixed );
+}
+
+void Chomp::selectKernels() {
+    switch (M) {
+    case 6:
+        smoothness_kernel = &Chomp::solveSmoothness<6>;
+        local_kernel = &Chomp::localSmoothKernel<6>;
+        break;
+    case 7:
+        smoothness_kernel = &Chomp::solveSmoothness<7>;
+        local_kernel = &Chomp::localSmoothKernel<7>;
+        break;
+    case 14:
+        smoothness_kernel = &Chomp::solveSmoothness<14>;
+        local_kernel = &Chomp::localSmoothKernel<14>;
+        break;
+    default:
+        smoothness_kernel = &Chomp::solveSmoothness<Eigen::Dynamic>;
+        local_kernel = &Chomp::localSmoothKernel<Eigen::Dynamic>;
+        break;
+    }
+}
+
 // single iteration of local smoothing
 //
 // precondition: prepareChompIter has been called since the last
 // time xi was modified
 void Chomp::localSmooth() {
+    (this->*local_kernel)();
+}
+
+template <int DOF>
+void Chomp::localSmoothKernel() {
 
     debug << "Starting localSmooth" << std::endl;
 
-    MatX h_t, H_t, P_t, P_t_inv, delta_t;
+    // the rows below have DOF columns, so that for the common robots
+    // the products over the DOF are unrolled at compile time.
+    typedef Eigen::Matrix<double, Eigen::Dynamic, DOF> MatDOF;
+    typedef Eigen::Matrix<double, 1, DOF> RowDOF;
+
+    MatX& q_t = workspace.q_t;
+    MatX& h_t = workspace.h_t;
+    MatX& H_t_dyn = workspace.H_t;
+    Eigen::Map<RowDOF> delta_t( workspace.delta_t.data(), M );
 
     hmag = 0;
     
-    const MatX & g = gradient->g;
+    const Eigen::Map<const MatDOF> g( gradient->g.data(), N, M );
 
     for (int t=0; t<N; ++t){
 
@@ -454,13 +683,17 @@ void Chomp::localSmooth() {
         //if this timestep could be constrained,
         //  evaluate the constraints
         if (is_constrained) {
-            c->evaluateConstraints(xi.row(t), h_t, H_t);
+            q_t = xi.row(t);
+            c->evaluateConstraints(q_t, h_t, H_t_dyn);
             is_constrained = h_t.rows() > 0;
         }
         
         //if there are active constraints this timestep.
         if ( is_constrained ) {
 
+            const Eigen::Map<const MatDOF> H_t( H_t_dyn.data(),
+                                                H_t_dyn.rows(), M );
+
             hmag = std::max(hmag, h_t.lpNorm<Eigen::Infinity>());
             
             debug << "ROWS: " << H_t.rows() << " " <<
@@ -468,14 +701,26 @@ void Chomp::localSmooth() {
             debug << "ROWS: " << h_t.rows() << " " <<
                       factory->constraints[t]->numOutputs() << "\n";
     
-            P_t = H_t*H_t.transpose();
-            P_t_inv = P_t.inverse();
-
-            // transpose g to be a column vector
-            delta_t = ( (MatX::Identity(M,M) - H_t.transpose()*P_t_inv*H_t)
-                        * g.row(t).transpose() * alpha
-                        + H_t.transpose()*P_t_inv*h_t 
-                      ).transpose();
+            // the projected step is alpha*g + H^T*y, where
+            //   (H*H^T) y = h - alpha*H*g,
+            // which needs no M-by-M matrices.
+            const int k = H_t.rows();
+            if (workspace.y_t.rows() < k) { workspace.y_t.resize( k, 1 ); }
+            Eigen::Block<MatX> y = workspace.y_t.topRows( k );
+
+            SkylineLDLT& P_t = workspace.local_system;
+            P_t.resize( k );
+            for (int i=0; i<k; ++i) {
+              for (int j=0; j<=i; ++j) {
+                P_t(i,j) = H_t.row(i).dot( H_t.row(j) );
+              }
+              y(i,0) = h_t(i) - alpha * H_t.row(i).dot( g.row(t) );
+            }
+            P_t.factor();
+            P_t.solve( y );
+
+            delta_t = alpha * g.row(t);
+            delta_t.noalias() += y.transpose() * H_t;
         
         }
         //there are no constraints, so just add the negative gradient
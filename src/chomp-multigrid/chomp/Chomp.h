@@ -44,6 +44,41 @@
 
 namespace chomp {
 
+//The working memory of the chomp updates. It is sized when chomp
+//  prepares for a resolution level, and then only grows if a bigger
+//  constraint system comes along, so that the iterations at a level
+//  do not allocate.
+class ChompWorkspace {
+  public:
+
+    //make room for N timesteps of M DOF, with k constraints in all
+    //  and at most k_max at any timestep, and a smoothness matrix
+    //  with nc coefficients.
+    void reserve(int N, int M, int k, int k_max, int nc);
+
+    //the global update. Only the first rows of Z are used, it is
+    //  as tall as the largest constraint system so far. Its two
+    //  columns are fixed, so that the solve keeps a row of it in
+    //  registers.
+    typedef Eigen::Matrix<double, Eigen::Dynamic, 2> SystemRHS;
+    SystemRHS Z;
+    MatX W, delta;
+
+    //The constraint system of a global update: the smoothness
+    //  matrix and the constraint Jacobian in a single symmetric
+    //  matrix, which is banded when its unknowns are ordered by
+    //  timestep. system_start is where the unknowns of each
+    //  timestep start, system_row is where the multiplier of each
+    //  constraint is, and system_first is the profile of the matrix.
+    SkylineLDLT constraint_system;
+    std::vector<int> system_start, system_row, system_first;
+
+    //the local update, with the constraints of a single timestep.
+    //  Only the first rows of y_t are used.
+    MatX q_t, h_t, H_t, y_t, delta_t;
+    SkylineLDLT local_system;
+};
+
 class Chomp : public ChompOptimizerBase {
   public:
 
@@ -60,15 +95,15 @@ class Chomp : public ChompOptimizerBase {
     MatX h; // constraint function of size k-by-1
     MatX h_sub; // constraint function of size k_sub-by-1
 
-    MatX H; // constraint Jacobian of size k-by-M*N
-    MatX H_sub; // constraint Jacobian of size k_sub-by-1
+    ConstraintJacobian H; // constraint Jacobian of size k-by-M*N
+    ConstraintJacobian H_sub; // constraint Jacobian of size k_sub-by-M*N_sub
     
     MatX bounds_violations;
 
     double hmag; // inf. norm magnitude of constraint violation
 
     // working variables
-    MatX P, HP, Y, W, delta, delta_trans; 
+    ChompWorkspace workspace;
     
     double alpha;       // the gradient step size
     double objRelErrTol; //Objective function value relative to the
@@ -105,9 +140,6 @@ class Chomp : public ChompOptimizerBase {
     pthread_mutex_t trajectory_mutex;
     bool use_mutex;
     
-    //A cholesky solver for solving the constraint matrix.
-    Eigen::LDLT<MatX> cholSolver;
-
     //used for goal set chomp.
     Constraint * goalset;
     bool use_goalset;
@@ -167,6 +199,20 @@ class Chomp : public ChompOptimizerBase {
     // upsamples the trajectory by 2x
     void upsample();
 
+    // build and factor workspace.constraint_system from the cholesky
+    // factor of the smoothness matrix and the constraint Jacobian.
+    // returns false if the constraints are too close to dependent for
+    // the factorization, which does not pivot.
+    bool factorConstraintSystem( const MatX& L,
+                                 const ConstraintJacobian& H_which );
+
+    // the constrained update into workspace.W and workspace.delta,
+    // without the banded system, by a pivoting solve for the
+    // multipliers. slower, but works with dependent constraints.
+    void solveConstraintsDense( const MatX& L, const MatX& g,
+                                const ConstraintJacobian& H_which,
+                                const MatX& h_which );
+
     // single iteration of chomp
     void chompGlobal();
     
@@ -176,6 +222,20 @@ class Chomp : public ChompOptimizerBase {
     // time xi was modified
     void localSmooth();
 
+    // the unconstrained global update, g = A^-1 * g, and local
+    // smoothing, compiled for DOF columns. DOF is Eigen::Dynamic for
+    // the robots that have no kernels of their own.
+    template <int DOF>
+    void solveSmoothness( const MatX& L, MatX& g );
+    template <int DOF>
+    void localSmoothKernel();
+
+    // point the kernels at the ones compiled for M, which is
+    // fixed once chomp is created.
+    void selectKernels();
+    void (Chomp::*smoothness_kernel)( const MatX& L, MatX& g );
+    void (Chomp::*local_kernel)();
+
     // upsamples trajectory, projecting onto constraint for each new
     // trajectory element.
     void constrainedUpsampleTo(int Nmax, double htol, double hstep=0.5);
@@ -80,8 +80,16 @@ inline double ChompCollGradHelper::computeGradient(
     Eigen::MatrixBase<Derived3>& g = 
         const_cast<Eigen::MatrixBase<Derived3>&>(g_const);
 
-    q1 = getTickBorderRepeat(-1, xi, pinit, pgoal, dt).transpose();
-    q2 = getTickBorderRepeat(0,  xi, pinit, pgoal, dt).transpose();
+    //the ticks are written in place, so that the loop below
+    //  does not allocate once these have their size.
+    const int M = xi.cols();
+    q0.resize(M, 1);
+    q1.resize(M, 1);
+    q2.resize(M, 1);
+    P.resize(chelper->nwkspace, chelper->nwkspace);
+
+    getTickBorderRepeat(-1, xi, pinit, pgoal, dt, q1.transpose());
+    getTickBorderRepeat(0,  xi, pinit, pgoal, dt, q2.transpose());
     
     const double inv_dt = 1/dt;
     const double inv_dt_squared = inv_dt * inv_dt;
@@ -90,9 +98,9 @@ inline double ChompCollGradHelper::computeGradient(
 
     for (int t=0; t < xi.rows() ; ++t) {
 
-      q0 = q1;
-      q1 = q2;
-      q2 = getTickBorderRepeat(t+1, xi, pinit, pgoal, dt).transpose();
+      q0.swap(q1);
+      q1.swap(q2);
+      getTickBorderRepeat(t+1, xi, pinit, pgoal, dt, q2.transpose());
 
       cspace_vel = 0.5 * (q2 - q0) * inv_dt;        
       cspace_accel = (q0 - 2.0*q1 + q2) * inv_dt_squared;
@@ -102,13 +110,13 @@ inline double ChompCollGradHelper::computeGradient(
         float cost = chelper->getCost(q1, u, dx_dq, cgrad);
         if (cost > 0.0) {
 
-          wkspace_vel = dx_dq * cspace_vel;
+          wkspace_vel.noalias() = dx_dq * cspace_vel;
 
           //this prevents nans from propagating. Several lines below, 
           //    wkspace_vel /= wv_norm if wv_norm is zero, nans propogate.
           if (wkspace_vel.isZero()){ continue; }
 
-          wkspace_accel = dx_dq * cspace_accel;
+          wkspace_accel.noalias() = dx_dq * cspace_accel;
           
           float wv_norm = wkspace_vel.norm();
           wkspace_vel /= wv_norm;
@@ -118,15 +126,18 @@ inline double ChompCollGradHelper::computeGradient(
 
           total += cost * scl;
           
-          P = MatX::Identity(chelper->nwkspace, chelper->nwkspace)
-              - (wkspace_vel * wkspace_vel.transpose());
+          P.setIdentity();
+          P.noalias() -= wkspace_vel * wkspace_vel.transpose();
 
-          K = (P * wkspace_accel) / (wv_norm * wv_norm);
-         
+          K.noalias() = P * wkspace_accel;
+          K /= (wv_norm * wv_norm);
+
+          // P * cgrad - cost * K, of size W-by-1
+          wkspace_grad.noalias() = P * cgrad;
+          wkspace_grad -= cost * K;
 
-          //          scalar * M-by-W        * (WxW * Wx1   - scalar * Wx1)
-          g.row(t) += (scl * (dx_dq.transpose() *
-                      (P * cgrad - cost * K)).transpose());
+          //                  scalar * (1-by-W               * W-by-M)
+          g.row(t).noalias() += scl * (wkspace_grad.transpose() * dx_dq);
          
 
         }
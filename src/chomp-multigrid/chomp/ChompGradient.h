@@ -109,7 +109,7 @@ class ChompCollGradHelper: public ChompGradientHelper {
     MatX q0, q1, q2;
     MatX cspace_vel,  cspace_accel,
          wkspace_vel, wkspace_accel;
-    MatX P, K; 
+    MatX P, K, wkspace_grad; 
     
 };
 
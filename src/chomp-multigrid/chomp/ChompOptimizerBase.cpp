@@ -18,7 +18,8 @@ ChompOptimizerBase::ChompOptimizerBase( ConstraintFactory * f,
     objective_type( object_type ),
     N(xinit.rows()), M(xinit.cols()),
     xi( xinit ),
-    lower_bounds( lower_bounds ), upper_bounds( upper_bounds )
+    lower_bounds( lower_bounds ), upper_bounds( upper_bounds ),
+    allocations( 0 )
 {
 
     assert( pinit.size() == M );
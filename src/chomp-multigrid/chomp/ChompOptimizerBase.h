@@ -21,6 +21,10 @@ class ChompOptimizerBase{
     //the current trajectory of size N*M.
     MatX xi;
     MatX lower_bounds, upper_bounds;
+
+    //the number of heap allocations that the last iteration made,
+    //  see heapAllocations.
+    size_t allocations;
     
     ChompOptimizerBase( ConstraintFactory * f,
                         const MatX & xi,
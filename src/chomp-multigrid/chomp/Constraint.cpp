@@ -125,6 +125,7 @@ namespace chomp {
         assert( _Bw.rows() == 6 );
 
         calculateDimensionality();
+        _active_dims.reserve( _dim_constraint );
     }
 
     inline void TSRConstraint::calculateDimensionality()
@@ -211,15 +212,12 @@ namespace chomp {
         //the dimensionality of the configuration space
         size_t DoF = qt.size() ;
         
-        //format h (constraint value vector).
-        if (size_t(h.rows()) != _dim_constraint || h.cols() != 1)
-        {
-            h.resize(_dim_constraint, 1);
-        }
-        
+        //collect the violated bounds first, so that h is only resized
+        //  when the number of them changes.
+        double violation[6];
         int current_dim = 0;
 
-        std::vector< int > active_dims;
+        _active_dims.clear();
         
         for ( int i = 0; i < _dim_constraint; i ++ )
         {
@@ -227,26 +225,28 @@ namespace chomp {
             
             //if the robot's position goes over the TSR's upper bound:
             if ( xyzrpy[dim] > _Bw(dim, 1) ){
-                h(current_dim) = xyzrpy[ dim ] - _Bw(dim, 1);
-                active_dims.push_back( dim );
+                violation[current_dim] = xyzrpy[ dim ] - _Bw(dim, 1);
+                _active_dims.push_back( dim );
                 current_dim ++;
             }
             //if the robot's position goes below the TSR's lower bound:
             else if ( xyzrpy[dim] < _Bw( dim, 0 ) ){
-                h(current_dim) = xyzrpy[ dim ] - _Bw(dim, 0);
-                active_dims.push_back( dim );
+                violation[current_dim] = xyzrpy[ dim ] - _Bw(dim, 0);
+                _active_dims.push_back( dim );
                 current_dim ++;
             }
         }
 
-        
-        if ( current_dim != _dim_constraint ){
-            h.conservativeResize( current_dim, 1 );
+        //format h (constraint value vector).
+        if ( h.rows() != current_dim || h.cols() != 1 ){
+            h.resize( current_dim, 1 );
         }
+        for ( int i = 0; i < current_dim; i ++ ){ h(i) = violation[i]; }
+
         if ( H.rows() != current_dim || size_t( H.cols() ) != DoF ){
             H.resize( current_dim, DoF );
         }
-        computeJacobian( qt, pos, H, active_dims );
+        computeJacobian( qt, pos, H, _active_dims );
 
     }
 
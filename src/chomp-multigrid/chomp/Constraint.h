@@ -126,6 +126,10 @@ namespace chomp {
                                      MatX& H);
     
   private:  
+    //the dimensions whose bounds the last evaluation found violated,
+    //  kept to save allocating them at every evaluation.
+    std::vector<int> _active_dims;
+
     //these are useful helper functions that determine various things.
     // They should not be overwritten.
     inline void calculateDimensionality();
@@ -59,9 +59,10 @@ namespace chomp {
     
     size_t numOutput();
 
+    //evaluate the constraints at every step-th timestep of xi.
     virtual void evaluate(const MatX& xi, 
                           MatX& h_tot, 
-                          MatX& H_tot, 
+                          ConstraintJacobian& H_tot, 
                           int step=1);
 
     virtual void evaluate(ConstMatMap& xi, 
@@ -87,6 +88,12 @@ namespace chomp {
             ->evaluate( constraint_dim, result, n_by_m, x, grad);
     }
 
+  private:
+    //buffers that are reused from one evaluation to the next. The
+    //  state of a timestep is copied into q_t, since passing a row
+    //  of xi as a MatX would make a temporary.
+    MatX q_t, h_t, H_t, h_all;
+
   };
 
 }
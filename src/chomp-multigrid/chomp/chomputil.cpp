@@ -32,10 +32,62 @@
 */
 
 #include "chomputil.h"
+#include "ChompOptimizerBase.h"
 #include <iomanip>
+#include <cmath>
+
+#ifdef CHOMP_COUNT_ALLOCATIONS
+
+//the linker is told to send the allocation calls of chomp (and of the
+//  libraries linked with the same flags) through these, see
+//  CMakeLists.txt. Nothing else in the process is affected.
+static size_t heap_allocations = 0;
+
+extern "C" {
+
+void * __real_malloc( size_t size );
+void * __real_calloc( size_t n, size_t size );
+void * __real_realloc( void * ptr, size_t size );
+void * __real__Znwm( size_t size );
+void * __real__Znam( size_t size );
+
+void * __wrap_malloc( size_t size ){
+    __sync_fetch_and_add( &heap_allocations, 1 );
+    return __real_malloc( size );
+}
+void * __wrap_calloc( size_t n, size_t size ){
+    __sync_fetch_and_add( &heap_allocations, 1 );
+    return __real_calloc( n, size );
+}
+void * __wrap_realloc( void * ptr, size_t size ){
+    __sync_fetch_and_add( &heap_allocations, 1 );
+    return __real_realloc( ptr, size );
+}
+
+//operator new and operator new[]
+void * __wrap__Znwm( size_t size ){
+    __sync_fetch_and_add( &heap_allocations, 1 );
+    return __real__Znwm( size );
+}
+void * __wrap__Znam( size_t size ){
+    __sync_fetch_and_add( &heap_allocations, 1 );
+    return __real__Znam( size );
+}
+
+}
+
+#endif
 
 namespace chomp {
 
+size_t heapAllocations() {
+#ifdef CHOMP_COUNT_ALLOCATIONS
+    return __sync_fetch_and_add( &heap_allocations, 0 );
+#else
+    return 0;
+#endif
+}
+
 const char* eventTypeString(int eventtype) {
     switch (eventtype) {
     case CHOMP_INIT: return "CHOMP_INIT";
@@ -73,7 +125,8 @@ int DebugChompObserver::notify(const ChompOptimizerBase& c,
               << "rel=" << std::setprecision(10)
               << ((lastObjective-curObjective)/curObjective) << ", "
               << "constraint=" << std::setprecision(10)
-              << constraintViolation << "\n";
+              << constraintViolation << ", "
+              << "alloc=" << c.allocations << "\n";
 
     if (std::isnan(curObjective) || std::isinf(curObjective) ||
         std::isnan(lastObjective) || std::isinf(lastObjective)) {
@@ -196,4 +249,72 @@ void createInitialTraj( const MatX & q0, const MatX & q1,
 
 
 
+void SkylineLDLT::resize(const std::vector<int>& first)
+{
+    this->first = first;
+    setProfile();
+}
+
+void SkylineLDLT::resize(int n)
+{
+    first.assign(n, 0);
+    setProfile();
+}
+
+void SkylineLDLT::reserve(int n, size_t entries)
+{
+    first.reserve(n);
+    offset.reserve(n);
+    values.reserve(entries);
+}
+
+void SkylineLDLT::setProfile()
+{
+    offset.resize(first.size());
+
+    ptrdiff_t start = 0;
+    for (size_t i=0; i<first.size(); ++i) {
+      assert(first[i] >= 0 && first[i] <= int(i));
+      offset[i] = start - first[i];
+      start += int(i) - first[i] + 1;
+    }
+
+    values.assign(start, 0.0);
+}
+
+bool SkylineLDLT::factor(double tolerance)
+{
+    const int n = rows();
+    SkylineLDLT& a = *this;
+    bool stable = true;
+
+    for (int i=0; i<n; ++i) {
+
+      // first turn row i into the row of L*D, with the entries of
+      // L of the earlier rows...
+      for (int j=first[i]; j<i; ++j) {
+        double sum = 0;
+        for (int k=std::max(first[i], first[j]); k<j; ++k) {
+          sum += a(i,k) * a(j,k); // k < j < i
+        }
+        a(i,j) -= sum;
+      }
+
+      // ...then divide out D to get the row of L, and the pivot.
+      double d = a(i,i);
+      double scale = fabs(d);
+      for (int j=first[i]; j<i; ++j) {
+        const double lij = a(j,j) ? a(i,j) / a(j,j) : 0;
+        d -= lij * a(i,j);
+        scale += fabs(lij * a(i,j));
+        a(i,j) = lij;
+      }
+      a(i,i) = d;
+
+      if (fabs(d) <= tolerance * scale) { stable = false; }
+    }
+
+    return stable;
+}
+
 }//namespace
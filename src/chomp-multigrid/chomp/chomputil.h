@@ -82,6 +82,12 @@ enum ChompEventType {
 //  of the event type.
 const char* eventTypeString(int eventtype);
 
+//the number of heap allocations made so far, by every thread, from
+//  the code of chomp and of the libraries that are linked to it with
+//  the same flags. They are only counted when chomp is built with
+//  CHOMP_COUNT_ALLOCATIONS, otherwise this is always zero.
+size_t heapAllocations();
+
 /////////////////Utility types /////////////////////////
 // These classes interface with chomp, to do something useful
 class ChompObserver {
@@ -111,6 +117,28 @@ enum ChompObjectiveType {
     MINIMIZE_ACCELERATION = 1,
 };
 
+//The Jacobian of the constraints on a trajectory. Each constraint
+//  only depends on the state at a single timestep, so the Jacobian
+//  is block diagonal, and only the blocks are kept: the rows from
+//  offset[i] to offset[i+1] of blocks are the Jacobian of the
+//  constraints at timestep i, which is k_i-by-M. In the full
+//  k-by-M*N Jacobian, they are in the columns j*N + i.
+//  blocks may have more rows than the Jacobian, so that its memory
+//  can be reused from one evaluation to the next.
+class ConstraintJacobian {
+  public:
+    MatX blocks;
+    std::vector<int> offset;
+
+    int rows() const { return offset.empty() ? 0 : offset.back(); }
+    int timesteps() const { return std::max(int(offset.size())-1, 0); }
+
+    Eigen::Block<const MatX> block(int i) const {
+      return blocks.block(offset[i], 0, offset[i+1]-offset[i],
+                          blocks.cols());
+    }
+};
+
 
 //upsamples a trajectory by 2x
 //  takes a trajectory of n waypoints, with endpoints q0, q1,
@@ -136,7 +164,7 @@ void createInitialTraj( const MatX & q0, const MatX & q1,
 //Copy a MatX into a std::vector of doubles
 inline void matToVec( const MatX & mat, std::vector<double> & vec ){
     const double * data = mat.data();
-    vec = std::vector<double>(data, data + mat.size());
+    vec.assign(data, data + mat.size());
 }
 
 //Copy a vector of doubles into a MatX.
@@ -167,41 +195,71 @@ static inline double mydot(const Eigen::MatrixBase<Derived1>& a,
   return a.cwiseProduct(b).sum();
 }
 
-template <class Derived>
-inline MatX getPos(const Eigen::MatrixBase<Derived>& x, double h){
+//write the position at time h into the row vector pos_const, which
+//  must already have the right size.
+template <class Derived1, class Derived2>
+inline void getPos(const Eigen::MatrixBase<Derived1>& x, double h,
+                   const Eigen::MatrixBase<Derived2>& pos_const){
+
+    Eigen::MatrixBase<Derived2>& pos = 
+      const_cast<Eigen::MatrixBase<Derived2>&>(pos_const);
+
     double fac = 1;
     double hn = 1;
 
-    MatX rval = x.row(0);
+    pos = x.row(0);
     for (int i=1; i<x.rows(); ++i) {
       fac *= i;
       hn *= h;
-      rval += (hn / fac) * x.row(i);
+      pos += (hn / fac) * x.row(i);
     }
+}
 
+template <class Derived>
+inline MatX getPos(const Eigen::MatrixBase<Derived>& x, double h){
+    MatX rval(1, x.cols());
+    getPos(x, h, rval);
     return rval;
 }
 
-template< class Derived1, class Derived2 >
-inline MatX getTickBorderRepeat(int tick,
+//write the state at the tick into the row vector q_const, which
+//  must already have the right size. This does not allocate, so it
+//  is the one to use inside of an iteration.
+template< class Derived1, class Derived2, class Derived3 >
+inline void getTickBorderRepeat(int tick,
                                 const Eigen::MatrixBase<Derived1> & xi,
                                 const Eigen::MatrixBase<Derived2> & q0,
                                 const Eigen::MatrixBase<Derived2> & q1,
-                                double dt)
+                                double dt,
+                                const Eigen::MatrixBase<Derived3> & q_const)
 {
 
     //if the tick is negative, get a state that falls off the
     //  the edge of the trajectory
-    if (tick < 0) { return getPos(q0, (tick+1)*dt); }
+    if (tick < 0) { getPos(q0, (tick+1)*dt, q_const); }
 
     //if the tick is larger than the number of states,
     //  get a state that falls off the positive edge of the
     //  trajectory
-    else if (tick >= xi.rows()) { return getPos(q1, (tick-xi.rows())*dt);}
+    else if (tick >= xi.rows()) { getPos(q1, (tick-xi.rows())*dt, q_const);}
 
     //if the tick corresponds to a state in the trajectory,
     //  return the corresponding state.
-    else { return xi.row( tick ); }
+    else {
+      const_cast<Eigen::MatrixBase<Derived3>&>(q_const) = xi.row( tick );
+    }
+}
+
+template< class Derived1, class Derived2 >
+inline MatX getTickBorderRepeat(int tick,
+                                const Eigen::MatrixBase<Derived1> & xi,
+                                const Eigen::MatrixBase<Derived2> & q0,
+                                const Eigen::MatrixBase<Derived2> & q1,
+                                double dt)
+{
+    MatX rval(1, xi.cols());
+    getTickBorderRepeat(tick, xi, q0, q1, dt, rval);
+    return rval;
 }
 
 ///////////////////////////////////////////////////////////////
@@ -267,6 +325,68 @@ double createBMatrix(int n,
                      const Eigen::MatrixBase<Derived3>& b_const,
                      double dt);
 
+//A symmetric matrix that is stored by rows, from the first nonzero
+//  column of each row up to the diagonal (a skyline, or profile),
+//  and factored in place into L*D*L^T. The fill-in of the
+//  factorization stays inside of the profile, so a matrix that
+//  is banded after a reordering costs no more than the band.
+//  D may have negative entries, so this works on the saddle point
+//  systems of constrained chomp, as long as no pivot comes out zero.
+//  A zero pivot is skipped, which solves the system in the least
+//  squares sense if its row is all zeros.
+class SkylineLDLT {
+  public:
+
+    //set the first column that can be nonzero in each row, with
+    //  first[i] <= i, and set the matrix to zero.
+    void resize(const std::vector<int>& first);
+
+    //make it a dense n-by-n matrix, and set it to zero.
+    void resize(int n);
+
+    //make room for n rows, and the given number of entries, so that
+    //  resizing to anything smaller does not allocate.
+    void reserve(int n, size_t entries);
+
+    int rows() const { return first.size(); }
+
+    //the entry at row i and column j, for first[i] <= j <= i.
+    double& operator()(int i, int j) {
+      assert(j >= first[i] && j <= i);
+      return values[offset[i] + j];
+    }
+    double operator()(int i, int j) const {
+      assert(j >= first[i] && j <= i);
+      return values[offset[i] + j];
+    }
+
+    //replace the matrix by its factorization. Returns false if the
+    //  magnitude of some pivot is at most tolerance times that of the
+    //  terms it was computed from, that is, if the pivot is mostly
+    //  cancellation error. Without pivoting, such a matrix is too
+    //  close to singular to trust the solve. Zero pivots are skipped
+    //  by the solve either way.
+    bool factor(double tolerance=0);
+
+    //x_const = (L*D*L^T)^-1 * x_const, for every column of x_const.
+    //  precondition: factor has been called.
+    template <class Derived>
+    void solve(const Eigen::MatrixBase<Derived>& x_const) const;
+
+  private:
+    //set up offset and values from first.
+    void setProfile();
+
+    //solve, with a row of x kept in a fixed size vector, for an x
+    //  whose number of columns is known at compile time.
+    template <class Derived>
+    void solveRows(Eigen::MatrixBase<Derived>& x) const;
+
+    std::vector<int> first;
+    std::vector<ptrdiff_t> offset;
+    std::vector<double> values;
+};
+
 
 /////////////////////////////////////////////////////////////////////
 //////////////////////Matrix Methods for Goalset-CHOMP///////////////
@@ -371,6 +491,73 @@ void skylineChol(int n,
 
 }
 //////////////////////////////////////////////////////////////////////
+//The sweeps of the skyline solves, for an x whose number of columns
+//  is known at compile time, and an L with a band of O. A row of x
+//  is kept in a fixed size vector, so that all of its columns sit in
+//  SIMD registers, along with the O rows solved just before it. Every
+//  column then goes through the band in a single sweep, and each
+//  entry of x is read and written once.
+
+//x_const = L^-1 * x_const
+template <int O, class Derived1, class Derived2>
+void skylineSweepForward(const Eigen::MatrixBase<Derived1>& L,
+                         const Eigen::MatrixBase<Derived2>& x_const)
+{
+    typedef Eigen::Matrix<double, 1, Derived2::ColsAtCompileTime> Row;
+
+    const int n = L.rows();
+    assert(L.cols() == O+1 && x_const.rows() == n);
+
+    Eigen::MatrixBase<Derived2>& x = 
+      const_cast<Eigen::MatrixBase<Derived2>&>(x_const);
+
+    // window[k] is row i-O+k, zero before the rows exist.
+    Row window[O];
+    for (int k=0; k<O; ++k) { window[k].setZero(); }
+
+    for (int i=0; i<n; ++i) {
+      Row xi = x.row(i);
+      for (int k=std::max(0, O-i); k<O; ++k) {
+        xi -= L(i,k) * window[k];
+      }
+      xi *= 1.0 / L(i,O);
+
+      for (int k=0; k+1<O; ++k) { window[k] = window[k+1]; }
+      window[O-1] = xi;
+      x.row(i) = xi;
+    }
+}
+
+//x_const = L^-T * x_const
+template <int O, class Derived1, class Derived2>
+void skylineSweepBackward(const Eigen::MatrixBase<Derived1>& L,
+                          const Eigen::MatrixBase<Derived2>& x_const)
+{
+    typedef Eigen::Matrix<double, 1, Derived2::ColsAtCompileTime> Row;
+
+    const int n = L.rows();
+    assert(L.cols() == O+1 && x_const.rows() == n);
+
+    Eigen::MatrixBase<Derived2>& x = 
+      const_cast<Eigen::MatrixBase<Derived2>&>(x_const);
+
+    // window[k] is row i+1+k, zero before the rows exist.
+    Row window[O];
+    for (int k=0; k<O; ++k) { window[k].setZero(); }
+
+    for (int i=n-1; i>=0; --i) {
+      Row xi = x.row(i);
+      for (int k=0; k<std::min(O, n-1-i); ++k) {
+        xi -= L(i+1+k, O-1-k) * window[k];
+      }
+      xi *= 1.0 / L(i,O);
+
+      for (int k=O-1; k>0; --k) { window[k] = window[k-1]; }
+      window[0] = xi;
+      x.row(i) = xi;
+    }
+}
+
 //This is used by the HMC class to generate random smooth momenta.
 template <class Derived1, class Derived2>
 void skylineCholMultiplyInverseTranspose(
@@ -387,6 +574,12 @@ void skylineCholMultiplyInverseTranspose(
     const int nc = L.cols();
     const int o = nc-1;
 
+    // the velocity and acceleration bands, on a fixed number of DOF.
+    if (Derived2::ColsAtCompileTime != Eigen::Dynamic) {
+      if (o == 1) { skylineSweepBackward<1>(L, x); return; }
+      if (o == 2) { skylineSweepBackward<2>(L, x); return; }
+    }
+
     for (int i=n-1; i>=0; --i) {
       const int j1 = std::min(i+nc, n);
       for (int j=i+1; j<j1; ++j) {
@@ -409,6 +602,12 @@ void skylineCholMultiplyInverse(const Eigen::MatrixBase<Derived1>& L,
     int nc = L.cols();
     int o = nc-1;
 
+    // the velocity and acceleration bands, on a fixed number of DOF.
+    if (Derived2::ColsAtCompileTime != Eigen::Dynamic) {
+      if (o == 1) { skylineSweepForward<1>(L, x); return; }
+      if (o == 2) { skylineSweepForward<2>(L, x); return; }
+    }
+
     for (int i=0; i<n; ++i) {
       int j0 = std::max(0, i-o);
       for (int j=j0; j<i; ++j) {
@@ -423,32 +622,10 @@ template <class Derived1, class Derived2>
 void skylineCholSolve(const Eigen::MatrixBase<Derived1>& L,
                       const Eigen::MatrixBase<Derived2>& x_const)
 {
+    assert(x_const.rows() == L.rows());
 
-    int n = L.rows();
-    assert(x_const.rows() == n);
-
-    Eigen::MatrixBase<Derived2>& x = 
-      const_cast<Eigen::MatrixBase<Derived2>&>(x_const);
-
-    int nc = L.cols();
-    int o = nc-1;
-
-    for (int i=0; i<n; ++i) {
-      int j0 = std::max(0, i-o);
-      for (int j=j0; j<i; ++j) {
-        x.row(i) -= L(i,j-i+o)*x.row(j); // here j < i so col < row
-      }
-      x.row(i) /= L(i,o);
-    }
-
-    for (int i=n-1; i>=0; --i) {
-      int j1 = std::min(i+nc, n);
-      for (int j=i+1; j<j1; ++j) {
-        x.row(i) -= L(j,i-j+o) * x.row(j); // here j > i so col < row
-      }
-      x.row(i) /= L(i,o);
-    }
-
+    skylineCholMultiplyInverse(L, x_const);
+    skylineCholMultiplyInverseTranspose(L, x_const);
 }
 
 
@@ -464,7 +641,7 @@ void skylineCholSolveMulti( const Eigen::MatrixBase<Derived1>& L,
       const_cast<Eigen::MatrixBase<Derived2>&>(xx_const);
 
     for (int i=0; i<m; ++i) {
-        skylineCholSolve(L, xx.block(n*i, 0, n, xx.cols()));
+        skylineCholSolve(L, xx.middleRows(n*i, n));
     }
     
 }
@@ -510,8 +687,73 @@ double createBMatrix(int n,
 
     return 0.5*c;
 }
-  
-  
+
+
+template <class Derived>
+void SkylineLDLT::solve(const Eigen::MatrixBase<Derived>& x_const) const
+{
+    const int n = rows();
+    assert(x_const.rows() == n);
+
+    Eigen::MatrixBase<Derived>& x =
+      const_cast<Eigen::MatrixBase<Derived>&>(x_const);
+
+    if (Derived::ColsAtCompileTime != Eigen::Dynamic) {
+      solveRows(x);
+      return;
+    }
+
+    for (int i=0; i<n; ++i) {
+      for (int j=first[i]; j<i; ++j) {
+        x.row(i) -= (*this)(i,j) * x.row(j);
+      }
+    }
+
+    for (int i=0; i<n; ++i) {
+      const double d = (*this)(i,i);
+      if (d != 0) { x.row(i) /= d; }
+      else { x.row(i).setZero(); }
+    }
+
+    for (int i=n-1; i>=0; --i) {
+      for (int j=first[i]; j<i; ++j) {
+        x.row(j) -= (*this)(i,j) * x.row(i);
+      }
+    }
+}
+
+template <class Derived>
+void SkylineLDLT::solveRows(Eigen::MatrixBase<Derived>& x) const
+{
+    typedef Eigen::Matrix<double, 1, Derived::ColsAtCompileTime> Row;
+
+    const int n = rows();
+
+    // row i stays in registers while the rows before it are
+    // subtracted from it.
+    for (int i=0; i<n; ++i) {
+      Row xi = x.row(i);
+      for (int j=first[i]; j<i; ++j) {
+        xi -= (*this)(i,j) * x.row(j);
+      }
+      x.row(i) = xi;
+    }
+
+    for (int i=0; i<n; ++i) {
+      const double d = (*this)(i,i);
+      if (d != 0) { x.row(i) *= 1.0 / d; }
+      else { x.row(i).setZero(); }
+    }
+
+    for (int i=n-1; i>=0; --i) {
+      const Row xi = x.row(i);
+      for (int j=first[i]; j<i; ++j) {
+        x.row(j) -= (*this)(i,j) * xi;
+      }
+    }
+}
+
+
 //this is a diag mul for goal set chomp
 template <class Derived1, class Derived2, class Derived3, class Derived4>
 void diagMul(const Eigen::MatrixBase<Derived1>& coeffs,
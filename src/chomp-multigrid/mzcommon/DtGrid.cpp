@@ -38,6 +38,11 @@
 #include <stdexcept>
 #include <assert.h>
 #include <fstream>
+#include <algorithm>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "Bresenham.h"
 
 
@@ -49,13 +54,48 @@ template <> const double DtGrid_t<double>::DT_INF = DBL_MAX;
 #include <map>
 
 template <class real>
-DtGrid_t<real>::DtGrid_t() {
+DtGrid_t<real>::DtGrid_t(): _dist(0), _grad(0), _mapGradients(true),
+                            _numThreads(0) {
   clear();
 }
 
+template <class real>
+DtGrid_t<real>::DtGrid_t(const DtGrid_t& other):
+  Grid3_t<real>(other),
+  _ax(other._ax),
+  _data(other._data),
+  _gdata(other._gdata),
+  _file(other._file),
+  _mapGradients(other._mapGradients),
+  _minDist(other._minDist),
+  _maxDist(other._maxDist),
+  _numThreads(other._numThreads),
+  _hmap(other._hmap)
+{
+  _sync();
+}
+
 template <class real>
 DtGrid_t<real>::~DtGrid_t() {}
 
+template <class real>
+DtGrid_t<real>& DtGrid_t<real>::operator=(const DtGrid_t& other) {
+  if (this != &other) {
+    Grid3_t<real>::operator=(other);
+    _ax = other._ax;
+    _data = other._data;
+    _gdata = other._gdata;
+    _file = other._file;
+    _mapGradients = other._mapGradients;
+    _minDist = other._minDist;
+    _maxDist = other._maxDist;
+    _numThreads = other._numThreads;
+    _hmap = other._hmap;
+    _sync();
+  }
+  return *this;
+}
+
 template <class real>
 real DtGrid_t<real>::minDist() const { return _minDist; }
 
@@ -68,38 +108,54 @@ void DtGrid_t<real>::clear() {
   this->_clear();
   _data.clear();
   _gdata.clear();
+  _file.close();
+  _mapGradients = true;
   _hmap.clear();
   _minDist = DT_INF;
   _maxDist = -DT_INF;
+  _sync();
+}
+
+template <class real>
+bool DtGrid_t<real>::isMapped() const {
+  return _file.isOpen();
+}
+
+template <class real>
+bool DtGrid_t<real>::hasGradients() const {
+  return _grad != 0;
 }
 
 template <class real>
 real& DtGrid_t<real>::operator()(size_t x, size_t y, size_t z) {
+  _detach();
   return _data[this->sub2ind(x,y,z)];
 }
 
 template <class real>
 const real& DtGrid_t<real>::operator()(size_t x, size_t y, size_t z) const {
-  return _data[this->sub2ind(x,y,z)];
+  return _dist[this->sub2ind(x,y,z)];
 }
 
 template <class real>
 const real& DtGrid_t<real>::operator()(const vec3u& s) const {
-  return _data[this->sub2ind(s)];
+  return _dist[this->sub2ind(s)];
 }
 
 template <class real>
 real& DtGrid_t<real>::operator()(const vec3u& s) {
+  _detach();
   return _data[this->sub2ind(s)];
 }
 
 template <class real>
 const real& DtGrid_t<real>::operator[](size_t idx) const {
-  return _data[idx];
+  return _dist[idx];
 }
 
 template <class real>
 real& DtGrid_t<real>::operator[](size_t idx) {
+  _detach();
   return _data[idx];
 }
 
@@ -109,20 +165,23 @@ real DtGrid_t<real>::_sample(const vec3& v, vec3* grad) const {
   vec3u fs = this->floorCell(v);
   vec3 fv = this->cellCenter(fs);
 
+  // the corners are always the cells lo and lo+1 along each axis, so
+  // that a gradient can be taken between them. when the point is not
+  // between two cell centers, all of the weight goes to fs.
+  vec3u lo;
+  vec3u step;
   vec3 alpha[2];
 
   real invCS = 1/this->_cellSize;
 
   for (int j=0; j<3; ++j) {
-    if (v[j] < fv[j]) {
-      alpha[0][j] = 1.0;
-      alpha[1][j] = 0.0;
-    } else {
+    lo[j] = this->_dims[j] > 1 ? std::min(fs[j], this->_dims[j]-2) : 0;
+    step[j] = this->_dims[j] > 1 ? 1 : 0;
+    alpha[0][j] = lo[j] == fs[j] ? 1.0 : 0.0;
+    alpha[1][j] = 1 - alpha[0][j];
+    if (v[j] >= fv[j]) {
       real diff = v[j] - fv[j];
-      if (diff >= this->_cellSize || fs[j] + 1 >= this->_dims[j]) {
-        alpha[0][j] = 1.0;
-        alpha[1][j] = 0.0;
-      } else {
+      if (diff < this->_cellSize && fs[j] + 1 < this->_dims[j]) {
         real u = diff * invCS;
         alpha[0][j] = 1.0f-u;
         alpha[1][j] = u;
@@ -141,29 +200,176 @@ real DtGrid_t<real>::_sample(const vec3& v, vec3* grad) const {
     vec3u(1,1,1)
   };
 
+  // the index of the corner lo, and the distances from it to the
+  // next cell along each axis.
+  size_t base = 0;
+  size_t offset[3];
+  for (int j=0; j<3; ++j) {
+    const size_t o = this->axisOffset(j, lo[j]);
+    base += o;
+    offset[j] = this->axisOffset(j, lo[j] + step[j]) - o;
+  }
+
   real f=0;
   vec3 g(0);
+  real c[8];
 
   for (int i=0; i<8; ++i) {
     const vec3u d=disp[i];
-    vec3u s = fs + d;
+    size_t idx = base;
     real coeff = 1.0f;
     for (int j=0; j<3; ++j) { 
+      idx += d[j]*offset[j];
       coeff *= alpha[d[j]][j];
     }
+    c[i] = _dist[idx];
     if (!coeff) { continue; }
-    f += coeff * _data[this->sub2ind(s)];
-    if (grad) {
-      g += coeff * gradient(s);
+    f += coeff * c[i];
+    if (grad && _grad) {
+      g += coeff * _grad[idx];
     }
   }
 
+  if (grad && !_grad) {
+    g = cornerGradient(c, alpha, step, invCS);
+  }
+
   if (grad) { *grad = g; }
 
   return f;
 
 }
 
+template <class real>
+vec3_t<real> DtGrid_t<real>::cornerGradient(const real c[8],
+                                             const vec3 alpha[2],
+                                             const vec3u& step,
+                                             real invCS) {
+
+  // the x corner bit is 4, y is 2 and z is 1.
+  static const int bit[3] = { 4, 2, 1 };
+
+  vec3 g(0);
+
+  for (int j=0; j<3; ++j) {
+    if (!step[j]) { continue; }
+    const int k0 = (j+1)%3, k1 = (j+2)%3;
+    for (int a=0; a<2; ++a) {
+      for (int b=0; b<2; ++b) {
+        const real coeff = alpha[a][k0] * alpha[b][k1];
+        if (!coeff) { continue; }
+        const int i = a*bit[k0] + b*bit[k1];
+        g[j] += coeff * (c[i+bit[j]] - c[i]);
+      }
+    }
+    g[j] *= invCS;
+  }
+
+  return g;
+
+}
+
+#ifdef __GNUC__
+#define DTGRID_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define DTGRID_PREFETCH(p)
+#endif
+
+template <class real>
+void DtGrid_t<real>::sample(size_t n, 
+                            const real* x, const real* y, const real* z,
+                            real* f, real* gx, real* gy, real* gz) const {
+
+  // points are done in blocks, so the per-point scratch fits on the
+  // stack: first the cell and weights of every point in the block,
+  // then the corners.
+  enum { BLOCK = 64, PREFETCH_AHEAD = 4 };
+
+  const real* pos[3] = { x, y, z };
+  const real invCS = 1/this->_cellSize;
+
+  // the steps to the next cell along an axis are the same for every
+  // point in a linear grid, but depend on the cell in a tiled one.
+  size_t base[BLOCK];
+  size_t step[3][BLOCK];
+  real u[3][BLOCK];
+
+  for (size_t b0=0; b0<n; b0+=BLOCK) {
+
+    const size_t bn = std::min(size_t(BLOCK), n-b0);
+
+    for (size_t i=0; i<bn; ++i) { base[i] = 0; }
+
+    // this is floorCell and the corners and weights from _sample, one
+    // axis at a time.
+    for (int j=0; j<3; ++j) {
+      const real* p = pos[j] + b0;
+      const real o = this->_origin[j];
+      const size_t dmax = this->_dims[j]-1;
+      const size_t lmax = dmax ? dmax-1 : 0;
+      for (size_t i=0; i<bn; ++i) {
+        real t = std::max((p[i] - o)*invCS - real(0.5), real(0));
+        size_t s = std::min(size_t(t), dmax);
+        size_t l = std::min(s, lmax);
+        real diff = p[i] - (o + (s+real(0.5))*this->_cellSize);
+        bool interp = (diff >= 0 && diff < this->_cellSize && s < dmax);
+        u[j][i] = interp ? diff * invCS : real(l != s);
+        const size_t off = this->axisOffset(j, l);
+        base[i] += off;
+        step[j][i] = dmax ? this->axisOffset(j, l+1) - off : 0;
+      }
+    }
+
+    for (size_t i=0; i<bn; ++i) {
+
+      if (i + PREFETCH_AHEAD < bn) {
+        const size_t ahead = i + PREFETCH_AHEAD;
+        DTGRID_PREFETCH(_dist + base[ahead]);
+        DTGRID_PREFETCH(_dist + base[ahead] + step[2][ahead]);
+      }
+
+      const vec3 a[2] = { vec3(1-u[0][i], 1-u[1][i], 1-u[2][i]),
+                          vec3(u[0][i], u[1][i], u[2][i]) };
+
+      real fi = 0;
+      vec3 g(0);
+      real c[8];
+
+      // same corner order as _sample
+      for (int dx=0; dx<2; ++dx) {
+        for (int dy=0; dy<2; ++dy) {
+          for (int dz=0; dz<2; ++dz) {
+            const real coeff = a[dx][0] * a[dy][1] * a[dz][2];
+            const size_t idx = base[i] + dx*step[0][i] 
+              + dy*step[1][i] + dz*step[2][i];
+            c[4*dx + 2*dy + dz] = _dist[idx];
+            if (!coeff) { continue; }
+            fi += coeff * _dist[idx];
+            if (gx && _grad) { 
+              g += coeff * _grad[idx];
+            }
+          }
+        }
+      }
+
+      if (gx && !_grad) {
+        g = cornerGradient(c, a, vec3u(step[0][i], step[1][i], step[2][i]),
+                           invCS);
+      }
+
+      f[b0+i] = fi;
+      if (gx) {
+        gx[b0+i] = g[0];
+        gy[b0+i] = g[1];
+        gz[b0+i] = g[2];
+      }
+
+    }
+
+  }
+
+}
+
 template <class real>
 real DtGrid_t<real>::sample(const vec3& v) const {
   return _sample(v, 0);
@@ -186,11 +392,20 @@ vec3_t<real> DtGrid_t<real>::gradient(vec3u s) const {
   vec3 g(0);
   if (!this->_size) { return g; }
 
-  if (!_gdata.empty()) {
-    return _gdata[this->sub2ind(s)];
+  if (_grad) {
+    return _grad[this->sub2ind(s)];
   }
 
-  real vcur = _data[this->sub2ind(s)];
+  return _diffGradient(s);
+
+}
+
+template <class real>
+vec3_t<real> DtGrid_t<real>::_diffGradient(vec3u s) const {
+
+  vec3 g(0);
+
+  real vcur = _dist[this->sub2ind(s)];
   real invCS = 1/this->_cellSize;
 
   for (int d=0; d<3; ++d) {
@@ -200,13 +415,13 @@ vec3_t<real> DtGrid_t<real>::gradient(vec3u s) const {
     if (s[d] > 0) { 
 
       --s[d];
-      real vprev = _data[this->sub2ind(s)];
+      real vprev = _dist[this->sub2ind(s)];
       ++s[d];
 
       if (s[d]+1 < this->_dims[d]) {
 
         ++s[d];
-        real vnext = _data[this->sub2ind(s)];
+        real vnext = _dist[this->sub2ind(s)];
         --s[d];
 
         g[d] = (vnext-vprev) * invCS * 0.5f;
@@ -222,7 +437,7 @@ vec3_t<real> DtGrid_t<real>::gradient(vec3u s) const {
       assert( s[d]+1 < this->_dims[d] );
 
       ++s[d];
-      real vnext = _data[this->sub2ind(s)];
+      real vnext = _dist[this->sub2ind(s)];
       --s[d];
 
       g[d] = (vnext-vcur) * invCS;
@@ -268,9 +483,10 @@ vec3_t<real> DtGrid_t<real>::normal(size_t idx) const {
 template <class real>
 void DtGrid_t<real>::resize(size_t nx, size_t ny, size_t nz,
                     Axis referenceAxis,
-                    real cellSize, const vec3& origin) {
+                    real cellSize, const vec3& origin,
+                    Layout layout) {
   clear();
-  this->_resize(nx,ny,nz,cellSize,origin);
+  this->_resize(nx,ny,nz,cellSize,origin,layout);
   if (this->empty()) { return; }
   _ax[2] = referenceAxis;
   _create();
@@ -280,9 +496,10 @@ template <class real>
 void DtGrid_t<real>::resize(const vec3& min,
                     const vec3& max,
                     Axis referenceAxis,
-                    real cellSize) {
+                    real cellSize,
+                    Layout layout) {
   clear();
-  this->_resize(min,max,cellSize);
+  this->_resize(min,max,cellSize,layout);
   if (this->empty()) { return; }
   _ax[2] = referenceAxis;
   
@@ -303,6 +520,7 @@ void DtGrid_t<real>::_create() {
   this->_size = this->_dims.prod();
 
   _data.resize(this->_size, DT_INF);
+  _sync();
 
   _hmap.resize(this->_dims[_ax[0]], this->_dims[_ax[1]], 
                this->_cellSize,
@@ -332,6 +550,17 @@ void DtGrid_t<real>::dt(const RealArray& f,
   assert(v.size() >= nn);
   assert(z.size() >= nn+1);
 
+  dt(&f[0], nn, &ft[0], &v[0], &z[0]);
+
+}
+
+template <class real>
+void DtGrid_t<real>::dt(const real* f,
+                        size_t nn,
+                        real* ft,
+                        int* v,
+                        real* z) {
+
   int n = nn;
 
   int k = 0;
@@ -372,6 +601,8 @@ void DtGrid_t<real>::computeDistsFromBinary(bool storeGradients) {
 
   if (this->empty()) { return; }
 
+  _detach();
+
   // set bintmp to true wherever data <= 0 and false wherever data > 0
   // also set data to 0 wherever bintmp is true and inf otherwise
   std::vector<bool> bintmp(this->_size);
@@ -407,6 +638,7 @@ void DtGrid_t<real>::computeDistsFromBinary(bool storeGradients) {
   }
 
   _gdata.clear();
+  _sync();
 
   if (storeGradients) {
     _createGradients();
@@ -414,11 +646,105 @@ void DtGrid_t<real>::computeDistsFromBinary(bool storeGradients) {
 
 }
 
+template <class real>
+void DtGrid_t<real>::updateDistsFromBinary(const vec3u& lo, const vec3u& hi,
+                                           size_t band, real maxDist) {
+
+  if (this->empty()) { return; }
+
+  _detach();
+
+  // the distances within band of the box are rewritten, and they are
+  // computed from the occupancy within 2*band of it, which holds the
+  // nearest occupied (or free) cell of any cell that is closer than
+  // band to one.
+  vec3u olo, ohi, wlo, whi;
+
+  for (int d=0; d<3; ++d) {
+    assert(lo[d] <= hi[d] && hi[d] <= this->_dims[d]);
+    olo[d] = lo[d] > band ? lo[d] - band : 0;
+    ohi[d] = std::min(hi[d] + band, this->_dims[d]);
+    wlo[d] = lo[d] > 2*band ? lo[d] - 2*band : 0;
+    whi[d] = std::min(hi[d] + 2*band, this->_dims[d]);
+  }
+
+  DtGrid_t<real> window;
+  window.setNumThreads(_numThreads);
+  window.resize(whi[0]-wlo[0], whi[1]-wlo[1], whi[2]-wlo[2],
+                referenceAxis(), this->_cellSize, vec3(0));
+
+  for (size_t z=wlo[2]; z<whi[2]; ++z) {
+    for (size_t y=wlo[1]; y<whi[1]; ++y) {
+      for (size_t x=wlo[0]; x<whi[0]; ++x) {
+        window._data[window.sub2ind(x-wlo[0], y-wlo[1], z-wlo[2])] =
+          (_data[this->sub2ind(x,y,z)] <= 0 ? 0 : 1);
+      }
+    }
+  }
+
+  window.computeDistsFromBinary(false);
+
+  // a window with no free (or no occupied) cell has distances of
+  // about DT_INF, so both sides are clamped.
+  for (size_t z=olo[2]; z<ohi[2]; ++z) {
+    for (size_t y=olo[1]; y<ohi[1]; ++y) {
+      for (size_t x=olo[0]; x<ohi[0]; ++x) {
+        real d = window._data[window.sub2ind(x-wlo[0], y-wlo[1], z-wlo[2])];
+        _data[this->sub2ind(x,y,z)] = std::max(std::min(d, maxDist), 
+                                               -maxDist);
+      }
+    }
+  }
+
+  // the cells that held the extents may have been overwritten before
+  // this was called, so the extents are found again.
+  recomputeExtents();
+
+  if (_gdata.empty()) { return; }
+
+  // the gradients are differences with the neighbors, so those of
+  // the cells just outside of the rewritten box change too.
+  for (int d=0; d<3; ++d) {
+    if (olo[d] > 0) { --olo[d]; }
+    ohi[d] = std::min(ohi[d] + 1, this->_dims[d]);
+  }
+
+  for (size_t z=olo[2]; z<ohi[2]; ++z) {
+    for (size_t y=olo[1]; y<ohi[1]; ++y) {
+      for (size_t x=olo[0]; x<ohi[0]; ++x) {
+        vec3u s(x,y,z);
+        _gdata[this->sub2ind(s)] = _diffGradient(s);
+      }
+    }
+  }
+
+}
+
+template <class real>
+void DtGrid_t<real>::swapData(DtGrid_t& other) {
+
+  assert(this->dims() == other.dims() && this->layout() == other.layout());
+
+  _detach();
+  other._detach();
+
+  _data.swap(other._data);
+  _gdata.swap(other._gdata);
+  std::swap(_minDist, other._minDist);
+  std::swap(_maxDist, other._maxDist);
+
+  _sync();
+  other._sync();
+
+}
+
 template <class real>
 void DtGrid_t<real>::computeDists(bool storeGradients) {
 
   if (this->empty()) { return; }
 
+  _detach();
+
   // clear min/max dist
   _minDist = DT_INF;
   _maxDist = -DT_INF;
@@ -466,6 +792,7 @@ void DtGrid_t<real>::computeDists(bool storeGradients) {
   }
 
   _gdata.clear();
+  _sync();
 
   if (storeGradients) {
     _createGradients();
@@ -473,53 +800,160 @@ void DtGrid_t<real>::computeDists(bool storeGradients) {
 
 }
 
+template <class real>
+struct DtGrid_t<real>::EDTTask {
+  DtGrid_t<real>* grid;
+  int axis;
+  size_t begin;
+  size_t end;
+};
+
+template <class real>
+void* DtGrid_t<real>::_edtThread(void* arg) {
+  EDTTask* task = (EDTTask*)arg;
+  task->grid->_edtPass(task->axis, task->begin, task->end);
+  return 0;
+}
+
+template <class real>
+void DtGrid_t<real>::setNumThreads(size_t n) { _numThreads = n; }
+
+template <class real>
+size_t DtGrid_t<real>::numThreads() const { return _numThreads; }
+
 template <class real>
 void DtGrid_t<real>::_computeEDT() {
 
-  size_t maxdim = this->_dims.max();
-  RealArray f(maxdim), ft(maxdim), zz(maxdim+1);
-  std::vector<int> v(maxdim);
+  size_t nthreads = _numThreads;
 
-  // along z
-  for (size_t y=0; y<this->ny(); ++y) {
-    for (size_t x=0; x<this->nx(); ++x) {
-      for (size_t z=0; z<this->nz(); ++z) {
-        f[z] = _data[this->sub2ind(x,y,z)];
-        assert(f[z] >= 0);
-      }
-      dt(f, this->nz(), ft, v, zz);
-      for (size_t z=0; z<this->nz(); ++z) {
-        _data[this->sub2ind(x,y,z)] = ft[z];
+  if (!nthreads) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? ncpu : 1;
+  }
+
+  // each pass is split into slabs along z, except the pass along z,
+  // which is split along y. the passes have to be done in order.
+  const int axes[3] = { 2, 1, 0 };
+
+  for (int a=0; a<3; ++a) {
+
+    const int axis = axes[a];
+    const size_t nslabs = (axis == 2) ? this->ny() : this->nz();
+    const size_t nt = std::max(size_t(1), std::min(nthreads, nslabs));
+
+    std::vector<EDTTask> tasks(nt);
+    std::vector<pthread_t> threads(nt);
+    std::vector<bool> started(nt, false);
+
+    for (size_t i=0; i<nt; ++i) {
+      tasks[i].grid = this;
+      tasks[i].axis = axis;
+      tasks[i].begin = (nslabs * i) / nt;
+      tasks[i].end = (nslabs * (i+1)) / nt;
+    }
+
+    // the first slabs are done on this thread, along with those of
+    // any thread that could not be started.
+    for (size_t i=1; i<nt; ++i) {
+      started[i] = (pthread_create(&threads[i], 0, 
+                                   &DtGrid_t<real>::_edtThread,
+                                   &tasks[i]) == 0);
+    }
+
+    _edtThread(&tasks[0]);
+
+    for (size_t i=1; i<nt; ++i) {
+      if (started[i]) { 
+        pthread_join(threads[i], 0); 
+      } else {
+        _edtThread(&tasks[i]);
       }
     }
+
   }
 
-  // along y
-  for (size_t z=0; z<this->nz(); ++z) {
-    for (size_t x=0; x<this->nx(); ++x) {
-      for (size_t y=0; y<this->ny(); ++y) {
-        f[y] = _data[this->sub2ind(x,y,z)];
-        assert(f[y] >= 0);
-      }
-      dt(f, this->ny(), ft, v, zz);
+}
+
+template <class real>
+void DtGrid_t<real>::_edtPass(int axis, size_t begin, size_t end) {
+
+  // lines along x in a linear grid are contiguous, so they are
+  // transformed in place. other lines are strided, so a block of
+  // neighboring lines is copied into a tile, one line per row,
+  // transformed, and copied back. the copies read and write runs of
+  // neighboring cells along x (or y, for lines along x).
+  enum { BLOCK = 16 };
+
+  const size_t n = this->_dims[axis];
+  const int slabAxis = (axis == 2) ? 1 : 2;
+  const int lineAxis = (axis == 0) ? 1 : 0;
+  const size_t nlines = this->_dims[lineAxis];
+
+  real* data = &_data[0];
+
+  RealArray tile(BLOCK*n), ft(n), zz(n+1);
+  IntArray v(n);
+
+  std::vector<size_t> off(n);
+  for (size_t k=0; k<n; ++k) { off[k] = this->axisOffset(axis, k); }
+
+  size_t lines[BLOCK];
+
+  for (size_t slab=begin; slab<end; ++slab) {
+
+    if (axis == 0 && this->_layout == Grid3_t<real>::LAYOUT_LINEAR) {
+
       for (size_t y=0; y<this->ny(); ++y) {
-        _data[this->sub2ind(x,y,z)] = ft[y];
+        real* line = data + this->sub2ind(0,y,slab);
+        for (size_t x=0; x<n; ++x) { assert(line[x] >= 0); }
+        dt(line, n, &ft[0], &v[0], &zz[0]);
+        for (size_t x=0; x<n; ++x) { 
+          line[x] = sqrt(ft[x])*this->_cellSize;
+        }
       }
+
+      continue;
+
     }
-  }
 
-  // along x
-  for (size_t z=0; z<this->nz(); ++z) {
-    for (size_t y=0; y<this->ny(); ++y) {
-      for (size_t x=0; x<this->nx(); ++x) {
-        f[x] = _data[this->sub2ind(x,y,z)];
-        assert(f[x] >= 0);
+    for (size_t l0=0; l0<nlines; l0+=BLOCK) {
+
+      const size_t bn = std::min(size_t(BLOCK), nlines-l0);
+
+      for (size_t b=0; b<bn; ++b) {
+        vec3u s(0);
+        s[slabAxis] = slab;
+        s[lineAxis] = l0 + b;
+        lines[b] = this->sub2ind(s);
       }
-      dt(f, this->nx(), ft, v, zz);
-      for (size_t x=0; x<this->nx(); ++x) {
-        _data[this->sub2ind(x,y,z)] = sqrt(ft[x])*this->_cellSize;
+
+      for (size_t k=0; k<n; ++k) {
+        for (size_t b=0; b<bn; ++b) {
+          assert(data[lines[b] + off[k]] >= 0);
+          tile[b*n + k] = data[lines[b] + off[k]];
+        }
+      }
+
+      for (size_t b=0; b<bn; ++b) {
+        real* row = &tile[b*n];
+        dt(row, n, &ft[0], &v[0], &zz[0]);
+        if (axis == 0) {
+          for (size_t k=0; k<n; ++k) { 
+            row[k] = sqrt(ft[k])*this->_cellSize;
+          }
+        } else {
+          std::copy(ft.begin(), ft.end(), row);
+        }
+      }
+
+      for (size_t k=0; k<n; ++k) {
+        for (size_t b=0; b<bn; ++b) {
+          data[lines[b] + off[k]] = tile[b*n + k];
+        }
       }
+
     }
+
   }
 
 }
@@ -528,18 +962,20 @@ template <class real>
 void DtGrid_t<real>::_createGradients() {
 
   _gdata.clear();
+  _sync();
 
   Vec3Array tmp(this->_size);
     
   for (size_t z=0; z<this->nz(); ++z) {
     for (size_t y=0; y<this->ny(); ++y) {
       for (size_t x=0; x<this->nx(); ++x) {
-        tmp[this->sub2ind(x,y,z)] = gradient(x,y,z);
+        tmp[this->sub2ind(x,y,z)] = _diffGradient(vec3u(x,y,z));
       }
     }
   }
   
   tmp.swap(_gdata);
+  _sync();
 
 }
 
@@ -587,13 +1023,212 @@ void DtGrid_t<real>::scanConvert(const TriMesh3& g,
 }
                      
 
+// squared distance from p to the triangle v, from Ericson's "Real-Time
+// Collision Detection"
+template <class real>
+static real pointTriDist2(const vec3_t<real>& p, const vec3_t<real> v[3]) {
+
+  typedef vec3_t<real> vec3;
+
+  const vec3 ab = v[1] - v[0];
+  const vec3 ac = v[2] - v[0];
+  const vec3 ap = p - v[0];
+
+  real d1 = vec3::dot(ab, ap);
+  real d2 = vec3::dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) { return ap.norm2(); }
+
+  const vec3 bp = p - v[1];
+  real d3 = vec3::dot(ab, bp);
+  real d4 = vec3::dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) { return bp.norm2(); }
+
+  real vc = d1*d4 - d3*d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) {
+    real t = d1 / (d1 - d3);
+    return (ap - t*ab).norm2();
+  }
+
+  const vec3 cp = p - v[2];
+  real d5 = vec3::dot(ab, cp);
+  real d6 = vec3::dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) { return cp.norm2(); }
+
+  real vb = d5*d2 - d1*d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) {
+    real t = d2 / (d2 - d6);
+    return (ap - t*ac).norm2();
+  }
+
+  real va = d3*d6 - d5*d4;
+  if (va <= 0 && (d4 - d3) >= 0 && (d5 - d6) >= 0) {
+    real t = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return (bp - t*(v[2] - v[1])).norm2();
+  }
+
+  real denom = 1 / (va + vb + vc);
+  real t1 = vb * denom;
+  real t2 = vc * denom;
+  return (ap - t1*ab - t2*ac).norm2();
+
+}
+
+// true if the 2D point p is inside the counterclockwise triangle
+// v. points on an edge count for exactly one of the two triangles
+// sharing it, so a column through a shared edge only hits once. to
+// make sure of that, each edge is evaluated in the same direction no
+// matter which triangle it belongs to, so the rounding is the same.
+template <class real>
+static bool insideTri2(const vec2_t<real>& p, const vec2_t<real> v[3]) {
+  for (int i=0; i<3; ++i) {
+    const vec2_t<real>* a = &v[i];
+    const vec2_t<real>* b = &v[(i+1)%3];
+    bool flip = ((*b)[0] < (*a)[0] || 
+                 ((*b)[0] == (*a)[0] && (*b)[1] < (*a)[1]));
+    if (flip) { std::swap(a, b); }
+    real dx = (*b)[0]-(*a)[0], dy = (*b)[1]-(*a)[1];
+    real e = dx*(p[1]-(*a)[1]) - dy*(p[0]-(*a)[0]);
+    if (flip) { e = -e; dx = -dx; dy = -dy; }
+    if (e < 0) { return false; }
+    if (e == 0 && !(dy > 0 || (dy == 0 && dx < 0))) { return false; }
+  }
+  return true;
+}
+
 template <class real>
 void DtGrid_t<real>::_scanConvert(const TriMesh3& g, 
                                   const Transform3* ptx, 
                                   bool asHeightmap) {
 
+  if (this->empty()) { return; }
+
+  _detach();
+
+  typedef HitStruct_t<real> HitStruct;
+  typedef std::vector<HitStruct> HitArray;
+
+  // cells closer than this to the surface get their exact distance,
+  // the same threshold that computeDists uses.
+  const real band = 0.87*this->_cellSize;
+
+  const size_t nu = this->_dims[_ax[0]];
+  const size_t nv = this->_dims[_ax[1]];
+  const size_t nc = this->_dims[_ax[2]];
+
+  // unsigned distance to the surface for the cells near it
+  RealArray near(this->_size, DT_INF);
+
+  // where each column through the cell centers crosses the surface
+  std::vector<HitArray> hits(nu*nv);
+
+  for (size_t f=0; f<g.faces.size(); ++f) {
+
+    vec3 v[3];
+    for (int k=0; k<3; ++k) {
+      v[k] = g.verts[g.faces[f].vidx[k]];
+      if (ptx) { v[k] = ptx->transformFwd(v[k]); }
+    }
+
+    vec3 lo = v[0], hi = v[0];
+    for (int k=1; k<3; ++k) {
+      for (int j=0; j<3; ++j) {
+        lo[j] = std::min(lo[j], v[k][j]);
+        hi[j] = std::max(hi[j], v[k][j]);
+      }
+    }
+
+    // distances for the cells near the triangle
+    vec3u s0 = this->nearestCell(lo - vec3(band));
+    vec3u s1 = this->nearestCell(hi + vec3(band));
+
+    for (size_t z=s0[2]; z<=s1[2]; ++z) {
+      for (size_t y=s0[1]; y<=s1[1]; ++y) {
+        for (size_t x=s0[0]; x<=s1[0]; ++x) {
+          size_t idx = this->sub2ind(x,y,z);
+          real d = sqrt(pointTriDist2(this->cellCenter(x,y,z), v));
+          if (d < band && d < near[idx]) { near[idx] = d; }
+        }
+      }
+    }
+
+    // crossings of the columns under the triangle
+    vec3 n = vec3::cross(v[1]-v[0], v[2]-v[0]);
+    if (!n[_ax[2]]) { continue; }
+
+    vec2 t[3];
+    for (int k=0; k<3; ++k) { t[k] = vec2(v[k][_ax[0]], v[k][_ax[1]]); }
+    if (n[_ax[2]] < 0) { std::swap(t[1], t[2]); }
+
+    vec3u c0 = this->nearestCell(lo);
+    vec3u c1 = this->nearestCell(hi);
+
+    for (size_t cv=c0[_ax[1]]; cv<=c1[_ax[1]]; ++cv) {
+      for (size_t cu=c0[_ax[0]]; cu<=c1[_ax[0]]; ++cu) {
+        vec3u s;
+        s[_ax[0]] = cu;
+        s[_ax[1]] = cv;
+        s[_ax[2]] = 0;
+        vec3 cc = this->cellCenter(s);
+        vec2 p(cc[_ax[0]], cc[_ax[1]]);
+        if (!insideTri2(p, t)) { continue; }
+        HitStruct h;
+        h.height = v[0][_ax[2]] - (n[_ax[0]]*(p[0]-v[0][_ax[0]]) +
+                                   n[_ax[1]]*(p[1]-v[0][_ax[1]])) / n[_ax[2]];
+        // going down through a face that points up enters the solid
+        h.orient = (n[_ax[2]] > 0) ? 1 : -1;
+        hits[cu + cv*nu].push_back(h);
+      }
+    }
+
+  }
+
+  for (size_t cv=0; cv<nv; ++cv) {
+    for (size_t cu=0; cu<nu; ++cu) {
+
+      HitArray& column = hits[cu + cv*nu];
+      std::sort(column.begin(), column.end());
+
+      if (asHeightmap) {
+        _hmap(cu,cv) = column.empty() ? 
+          this->_origin[_ax[2]] : column[0].height;
+      }
+
+      // walk down the column, counting how many times the surface
+      // has been entered
+      int winding = 0;
+      size_t k = 0;
 
-  throw std::runtime_error("_scanConvert not implemented yet");
+      for (size_t c=nc; c-- > 0; ) {
+
+        vec3u s;
+        s[_ax[0]] = cu;
+        s[_ax[1]] = cv;
+        s[_ax[2]] = c;
+
+        size_t idx = this->sub2ind(s);
+        real hc = this->cellCenter(s)[_ax[2]];
+
+        while (k < column.size() && column[k].height > hc) {
+          winding += column[k].orient;
+          ++k;
+        }
+
+        bool inside = asHeightmap ? (k > 0) : (winding > 0);
+        real d = inside ? -near[idx] : near[idx];
+
+        // choose magnitude of smaller and negate if either negative
+        real& cur = _data[idx];
+        bool neg = (d < 0 || cur < 0);
+        cur = std::min(fabs(d), fabs(cur)) * (neg ? -1 : 1);
+
+      }
+
+    }
+  }
+
+  if (asHeightmap) {
+    _hmap.recomputeExtents();
+  }
 
 }
 
@@ -650,21 +1285,25 @@ vec3_t<real> DtGrid_t<real>::heightVec(const vec2u& s) const {
 template <class real>
 void DtGrid_t<real>::recomputeExtents() {
 
-  for (size_t z=0; z<this->nz(); ++z) {
-    for (size_t y=0; y<this->ny(); ++y) {
-      for (size_t x=0; x<this->nx(); ++x) {
-        vec3u s(x,y,z);
-        size_t i = this->sub2ind(s);
-        _minDist = std::min(_data[i], _minDist);
-        _maxDist = std::max(_data[i], _maxDist);
-      }
-    }
+  _minDist = DT_INF;
+  _maxDist = -DT_INF;
+
+  // the order of the cells does not matter here.
+  for (size_t i=0; i<this->_size; ++i) {
+    _minDist = std::min(_dist[i], _minDist);
+    _maxDist = std::max(_dist[i], _maxDist);
   }
 
   _hmap.recomputeExtents();
 
 }
 
+template <class real>
+void DtGrid_t<real>::computeGradients() {
+  _detach();
+  _createGradients();
+}
+
 template <class real>
 real DtGrid_t<real>::minHeight() const { return _hmap.minHeight(); }
 
@@ -686,12 +1325,12 @@ template <class real>
 class LineMin3_t {
 public:
   const vec3u& dims;
-  const std::vector<real>& data;
+  const real* data;
   real& minVal;
   vec3u& minPixel;
   
   LineMin3_t(const vec3u& sz,
-             const std::vector<real>& d,
+             const real* d,
              real& mv, 
              vec3u& mp):
     
@@ -736,9 +1375,9 @@ real DtGrid_t<real>::lineMin(const vec3u& s1, const vec3u& s2, vec3u& minPixel)
   minPixel = s1;
   if (this->empty()) { return 0; }
   
-  real minVal = _data[this->sub2ind(s1)];
+  real minVal = _dist[this->sub2ind(s1)];
 
-  LineMin3_t<real> lm(this->_dims, _data, minVal, minPixel);
+  LineMin3_t<real> lm(this->_dims, _dist, minVal, minPixel);
   
   bresenham3D(s1, s2, lm);
 
@@ -746,6 +1385,48 @@ real DtGrid_t<real>::lineMin(const vec3u& s1, const vec3u& s2, vec3u& minPixel)
 
 }
 
+// the header of files written by saveMappable. the arrays follow it,
+// at the given offsets from the start of the file.
+struct DtGridFileHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t realSize;
+  uint32_t hasGradients;
+  uint32_t ax[3];
+  uint64_t dims[3];
+  uint64_t hdims[2];
+  double   origin[3];
+  double   cellSize;
+  double   minDist;
+  double   maxDist;
+  uint64_t distOffset;
+  uint64_t gradOffset;
+  uint64_t hmapOffset;
+  // added in version 2. it falls in the padding after a version 1
+  // header, which is zero, the linear layout.
+  uint64_t layout;
+};
+
+enum { 
+  DTGRID_MAGIC_SIZE = 8,
+  DTGRID_VERSION = 2,
+  DTGRID_ALIGN = 64
+};
+
+static const char* DTGRID_MAGIC = "MZDTGRID";
+
+static inline uint64_t dtAlign(uint64_t offset) {
+  return (offset + DTGRID_ALIGN - 1) / DTGRID_ALIGN * DTGRID_ALIGN;
+}
+
+// true if the axes are a permutation of 0, 1 and 2, so that they
+// can index the dimensions.
+template <class Tax>
+static bool validAxes(const Tax ax[3]) {
+  return (ax[0] < 3 && ax[1] < 3 && ax[2] < 3 &&
+          ax[0] != ax[1] && ax[1] != ax[2] && ax[0] != ax[2]);
+}
+
 template <class Tval>
 void get(std::istream& istr, Tval& value) {
   if (!istr.read((char*)&value, sizeof(value))) {
@@ -766,6 +1447,16 @@ bool DtGrid_t<real>::load(const char* filename, bool storeGradients) {
   std::ifstream istr(filename);
   if (!istr.is_open()) { return false; }
 
+  char magic[DTGRID_MAGIC_SIZE];
+  if (istr.read(magic, DTGRID_MAGIC_SIZE) && 
+      !memcmp(magic, DTGRID_MAGIC, DTGRID_MAGIC_SIZE)) {
+    istr.close();
+    return _loadMapped(filename, storeGradients);
+  }
+
+  istr.clear();
+  istr.seekg(0);
+
   clear();
 
   try {
@@ -781,7 +1472,7 @@ bool DtGrid_t<real>::load(const char* filename, bool storeGradients) {
     for (int i=0; i<3; ++i) { get(istr, this->_origin[i]); }
     get(istr, this->_cellSize);
     
-    if (this->_size != this->_dims.prod()) { 
+    if (!validAxes(&_ax[0]) || this->_size != this->_dims.prod()) { 
       clear();
       return false; 
     }
@@ -807,6 +1498,7 @@ bool DtGrid_t<real>::load(const char* filename, bool storeGradients) {
     get(istr, _minDist);
     get(istr, _maxDist);
     _hmap.recomputeExtents();
+    _sync();
 
   } catch (...) {
     
@@ -840,8 +1532,12 @@ void DtGrid_t<real>::save(const char* filename) const {
   for (int i=0; i<3; ++i) { put(ostr, this->_origin[i]); }
   put(ostr, this->_cellSize);
 
-  for (size_t i=0; i<this->_size; ++i) {
-    put(ostr, _data[i]);
+  for (size_t z=0; z<this->nz(); ++z) {
+    for (size_t y=0; y<this->ny(); ++y) {
+      for (size_t x=0; x<this->nx(); ++x) {
+        put(ostr, _dist[this->sub2ind(x,y,z)]);
+      }
+    }
   }
 
   for (size_t i=0; i<_hmap.size(); ++i) {
@@ -853,6 +1549,180 @@ void DtGrid_t<real>::save(const char* filename) const {
 
 }
 
+template <class real>
+bool DtGrid_t<real>::_loadMapped(const char* filename, bool storeGradients) {
+
+  clear();
+
+  if (!_file.open(filename)) { return false; }
+
+  const char* base = _file.data();
+  const size_t fsize = _file.size();
+
+  DtGridFileHeader h;
+
+  bool ok = fsize >= sizeof(h);
+
+  if (ok) {
+    memcpy(&h, base, sizeof(h));
+    ok = ((h.version == 1 || h.version == DTGRID_VERSION) && 
+          h.realSize == sizeof(real) && validAxes(h.ax));
+    if (h.version == 1) { h.layout = Grid3_t<real>::LAYOUT_LINEAR; }
+  }
+
+  if (ok) {
+    for (int i=0; i<3; ++i) { 
+      this->_dims[i] = h.dims[i];
+      this->_origin[i] = h.origin[i];
+      _ax[i] = h.ax[i];
+    }
+    this->_size = this->_dims.prod();
+    this->_cellSize = h.cellSize;
+    ok = (h.layout <= Grid3_t<real>::LAYOUT_TILED &&
+          this->_setLayout(Layout(h.layout)));
+    _minDist = h.minDist;
+    _maxDist = h.maxDist;
+
+    const uint64_t hsize = h.hdims[0] * h.hdims[1];
+
+    ok = (ok && this->_size &&
+          h.hdims[0] == this->_dims[_ax[0]] &&
+          h.hdims[1] == this->_dims[_ax[1]] &&
+          h.distOffset % sizeof(real) == 0 &&
+          h.distOffset + this->_size*sizeof(real) <= fsize &&
+          h.hmapOffset + hsize*sizeof(real) <= fsize &&
+          (!h.hasGradients || 
+           (h.gradOffset % sizeof(real) == 0 &&
+            h.gradOffset + this->_size*sizeof(vec3) <= fsize)));
+  }
+
+  if (!ok) { 
+    clear();
+    return false;
+  }
+
+  // the heightmap is small, so it gets copied
+  _hmap.resize(this->_dims[_ax[0]], this->_dims[_ax[1]], 
+               this->_cellSize,
+               vec2(this->_origin[_ax[0]], this->_origin[_ax[1]]));
+
+  memcpy(&_hmap[0], base + h.hmapOffset, _hmap.size()*sizeof(real));
+  _hmap.recomputeExtents();
+
+  _mapGradients = storeGradients;
+  _sync();
+
+  if (storeGradients && !_grad) {
+    _createGradients();
+  }
+
+  return true;
+
+}
+
+template <class real>
+bool DtGrid_t<real>::saveMappable(const char* filename, 
+                                  bool storeGradients) const {
+
+  std::ofstream ostr(filename, std::ios::out | std::ios::binary);
+  if (!ostr.is_open()) { return false; }
+
+  const bool hasGradients = storeGradients && this->_size;
+
+  DtGridFileHeader h;
+  memset(&h, 0, sizeof(h));
+
+  memcpy(h.magic, DTGRID_MAGIC, DTGRID_MAGIC_SIZE);
+  h.version = DTGRID_VERSION;
+  h.realSize = sizeof(real);
+  h.hasGradients = hasGradients;
+  h.layout = this->_layout;
+  
+  for (int i=0; i<3; ++i) {
+    h.ax[i] = _ax[i];
+    h.dims[i] = this->_dims[i];
+    h.origin[i] = this->_origin[i];
+  }
+  h.hdims[0] = this->_dims[_ax[0]];
+  h.hdims[1] = this->_dims[_ax[1]];
+  h.cellSize = this->_cellSize;
+  h.minDist = _minDist;
+  h.maxDist = _maxDist;
+
+  h.distOffset = dtAlign(sizeof(h));
+  h.gradOffset = dtAlign(h.distOffset + this->_size*sizeof(real));
+  h.hmapOffset = dtAlign(h.gradOffset + 
+                         (hasGradients ? this->_size*sizeof(vec3) : 0));
+
+  std::vector<char> pad(DTGRID_ALIGN, 0);
+  uint64_t pos = 0;
+
+  ostr.write((const char*)&h, sizeof(h));
+  pos += sizeof(h);
+
+  ostr.write(&pad[0], h.distOffset - pos);
+  if (this->_size) { 
+    ostr.write((const char*)_dist, this->_size*sizeof(real));
+  }
+  pos = h.distOffset + this->_size*sizeof(real);
+
+  ostr.write(&pad[0], h.gradOffset - pos);
+  pos = h.gradOffset;
+
+  if (hasGradients) {
+    if (_grad) {
+      ostr.write((const char*)_grad, this->_size*sizeof(vec3));
+    } else {
+      for (size_t i=0; i<this->_size; ++i) {
+        vec3 g = gradient(i);
+        ostr.write((const char*)&g, sizeof(vec3));
+      }
+    }
+    pos += this->_size*sizeof(vec3);
+  }
+
+  ostr.write(&pad[0], h.hmapOffset - pos);
+  if (_hmap.size()) {
+    ostr.write((const char*)&_hmap[0], _hmap.size()*sizeof(real));
+  }
+
+  return bool(ostr);
+
+}
+
+template <class real>
+void DtGrid_t<real>::_detach() {
+
+  if (!_file.isOpen()) { return; }
+
+  _data.assign(_dist, _dist + this->_size);
+
+  if (_grad && _gdata.empty()) {
+    _gdata.assign(_grad, _grad + this->_size);
+  }
+
+  _file.close();
+  _sync();
+
+}
+
+template <class real>
+void DtGrid_t<real>::_sync() {
+
+  _dist = _data.empty() ? 0 : &_data[0];
+  _grad = _gdata.empty() ? 0 : &_gdata[0];
+
+  if (_file.isOpen()) {
+    DtGridFileHeader h;
+    memcpy(&h, _file.data(), sizeof(h));
+    _dist = (const real*)(_file.data() + h.distOffset);
+    if (h.hasGradients && _mapGradients) {
+      _grad = (const vec3*)(_file.data() + h.gradOffset);
+    }
+  }
+
+}
+
 template <class real>
 const HeightMap_t<real>& DtGrid_t<real>::heightMap() const { return _hmap; }
 
@@ -954,6 +1824,8 @@ void DtGrid_t<real>::computeDistsFromHeightMap(bool storeGradients) {
   assert( nu == this->_dims[_ax[0]] );
   assert( nv == this->_dims[_ax[1]] );
 
+  _detach();
+
   // for each u,v in heightmap
   for (size_t v=0; v<nv; ++v) {
     for (size_t u=0; u<nu; ++u) {
@@ -1026,4 +1898,41 @@ void DtGrid_t<real>::computeDistsFromHeightMap(bool storeGradients) {
 template class DtGrid_t<float>;
 template class DtGrid_t<double>;
 
+size_t dtGridRealSize(const char* filename) {
+
+  std::ifstream istr(filename, std::ios::in | std::ios::binary);
+  if (!istr.is_open()) { return 0; }
+
+  char magic[DTGRID_MAGIC_SIZE];
+  if (istr.read(magic, DTGRID_MAGIC_SIZE) && 
+      !memcmp(magic, DTGRID_MAGIC, DTGRID_MAGIC_SIZE)) {
+    DtGridFileHeader h;
+    istr.seekg(0);
+    if (!istr.read((char*)&h, sizeof(h))) { return 0; }
+    return h.realSize;
+  }
+
+  // the files written by save have no header, but after the sizes
+  // they only hold reals: the origin, the cell size, the distances,
+  // the heightmap and the extents.
+  istr.clear();
+  istr.seekg(0);
+
+  size_t sizes[8];
+  try {
+    for (int i=0; i<8; ++i) { get(istr, sizes[i]); }
+  } catch (...) {
+    return 0;
+  }
+  const size_t count = sizes[3] + sizes[7] + 6;
+
+  istr.seekg(0, std::ios::end);
+  const size_t bytes = size_t(istr.tellg()) - sizeof(sizes);
+
+  if (bytes == count*sizeof(float)) { return sizeof(float); }
+  if (bytes == count*sizeof(double)) { return sizeof(double); }
+  return 0;
+
+}
+
 
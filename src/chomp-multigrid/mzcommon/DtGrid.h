@@ -39,6 +39,7 @@
 #include "vec2u.h"
 #include "vec2.h"
 #include "HeightMap.h"
+#include "MappedFile.h"
 
 template <class real>
 class DtGrid_t: public Grid3_t<real> {
@@ -53,6 +54,7 @@ public:
   typedef std::vector<vec3>  Vec3Array;
   typedef std::vector<int>   IntArray;
   typedef std::vector<bool>  BoolArray;
+  typedef typename Grid3_t<real>::Layout Layout;
 
   static const real DT_INF;
 
@@ -66,8 +68,12 @@ public:
 
   DtGrid_t();
 
+  DtGrid_t(const DtGrid_t& other);
+
   ~DtGrid_t();
 
+  DtGrid_t& operator=(const DtGrid_t& other);
+
   //////////////////////////////////////////////////////////////////////
 
   const vec3u& referenceAxes() const;
@@ -76,14 +82,17 @@ public:
 
   void clear();
 
+  // a tiled layout rounds the dims up to whole tiles, see Grid3_t.
   void resize(size_t nx, size_t ny, size_t nz, 
               Axis referenceAxis,
-              real cellSize, const vec3& origin);
+              real cellSize, const vec3& origin,
+              Layout layout=Grid3_t<real>::LAYOUT_LINEAR);
 
   void resize(const vec3& min,
               const vec3& max,
               Axis referenceAxis,
-              real cellSize);
+              real cellSize,
+              Layout layout=Grid3_t<real>::LAYOUT_LINEAR);
   //////////////////////////////////////////////////////////////////////
 
   const real& operator[](size_t idx) const;
@@ -112,8 +121,25 @@ public:
 
   real sample(const vec3& v) const;
 
+  // when the gradients are not stored, the gradient is that of the
+  // trilinear interpolation of the 8 cells around v, instead of the
+  // interpolation of the gradients at those cells.
   real sample(const vec3& v, vec3& gradient) const;
 
+  // the gradient of the trilinear interpolation of the 8 corner
+  // values c, given in the order (0,0,0), (0,0,1), (0,1,0), ...
+  // (1,1,1), with the weights alpha[0] and alpha[1] of the low and
+  // high corner along each axis. axes with no step have no gradient.
+  static vec3 cornerGradient(const real c[8], const vec3 alpha[2],
+                             const vec3u& step, real invCS);
+
+  // samples n points at once, given as separate x, y and z arrays,
+  // storing the values in f and the gradients in gx, gy and gz. The
+  // gradient arrays may all be NULL. Gives the same results as
+  // calling sample on each point.
+  void sample(size_t n, const real* x, const real* y, const real* z,
+              real* f, real* gx, real* gy, real* gz) const;
+
   // returns the position of minimum value along the line connecting
   // s1 and s2
   real lineMin(const vec3u& s1, const vec3u& s2, vec3u& smin) const;
@@ -164,25 +190,102 @@ public:
 
   void computeDistsFromBinary(bool storeGradients=true);
 
+  // recomputes the distances around the box of cells [lo, hi) after
+  // its occupancy has been changed by writing a value <= 0 (occupied)
+  // or > 0 (free) into its cells, as for computeDistsFromBinary. the
+  // occupancy of every other cell is the sign of its distance. only
+  // the cells within band cells of the box are rewritten, so
+  // afterwards every distance of less than band cells is exact, and
+  // the others are still at least band cells. the rewritten distances
+  // are clamped to [-maxDist, maxDist]. the extents are found again
+  // by a pass over every cell.
+  void updateDistsFromBinary(const vec3u& lo, const vec3u& hi,
+                             size_t band, real maxDist=DT_INF);
+
+  // exchanges the distances, gradients and extents with those of a
+  // grid of the same dimensions and layout, without copying them.
+  // mapped grids are copied into memory first.
+  void swapData(DtGrid_t& other);
+
+  // sets the extents to the smallest and largest distances.
   void recomputeExtents();
 
+  // stores the gradients of distances that were written directly
+  // through operator(), instead of by one of the computeDists calls.
+  void computeGradients();
+
+  // the number of threads used to compute distance transforms. 0
+  // (the default) means one per online processor. the result does
+  // not depend on the number of threads.
+  void setNumThreads(size_t n);
+  size_t numThreads() const;
+
   static void dt(const RealArray& f,
                  size_t n,
                  RealArray& ft,
                  IntArray& v,
                  RealArray& z);
 
+  // same as above, on raw arrays. z must hold n+1 values.
+  static void dt(const real* f,
+                 size_t n,
+                 real* ft,
+                 int* v,
+                 real* z);
+
+  // loads either format written below. files written by
+  // saveMappable are mapped into memory instead of being read, so
+  // loading them costs almost nothing, and the pages are shared with
+  // any other process that maps the same file.
   bool load(const char* filename, bool storeGradients=true);
   void save(const char* filename) const;
+
+  // saves a file that load can map directly: a fixed header followed
+  // by the distances, optionally the gradients, and the heightmap,
+  // each aligned to 64 bytes. the file is in native byte order and
+  // is only readable by a DtGrid with the same real type. the cells
+  // are stored in the layout of the grid, which a mapped grid keeps;
+  // save always writes them in the linear layout.
+  bool saveMappable(const char* filename, bool storeGradients=true) const;
+
+  // true if the distances are being read out of a mapped file. any
+  // non-const access to the distances copies them into memory first.
+  bool isMapped() const;
+
+  // true if the gradients are stored, in memory or in a mapped file.
+  // without them, a grid takes a quarter of the memory. load ignores
+  // the gradients in a file if storeGradients is false.
+  bool hasGradients() const;
    
 private:
 
   void _create();
   void _createGradients();
+
+  // the central difference of the distances around s, ignoring any
+  // stored gradients
+  vec3 _diffGradient(vec3u s) const;
   void _computeEDT();
+
+  struct EDTTask;
+
+  // runs the 1D transform along one axis for the lines in slabs
+  // [begin, end) of the outermost other axis
+  void _edtPass(int axis, size_t begin, size_t end);
+
+  static void* _edtThread(void* arg);
+
+  bool _loadMapped(const char* filename, bool storeGradients);
+
+  // copies the mapped data into _data and _gdata and drops the mapping
+  void _detach();
+
+  // points _dist and _grad at wherever the data currently lives
+  void _sync();
   
   real _sample(const vec3& v, vec3* gradient) const;
 
+
   void _scanConvert(const TriMesh3& model, 
                     const Transform3* transform,
                     bool asHeightmap);
@@ -194,9 +297,21 @@ private:
   // gradient data
   Vec3Array _gdata;
 
+  // the file that the data was mapped from, if any, and the arrays
+  // that the const accessors read from: either the mapping or the
+  // two arrays above. _grad is NULL if there are no stored gradients.
+  MappedFile  _file;
+  const real* _dist;
+  const vec3* _grad;
+
+  // false if the gradients in the mapped file are not used
+  bool _mapGradients;
+
   real _minDist;
   real _maxDist;
 
+  size_t _numThreads;
+
   // heightmap data
   HeightMap _hmap;
 
@@ -205,4 +320,8 @@ private:
 typedef DtGrid_t<float> DtGridf;
 typedef DtGrid_t<double> DtGridd;
 
+// the size of the real type that a file written by DtGrid_t::save or
+// saveMappable holds, or 0 if it is not a distance field.
+size_t dtGridRealSize(const char* filename);
+
 #endif
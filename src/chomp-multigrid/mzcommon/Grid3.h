@@ -44,6 +44,22 @@ public:
   typedef vec3_t<real> vec3;
   typedef Box3_t<real> Box3;
 
+  // the order of the cells in memory. LAYOUT_LINEAR is x fastest,
+  // then y, then z. LAYOUT_TILED stores the grid as 4x4x4 tiles in
+  // that order, each tile x fastest, so the neighbors of a cell are
+  // usually on the same few cache lines. a tiled grid has dims that
+  // are multiples of TILE_SIZE.
+  enum Layout {
+    LAYOUT_LINEAR = 0,
+    LAYOUT_TILED = 1
+  };
+
+  enum {
+    TILE_BITS = 2,
+    TILE_SIZE = 1 << TILE_BITS,
+    TILE_MASK = TILE_SIZE - 1
+  };
+
   Grid3_t() { _clear(); }
 
   const vec3u& dims() const { return _dims; }
@@ -58,6 +74,8 @@ public:
 
   bool empty() const { return !_size; }
 
+  Layout layout() const { return _layout; }
+
 
   Box3 bbox() const {
     Box3 rval;
@@ -121,15 +139,46 @@ public:
   }
 
   size_t sub2ind(const vec3u& s) const {
-    return vec3u::sub2ind(_dims, s);
+    return sub2ind(s[0], s[1], s[2]);
   }
 
   size_t sub2ind(size_t x, size_t y, size_t z) const {
-    return vec3u::sub2ind(_dims, x, y, z);
+    if (_layout == LAYOUT_LINEAR) {
+      return vec3u::sub2ind(_dims, x, y, z);
+    }
+    const size_t tile = ((z >> TILE_BITS)*_tdims[1] 
+                         + (y >> TILE_BITS))*_tdims[0] 
+      + (x >> TILE_BITS);
+    return (tile << (3*TILE_BITS))
+      | (((((z & TILE_MASK) << TILE_BITS)
+           | (y & TILE_MASK)) << TILE_BITS)
+         | (x & TILE_MASK));
   }
   
+  // in either layout, sub2ind(x,y,z) is axisOffset(0,x) +
+  // axisOffset(1,y) + axisOffset(2,z), so a neighbor along one axis
+  // is a fixed distance away for every cell with the same coordinate
+  // along that axis.
+  size_t axisOffset(int axis, size_t s) const {
+    if (_layout == LAYOUT_LINEAR) {
+      return s * (axis == 0 ? 1 : axis == 1 ? _dims[0] : _dims[0]*_dims[1]);
+    }
+    const size_t tstride = (axis == 0 ? 1 : 
+                            axis == 1 ? _tdims[0] : _tdims[0]*_tdims[1]);
+    return ((s >> TILE_BITS)*tstride << (3*TILE_BITS))
+      + ((s & TILE_MASK) << (axis*TILE_BITS));
+  }
+
   vec3u ind2sub(size_t idx) const {
-    return vec3u::ind2sub(_dims, idx); 
+    if (_layout == LAYOUT_LINEAR) {
+      return vec3u::ind2sub(_dims, idx); 
+    }
+    vec3u s = vec3u::ind2sub(_tdims, idx >> (3*TILE_BITS));
+    for (int i=0; i<3; ++i) {
+      s[i] = (s[i] << TILE_BITS) 
+        | ((idx >> (i*TILE_BITS)) & TILE_MASK);
+    }
+    return s;
   }
 
   void sampleCoeffs(const vec3& pos,
@@ -195,6 +244,8 @@ protected:
 
   void _clear() {
     _dims = vec3u(0);
+    _tdims = vec3u(0);
+    _layout = LAYOUT_LINEAR;
     _size = 0;
     _origin = vec3(0);
     _cellSize = 0;
@@ -210,22 +261,45 @@ protected:
     return s;
   }
 
-  // straightforward
+  // straightforward, except that a tiled grid rounds the dims up to
+  // whole tiles.
   void _resize(const vec3u& dims, 
                real cellSize,
-               const vec3& origin) {
+               const vec3& origin,
+               Layout layout=LAYOUT_LINEAR) {
     _clear();
-    _size = dims.prod();
-    if (!_size) { return; }
+    if (!dims.prod()) { return; }
     _dims = dims;
+    if (layout == LAYOUT_TILED) {
+      for (int i=0; i<3; ++i) {
+        _dims[i] = (dims[i] + TILE_MASK) & ~size_t(TILE_MASK);
+      }
+    }
+    _size = _dims.prod();
     _cellSize = cellSize;
     _origin = origin;
     _box = bbox(); 
+    _setLayout(layout);
   }
 
   void _resize(size_t nx, size_t ny, size_t nz,
-               real cellSize, const vec3& origin) {
-    _resize(vec3u(nx, ny, nz), cellSize, origin);
+               real cellSize, const vec3& origin,
+               Layout layout=LAYOUT_LINEAR) {
+    _resize(vec3u(nx, ny, nz), cellSize, origin, layout);
+  }
+
+  // sets the layout of a grid whose dims are already set. returns
+  // false if the dims are not whole tiles.
+  bool _setLayout(Layout layout) {
+    _layout = LAYOUT_LINEAR;
+    _tdims = vec3u(0);
+    if (layout == LAYOUT_LINEAR) { return true; }
+    for (int i=0; i<3; ++i) {
+      if (_dims[i] & TILE_MASK) { return false; }
+      _tdims[i] = _dims[i] >> TILE_BITS;
+    }
+    _layout = layout;
+    return true;
   }
     
   // automatically computes origin and dims so that the bottom left
@@ -233,7 +307,8 @@ protected:
   // the center of this is the center of min and max
   void _resize(const vec3& min,
                const vec3& max,
-               real cellSize) {
+               real cellSize,
+               Layout layout=LAYOUT_LINEAR) {
     _clear();
     vec3u dims;
     vec3  origin;
@@ -244,7 +319,7 @@ protected:
       dims[i] = size_t(ceil(f));
       origin[i] = center[i] - real(0.5)*cellSize*dims[i];
     }
-    _resize(dims, cellSize, origin);
+    _resize(dims, cellSize, origin, layout);
   }
 
   void _resize(const Box3& bbox, real cellSize) {
@@ -253,6 +328,11 @@ protected:
   
   vec3u  _dims;
   size_t _size;
+  Layout _layout;
+
+  // the number of tiles along each axis, if the grid is tiled
+  vec3u  _tdims;
+
   vec3   _origin;
   real   _cellSize;
   Box3   _box;
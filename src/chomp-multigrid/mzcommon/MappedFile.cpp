@@ -0,0 +1,71 @@
+#include "MappedFile.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(): _map(0) {}
+
+MappedFile::MappedFile(const MappedFile& other): _map(other._map) {
+  if (_map) { ++_map->refs; }
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+MappedFile& MappedFile::operator=(const MappedFile& other) {
+  if (other._map) { ++other._map->refs; }
+  close();
+  _map = other._map;
+  return *this;
+}
+
+bool MappedFile::open(const char* filename) {
+
+  close();
+
+  int fd = ::open(filename, O_RDONLY);
+  if (fd < 0) { return false; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    ::close(fd);
+    return false;
+  }
+
+  void* addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+  // the mapping stays valid after the descriptor is closed
+  ::close(fd);
+
+  if (addr == MAP_FAILED) { return false; }
+
+  _map = new Mapping;
+  _map->addr = addr;
+  _map->size = st.st_size;
+  _map->refs = 1;
+
+  return true;
+
+}
+
+void MappedFile::close() {
+  if (_map && --_map->refs == 0) {
+    munmap(_map->addr, _map->size);
+    delete _map;
+  }
+  _map = 0;
+}
+
+const char* MappedFile::data() const {
+  return _map ? (const char*)_map->addr : 0;
+}
+
+size_t MappedFile::size() const {
+  return _map ? _map->size : 0;
+}
+
+bool MappedFile::isOpen() const {
+  return _map != 0;
+}
@@ -0,0 +1,42 @@
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <stddef.h>
+
+// A read-only memory mapping of a whole file. Copies share the same
+// mapping, which is unmapped when the last copy goes away. The
+// reference count is not atomic, so copies should not be made or
+// destroyed concurrently.
+class MappedFile {
+public:
+
+  MappedFile();
+  MappedFile(const MappedFile& other);
+  ~MappedFile();
+
+  MappedFile& operator=(const MappedFile& other);
+
+  // maps the file, replacing any previous mapping. returns false
+  // (and holds no mapping) if the file cannot be mapped.
+  bool open(const char* filename);
+
+  void close();
+
+  const char* data() const;
+  size_t size() const;
+
+  bool isOpen() const;
+
+private:
+
+  struct Mapping {
+    void* addr;
+    size_t size;
+    int refs;
+  };
+
+  Mapping* _map;
+
+};
+
+#endif
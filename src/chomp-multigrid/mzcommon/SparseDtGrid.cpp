@@ -0,0 +1,266 @@
+#include "SparseDtGrid.h"
+#include <algorithm>
+#include <assert.h>
+
+template <class real>
+SparseDtGrid_t<real>::SparseDtGrid_t() {
+  clear();
+}
+
+template <class real>
+void SparseDtGrid_t<real>::clear() {
+  this->_clear();
+  _bdims = vec3u(0);
+  _table.clear();
+  _bricks.clear();
+  _qbricks.clear();
+  _numBricks = 0;
+  _quantized = false;
+  _step = 0;
+  _band = 0;
+  _minDist = DtGrid::DT_INF;
+  _maxDist = -DtGrid::DT_INF;
+}
+
+template <class real>
+void SparseDtGrid_t<real>::build(const DtGrid& grid, real band,
+                                 bool quantize) {
+
+  clear();
+
+  this->_resize(grid.dims(), grid.cellSize(), grid.origin());
+  if (this->empty()) { return; }
+
+  _band = band;
+  _minDist = std::min(grid.minDist(), band);
+  _maxDist = std::min(grid.maxDist(), band);
+
+  _quantized = quantize;
+  if (_quantized) {
+    _step = std::max(band - _minDist, real(0)) / 65535;
+  }
+
+  for (int j=0; j<3; ++j) {
+    _bdims[j] = (this->_dims[j] + BRICK_MASK) >> BRICK_BITS;
+  }
+
+  _table.resize(_bdims.prod(), -1);
+
+  for (size_t bz=0; bz<_bdims[2]; ++bz) {
+    for (size_t by=0; by<_bdims[1]; ++by) {
+      for (size_t bx=0; bx<_bdims[0]; ++bx) {
+
+        const vec3u p0(bx << BRICK_BITS, by << BRICK_BITS, bz << BRICK_BITS);
+        vec3u p1;
+        for (int j=0; j<3; ++j) {
+          p1[j] = std::min(p0[j] + BRICK_SIZE, this->_dims[j]);
+        }
+
+        bool keep = false;
+        for (size_t z=p0[2]; z<p1[2] && !keep; ++z) {
+          for (size_t y=p0[1]; y<p1[1] && !keep; ++y) {
+            for (size_t x=p0[0]; x<p1[0] && !keep; ++x) {
+              keep = grid(x,y,z) < band;
+            }
+          }
+        }
+
+        if (!keep) { continue; }
+
+        const size_t brick = _numBricks++;
+        _table[(bz*_bdims[1] + by)*_bdims[0] + bx] = int32_t(brick);
+
+        // cells past the edge of the grid are never read, but they
+        // are given the far value anyway.
+        if (_quantized) {
+          _qbricks.resize(_numBricks*BRICK_CELLS, 65535);
+        } else {
+          _bricks.resize(_numBricks*BRICK_CELLS, band);
+        }
+
+        for (size_t z=p0[2]; z<p1[2]; ++z) {
+          for (size_t y=p0[1]; y<p1[1]; ++y) {
+            for (size_t x=p0[0]; x<p1[0]; ++x) {
+              const size_t idx = brick*BRICK_CELLS + _cellOffset(x,y,z);
+              const real d = std::min(grid(x,y,z), band);
+              if (!_quantized) {
+                _bricks[idx] = d;
+              } else if (_step > 0) {
+                _qbricks[idx] = uint16_t(std::min(real(65535),
+                                                  (d - _minDist)/_step
+                                                  + real(0.5)));
+              } else {
+                _qbricks[idx] = 0;
+              }
+            }
+          }
+        }
+
+      }
+    }
+  }
+
+}
+
+template <class real>
+size_t SparseDtGrid_t<real>::memoryUsage() const {
+  return (_table.size()*sizeof(int32_t) + _bricks.size()*sizeof(real)
+          + _qbricks.size()*sizeof(uint16_t));
+}
+
+template <class real>
+real SparseDtGrid_t<real>::operator()(size_t x, size_t y, size_t z) const {
+
+  const int32_t brick = _table[((z >> BRICK_BITS)*_bdims[1]
+                                + (y >> BRICK_BITS))*_bdims[0]
+                               + (x >> BRICK_BITS)];
+
+  if (brick < 0) { return _band; }
+
+  const size_t idx = size_t(brick)*BRICK_CELLS + _cellOffset(x,y,z);
+
+  if (_quantized) { return _minDist + _qbricks[idx]*_step; }
+
+  return _bricks[idx];
+
+}
+
+template <class real>
+real SparseDtGrid_t<real>::operator()(const vec3u& s) const {
+  return (*this)(s[0], s[1], s[2]);
+}
+
+// the same differences as DtGrid_t::gradient
+template <class real>
+vec3_t<real> SparseDtGrid_t<real>::gradient(vec3u s) const {
+
+  vec3 g(0);
+  if (!this->_size) { return g; }
+
+  real vcur = (*this)(s);
+  real invCS = 1/this->_cellSize;
+
+  for (int d=0; d<3; ++d) {
+
+    if (this->_dims[d] == 1) { continue; }
+
+    if (s[d] > 0) {
+
+      --s[d];
+      real vprev = (*this)(s);
+      ++s[d];
+
+      if (s[d]+1 < this->_dims[d]) {
+
+        ++s[d];
+        real vnext = (*this)(s);
+        --s[d];
+
+        g[d] = (vnext-vprev) * invCS * 0.5f;
+
+      } else {
+
+        g[d] = (vcur-vprev) * invCS;
+
+      }
+
+    } else {
+
+      assert( s[d]+1 < this->_dims[d] );
+
+      ++s[d];
+      real vnext = (*this)(s);
+      --s[d];
+
+      g[d] = (vnext-vcur) * invCS;
+
+    }
+
+  }
+
+  return g;
+
+}
+
+// the same interpolation as DtGrid_t::_sample without stored gradients
+template <class real>
+real SparseDtGrid_t<real>::_sample(const vec3& v, vec3* grad) const {
+
+  vec3u fs = this->floorCell(v);
+  vec3 fv = this->cellCenter(fs);
+
+  vec3u lo;
+  vec3u step;
+  vec3 alpha[2];
+
+  real invCS = 1/this->_cellSize;
+
+  for (int j=0; j<3; ++j) {
+    lo[j] = this->_dims[j] > 1 ? std::min(fs[j], this->_dims[j]-2) : 0;
+    step[j] = this->_dims[j] > 1 ? 1 : 0;
+    alpha[0][j] = lo[j] == fs[j] ? 1.0 : 0.0;
+    alpha[1][j] = 1 - alpha[0][j];
+    if (v[j] >= fv[j]) {
+      real diff = v[j] - fv[j];
+      if (diff < this->_cellSize && fs[j] + 1 < this->_dims[j]) {
+        real u = diff * invCS;
+        alpha[0][j] = 1.0f-u;
+        alpha[1][j] = u;
+      }
+    }
+  }
+
+  real f=0;
+  real c[8];
+
+  for (int i=0; i<8; ++i) {
+    const vec3u d((i>>2)&1, (i>>1)&1, i&1);
+    vec3u s = lo;
+    real coeff = 1.0f;
+    for (int j=0; j<3; ++j) {
+      s[j] += d[j]*step[j];
+      coeff *= alpha[d[j]][j];
+    }
+    c[i] = (*this)(s);
+    f += coeff * c[i];
+  }
+
+  if (grad) { *grad = DtGrid::cornerGradient(c, alpha, step, invCS); }
+
+  return f;
+
+}
+
+template <class real>
+real SparseDtGrid_t<real>::sample(const vec3& v) const {
+  return _sample(v, 0);
+}
+
+template <class real>
+real SparseDtGrid_t<real>::sample(const vec3& v, vec3& gradient) const {
+  return _sample(v, &gradient);
+}
+
+template <class real>
+void SparseDtGrid_t<real>::sample(size_t n,
+                                  const real* x, const real* y, const real* z,
+                                  real* f,
+                                  real* gx, real* gy, real* gz) const {
+
+  for (size_t i=0; i<n; ++i) {
+    const vec3 v(x[i], y[i], z[i]);
+    if (gx) {
+      vec3 g;
+      f[i] = _sample(v, &g);
+      gx[i] = g[0];
+      gy[i] = g[1];
+      gz[i] = g[2];
+    } else {
+      f[i] = _sample(v, 0);
+    }
+  }
+
+}
+
+template class SparseDtGrid_t<float>;
+template class SparseDtGrid_t<double>;
@@ -0,0 +1,107 @@
+#ifndef _SPARSEDTGRID_H_
+#define _SPARSEDTGRID_H_
+
+#include "DtGrid.h"
+#include <stdint.h>
+
+// A read-only copy of the distances in a DtGrid that only keeps the
+// cells near the surface. The grid is split into bricks of 8x8x8
+// cells, and only the bricks with a cell closer than the band (or
+// inside an object) are stored. Every other cell reads as the band,
+// so this is the same as a DtGrid holding min(dist, band), and it
+// samples the same way as one without stored gradients: the gradient
+// is that of the trilinear interpolation.
+//
+// The bricks can also be quantized to 16 bits, spread evenly between
+// the smallest distance and the band, which uses a quarter of the
+// memory of double cells at an error of at most half a step.
+template <class real>
+class SparseDtGrid_t: public Grid3_t<real> {
+public:
+
+  typedef DtGrid_t<real> DtGrid;
+  typedef vec3_t<real>   vec3;
+
+  enum {
+    BRICK_BITS = 3,
+    BRICK_SIZE = 1 << BRICK_BITS,
+    BRICK_MASK = BRICK_SIZE - 1,
+    BRICK_CELLS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE
+  };
+
+  SparseDtGrid_t();
+
+  void clear();
+
+  // copies the bricks of grid that have a cell closer than band.
+  void build(const DtGrid& grid, real band, bool quantize=false);
+
+  real band() const { return _band; }
+
+  bool isQuantized() const { return _quantized; }
+
+  // the largest error that quantizing added to a stored cell
+  real quantizationError() const { return _quantized ? _step/2 : 0; }
+
+  real minDist() const { return _minDist; }
+  real maxDist() const { return _maxDist; }
+
+  size_t numBricks() const { return _numBricks; }
+
+  // bytes used by the brick table and the bricks
+  size_t memoryUsage() const;
+
+  real operator()(size_t x, size_t y, size_t z) const;
+
+  real operator()(const vec3u& s) const;
+
+  vec3 gradient(vec3u s) const;
+
+  real sample(const vec3& v) const;
+
+  real sample(const vec3& v, vec3& gradient) const;
+
+  // same as DtGrid_t::sample for n points at once. the gradient
+  // arrays may all be NULL.
+  void sample(size_t n, const real* x, const real* y, const real* z,
+              real* f, real* gx, real* gy, real* gz) const;
+
+private:
+
+  real _sample(const vec3& v, vec3* grad) const;
+
+  // the offset of a cell within its brick
+  static size_t _cellOffset(size_t x, size_t y, size_t z) {
+    return ((((z & BRICK_MASK) << BRICK_BITS)
+             | (y & BRICK_MASK)) << BRICK_BITS)
+      | (x & BRICK_MASK);
+  }
+
+  // the number of bricks along each axis
+  vec3u _bdims;
+
+  // the index of each brick in _bricks, or -1 if it is not stored
+  std::vector<int32_t> _table;
+
+  // the cells of the stored bricks, x fastest within a brick. Only
+  // one of these is used, depending on whether the grid is quantized.
+  std::vector<real> _bricks;
+  std::vector<uint16_t> _qbricks;
+
+  size_t _numBricks;
+
+  bool _quantized;
+
+  // a quantized cell holds (dist - _minDist) / _step
+  real _step;
+
+  real _band;
+  real _minDist;
+  real _maxDist;
+
+};
+
+typedef SparseDtGrid_t<float> SparseDtGridf;
+typedef SparseDtGrid_t<double> SparseDtGridd;
+
+#endif
@@ -0,0 +1,440 @@
+/*
+* Copyright (c) 2008-2014, Matt Zucker
+*
+* This file is provided under the following "BSD-style" License:
+*
+* Redistribution and use in source and binary forms, with or
+* without modification, are permitted provided that the following
+* conditions are met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+* USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+* AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+* ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+* POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+
+#include "DtGrid.h"
+#include "SparseDtGrid.h"
+#include "TimeUtil.h"
+#include "mersenne.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <iostream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+// times sampling a distance field stored in the linear and the tiled
+// layout, on the same queries, and counts the cache misses of each
+// where the kernel allows it. first checks that updating the
+// distances around a few changed cells gives the same distances as
+// computing the whole field again, and that a sparse copy of the
+// field samples the same as the dense one, and exits with 1 if not.
+//
+// usage: dtbench [grid.dt [trace.txt]]
+//
+// without a grid, a 192^3 field around a few random spheres is used.
+// the trace holds one query per line, "x y z" in the frame of the
+// grid. without one, there are two sets of queries: spheres spaced
+// along random links, in the order that a collision check visits
+// them, and the same number of uniformly random points.
+
+// counts one kind of hardware event for this thread
+class EventCounter {
+public:
+
+  EventCounter(uint32_t type, uint64_t config): fd(-1) {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~EventCounter() { if (fd >= 0) { close(fd); } }
+
+  bool valid() const { return fd >= 0; }
+
+  void start() {
+#ifdef __linux__
+    if (fd < 0) { return; }
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+  }
+
+  long long stop() {
+    long long count = -1;
+#ifdef __linux__
+    if (fd < 0) { return count; }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) { count = -1; }
+#endif
+    return count;
+  }
+
+private:
+
+  int fd;
+
+};
+
+typedef std::vector<double> RealArray;
+
+static void makeField(DtGridd& grid, size_t N=192) {
+
+  enum { NSPHERES = 12 };
+
+  grid.resize(N, N, N, DtGridd::AXIS_Z, 1.0/N, vec3d(0));
+
+  vec3d centers[NSPHERES];
+  double radii[NSPHERES];
+  for (int i=0; i<NSPHERES; ++i) {
+    centers[i] = vec3d(mt_genrand_real1(), mt_genrand_real1(),
+                       mt_genrand_real1());
+    radii[i] = 0.03 + 0.1*mt_genrand_real1();
+  }
+
+  for (size_t z=0; z<grid.nz(); ++z) {
+    for (size_t y=0; y<grid.ny(); ++y) {
+      for (size_t x=0; x<grid.nx(); ++x) {
+        const vec3d c = grid.cellCenter(x,y,z);
+        bool occupied = false;
+        for (int i=0; i<NSPHERES && !occupied; ++i) {
+          occupied = (c - centers[i]).norm() < radii[i];
+        }
+        grid(x,y,z) = occupied ? 0 : 1;
+      }
+    }
+  }
+
+  grid.computeDistsFromBinary(false);
+
+}
+
+// occupies a box of cells in a field, updates the distances around
+// it, and compares them with computing the whole field again. every
+// distance of less than band cells has to be the same, and the others
+// at least band cells.
+static bool checkUpdate() {
+
+  enum { N = 64, BAND = 5 };
+
+  DtGridd updated;
+  makeField(updated, N);
+
+  const vec3u lo(N/3, N/4, N/2), hi(N/3 + 6, N/4 + 9, N/2 + 4);
+  for (size_t z=lo[2]; z<hi[2]; ++z) {
+    for (size_t y=lo[1]; y<hi[1]; ++y) {
+      for (size_t x=lo[0]; x<hi[0]; ++x) {
+        updated(x,y,z) = 0;
+      }
+    }
+  }
+
+  DtGridd full;
+  full.resize(N, N, N, DtGridd::AXIS_Z, updated.cellSize(), vec3d(0));
+  for (size_t i=0; i<full.size(); ++i) {
+    full[i] = updated[i] <= 0 ? 0 : 1;
+  }
+  full.computeDistsFromBinary(false);
+
+  const double band = BAND * updated.cellSize();
+  updated.updateDistsFromBinary(lo, hi, BAND, band);
+
+  double maxDiff = 0;
+  size_t tooClose = 0;
+  for (size_t i=0; i<full.size(); ++i) {
+    if (fabs(full[i]) < band) {
+      maxDiff = std::max(maxDiff, fabs(updated[i] - full[i]));
+    } else if (fabs(updated[i]) < band * (1 - 1e-9)) {
+      ++tooClose;
+    }
+  }
+
+  const bool ok = maxDiff <= 1e-9 && tooClose == 0;
+  printf("update: largest difference within the band: %g, "
+         "cells wrongly inside of it: %d%s\n", maxDiff, int(tooClose),
+         ok ? "" : " FAILED");
+
+  return ok;
+
+}
+
+static void makeQueries(const DtGridd& grid, bool links,
+                        RealArray& x, RealArray& y, RealArray& z) {
+
+  enum { NLINKS = 20000, NPERLINK = 16 };
+
+  const DtGridd::Box3 box = grid.bbox();
+  const vec3d size = box.p1 - box.p0;
+  const double length = 0.3 * std::min(size[0], std::min(size[1], size[2]));
+
+  for (int i=0; i<NLINKS && links; ++i) {
+    vec3d dir(mt_genrand_real1()-0.5, mt_genrand_real1()-0.5,
+              mt_genrand_real1()-0.5);
+    dir = dir / std::max(dir.norm(), 1e-9);
+    vec3d p0;
+    for (int j=0; j<3; ++j) {
+      p0[j] = box.p0[j] + length + (size[j] - 2*length)*mt_genrand_real1();
+    }
+    for (int k=0; k<NPERLINK; ++k) {
+      const vec3d p = p0 + dir * (length * k / (NPERLINK-1));
+      x.push_back(p[0]);
+      y.push_back(p[1]);
+      z.push_back(p[2]);
+    }
+  }
+
+  for (int i=0; i<NLINKS*NPERLINK && !links; ++i) {
+    x.push_back(box.p0[0] + size[0]*mt_genrand_real1());
+    y.push_back(box.p0[1] + size[1]*mt_genrand_real1());
+    z.push_back(box.p0[2] + size[2]*mt_genrand_real1());
+  }
+
+}
+
+// builds a sparse copy of grid and compares it with a dense grid
+// holding min(dist, band): every cell, and the distances and
+// gradients sampled at the queries inside of the grid. a quantized
+// copy may be off by its quantization error at every cell, and so
+// by twice that over a cell in the gradients.
+static bool checkSparse(const DtGridd& grid, bool quantize,
+                        const RealArray& x, const RealArray& y,
+                        const RealArray& z) {
+
+  const double band = 8 * grid.cellSize();
+
+  SparseDtGridd sparse;
+  sparse.build(grid, band, quantize);
+
+  DtGridd clamped;
+  clamped.resize(grid.nx(), grid.ny(), grid.nz(), grid.referenceAxis(),
+                 grid.cellSize(), grid.origin());
+  for (size_t i=0; i<clamped.size(); ++i) {
+    clamped[i] = std::min(grid[i], band);
+  }
+
+  const double tol = sparse.quantizationError() + 1e-9 * band;
+  const double gtol = 2 * tol / grid.cellSize();
+
+  double maxDiff = 0;
+  for (size_t cz=0; cz<grid.nz(); ++cz) {
+    for (size_t cy=0; cy<grid.ny(); ++cy) {
+      for (size_t cx=0; cx<grid.nx(); ++cx) {
+        maxDiff = std::max(maxDiff, fabs(sparse(cx,cy,cz) - 
+                                         clamped(cx,cy,cz)));
+      }
+    }
+  }
+
+  const DtGridd::Box3 box = grid.bbox();
+  RealArray px, py, pz;
+  for (size_t i=0; i<x.size(); ++i) {
+    if (!box.contains(vec3d(x[i], y[i], z[i]))) { continue; }
+    px.push_back(x[i]);
+    py.push_back(y[i]);
+    pz.push_back(z[i]);
+  }
+
+  const size_t n = px.size();
+  RealArray f(n), gx(n), gy(n), gz(n), rf(n), rgx(n), rgy(n), rgz(n);
+  double maxSampleDiff = 0, maxGradDiff = 0;
+
+  if (n) {
+    sparse.sample(n, &px[0], &py[0], &pz[0], &f[0], &gx[0], &gy[0], &gz[0]);
+    clamped.sample(n, &px[0], &py[0], &pz[0], 
+                   &rf[0], &rgx[0], &rgy[0], &rgz[0]);
+  }
+
+  for (size_t i=0; i<n; ++i) {
+    maxSampleDiff = std::max(maxSampleDiff, fabs(f[i] - rf[i]));
+    maxGradDiff = std::max(maxGradDiff, fabs(gx[i] - rgx[i]));
+    maxGradDiff = std::max(maxGradDiff, fabs(gy[i] - rgy[i]));
+    maxGradDiff = std::max(maxGradDiff, fabs(gz[i] - rgz[i]));
+  }
+
+  const bool ok = (maxDiff <= tol && maxSampleDiff <= tol && 
+                   maxGradDiff <= gtol);
+  printf("%s sparse: largest difference in the cells: %g, samples: %g, "
+         "gradients: %g%s\n", quantize ? "16 bit" : "double",
+         maxDiff, maxSampleDiff, maxGradDiff, ok ? "" : " FAILED");
+
+  return ok;
+
+}
+
+static void bench(const char* trace, const char* name,
+                  const DtGridd& grid, 
+                  const RealArray& x, const RealArray& y, 
+                  const RealArray& z, bool batch) {
+
+  enum { REPEAT = 5 };
+
+  const size_t n = x.size();
+  RealArray f(n), gx(n), gy(n), gz(n);
+
+  EventCounter llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  EventCounter l1(PERF_TYPE_HW_CACHE, 
+                  PERF_COUNT_HW_CACHE_L1D |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+  llc.start();
+  l1.start();
+  const TimeStamp start = TimeStamp::now();
+
+  for (int r=0; r<REPEAT; ++r) {
+    if (batch) {
+      grid.sample(n, &x[0], &y[0], &z[0], &f[0], &gx[0], &gy[0], &gz[0]);
+    } else {
+      for (size_t i=0; i<n; ++i) {
+        vec3d g;
+        f[i] = grid.sample(vec3d(x[i], y[i], z[i]), g);
+      }
+    }
+  }
+
+  const double elapsed = (TimeStamp::now() - start).toDouble();
+  const long long l1Misses = l1.stop();
+  const long long llcMisses = llc.stop();
+
+  const double total = double(n) * REPEAT;
+
+  printf("%-6s %-6s %-6s %8.2f ns/sample", trace, name, 
+         batch ? "batch" : "single", 1e9 * elapsed / total);
+  if (l1Misses >= 0) { 
+    printf("  %6.3f L1d misses/sample", l1Misses / total); 
+  }
+  if (llcMisses >= 0) { 
+    printf("  %6.3f LLC misses/sample", llcMisses / total); 
+  }
+  printf("\n");
+
+}
+
+int main(int argc, char** argv) {
+
+  if (argc > 3) { 
+    std::cerr << "usage: " << argv[0] << " [grid.dt [trace.txt]]\n";
+    exit(1);
+  }
+
+  mt_init_genrand(12345);
+
+  if (!checkUpdate()) { exit(1); }
+
+  DtGridd linear;
+
+  if (argc > 1) {
+    if (!linear.load(argv[1], false)) {
+      std::cerr << "error loading " << argv[1] << "\n";
+      exit(1);
+    }
+  } else {
+    makeField(linear);
+  }
+
+  // the tiled copy holds the same distances, with some extra cells
+  // at the far edges to fill out the tiles.
+  DtGridd tiled;
+  tiled.resize(linear.nx(), linear.ny(), linear.nz(), 
+               linear.referenceAxis(), linear.cellSize(), linear.origin(),
+               DtGridd::LAYOUT_TILED);
+
+  for (size_t z=0; z<tiled.nz(); ++z) {
+    for (size_t y=0; y<tiled.ny(); ++y) {
+      for (size_t x=0; x<tiled.nx(); ++x) {
+        const vec3u s(std::min(x, linear.nx()-1),
+                      std::min(y, linear.ny()-1),
+                      std::min(z, linear.nz()-1));
+        tiled(x,y,z) = linear(s);
+      }
+    }
+  }
+
+  const char* traces[2] = { "links", "random" };
+  int ntraces = 2;
+
+  if (argc > 2) { 
+    traces[0] = "trace";
+    ntraces = 1;
+  }
+
+  printf("%dx%dx%d grid\n", int(linear.nx()), int(linear.ny()),
+         int(linear.nz()));
+
+  for (int t=0; t<ntraces; ++t) {
+
+    RealArray x, y, z;
+
+    if (argc > 2) {
+      std::ifstream istr(argv[2]);
+      double px, py, pz;
+      while (istr >> px >> py >> pz) {
+        x.push_back(px);
+        y.push_back(py);
+        z.push_back(pz);
+      }
+    } else {
+      makeQueries(linear, t == 0, x, y, z);
+    }
+
+    if (x.empty()) {
+      std::cerr << "no queries\n";
+      exit(1);
+    }
+
+    // the layouts must give the same answers inside the linear grid.
+    double maxDiff = 0;
+    for (size_t i=0; i<x.size(); ++i) {
+      const vec3d p(x[i], y[i], z[i]);
+      if (!linear.isInside(p)) { continue; }
+      maxDiff = std::max(maxDiff, fabs(linear.sample(p) - tiled.sample(p)));
+    }
+    printf("%s: %d queries, largest difference between the layouts: %g\n",
+           traces[t], int(x.size()), maxDiff);
+
+    if (!checkSparse(linear, false, x, y, z) || 
+        !checkSparse(linear, true, x, y, z)) { exit(1); }
+
+    for (int batch=0; batch<2; ++batch) {
+      bench(traces[t], "linear", linear, x, y, z, batch);
+      bench(traces[t], "tiled", tiled, x, y, z, batch);
+    }
+
+  }
+
+  return 0;
+
+}
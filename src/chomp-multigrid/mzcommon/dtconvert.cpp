@@ -0,0 +1,77 @@
+/*
+* Copyright (c) 2008-2014, Matt Zucker
+*
+* This file is provided under the following "BSD-style" License:
+*
+* Redistribution and use in source and binary forms, with or
+* without modification, are permitted provided that the following
+* conditions are met:
+*
+* * Redistributions of source code must retain the above copyright
+* notice, this list of conditions and the following disclaimer.
+*
+* * Redistributions in binary form must reproduce the above
+* copyright notice, this list of conditions and the following
+* disclaimer in the documentation and/or other materials provided
+* with the distribution.
+*
+* THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+* CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+* INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+* MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+* DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+* CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+* SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+* LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+* USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+* AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+* LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+* ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+* POSSIBILITY OF SUCH DAMAGE.
+*
+*/
+
+
+#include "DtGrid.h"
+#include <stdlib.h>
+#include <iostream>
+
+// converts a distance field written by DtGrid::save into the format
+// written by DtGrid::saveMappable, which DtGrid::load maps directly.
+// the output has the same real type as the input.
+
+template <class real>
+void convert(const char* input, const char* output) {
+
+  DtGrid_t<real> grid;
+
+  if (!grid.load(input, false)) {
+    std::cerr << "error loading " << input << "\n";
+    exit(1);
+  }
+
+  if (!grid.saveMappable(output)) {
+    std::cerr << "error saving " << output << "\n";
+    exit(1);
+  }
+
+}
+
+int main(int argc, char** argv) {
+
+  if (argc != 3) { 
+    std::cerr << "usage: " << argv[0] << " input.dt output.dt\n";
+    exit(1);
+  }
+
+  switch (dtGridRealSize(argv[1])) {
+  case sizeof(float):  convert<float>(argv[1], argv[2]); break;
+  case sizeof(double): convert<double>(argv[1], argv[2]); break;
+  default:
+    std::cerr << "error loading " << argv[1] << "\n";
+    exit(1);
+  }
+
+  return 0;
+
+}
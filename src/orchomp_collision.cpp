@@ -2,9 +2,15 @@
 #include "orchomp_mod.h"
 #include "orchomp_collision_pruner.h"
 
+#include <fstream>
+#include <cstdlib>
+
 
 namespace orchomp {
 
+//the largest sphere position (or jacobian) error that the native
+//  kinematics may have before openrave is used instead.
+static const double NATIVE_FK_TOLERANCE = 1e-6;
 
 template <class Derived>
 void assertJacobianIsEquivalent(const Eigen::MatrixBase<Derived> & mat,
@@ -25,11 +31,15 @@ SphereCollisionHelper::SphereCollisionHelper(
                        double epsilon, 
                        double obs_factor,
                        double epsilon_self,
-                       double obs_factor_self) :
+                       double obs_factor_self,
+                       size_t n_threads,
+                       bool use_native_fk,
+                       const std::string & broadphase) :
         ncspace(ncspace), nwkspace(3),
-        pruner( NULL ),
         module(module),
-        inactive_spheres_have_been_set( false ),
+        n_threads( std::max( n_threads, size_t(1) ) ),
+        broadphase( broadphase ),
+        kinematics( NULL ),
         gamma( gamma),
         epsilon( epsilon ),
         epsilon_self( epsilon_self ),
@@ -40,14 +50,30 @@ SphereCollisionHelper::SphereCollisionHelper(
     ignorables.insert( module->robot->GetAdjacentLinks().begin(),
                        module->robot->GetAdjacentLinks().end() );
     getSpheres();
+    checkSparseBands();
+    initIgnoreMask();
 
-    sphere_costs.resize( nbodies );
-
+    initWorkspaces();
     initPruner();
+    selectKernel();
 
+    if ( use_native_fk ){ initKinematics(); }
+
+    pthread_mutex_init( &kinematics_mutex, NULL );
+    startWorkers();
 }
 
 SphereCollisionHelper::~SphereCollisionHelper(){
+    stopWorkers();
+    if ( kinematics ){ delete kinematics; }
+    while ( !workspaces.empty() ){
+        delete workspaces.back();
+        workspaces.pop_back();
+    }
+    pthread_mutex_destroy( &kinematics_mutex );
+}
+
+CollisionWorkspace::~CollisionWorkspace(){
     if ( pruner ){ delete pruner; }
 }
 
@@ -93,6 +119,93 @@ double SphereCollisionHelper::addToGradient(chomp::ConstMatMap& xi,
 }
 
 
+void SphereCollisionHelper::startWorkers(){
+    pthread_mutex_init( &pool_mutex, NULL );
+    pthread_cond_init( &work_cond, NULL );
+    pthread_cond_init( &done_cond, NULL );
+    generation = 0;
+    pending = 0;
+    stopping = false;
+
+    //the workers keep pointers to their tasks, so the tasks are never
+    //  resized after this. If a thread cannot be created, its block
+    //  is done on the calling thread.
+    tasks.resize( workspaces.size() );
+    threads.resize( workspaces.size() );
+    started.assign( workspaces.size(), false );
+    for ( size_t i = 0; i < tasks.size(); i ++ ){
+        tasks[i].helper = this;
+        tasks[i].ws = workspaces[i];
+        tasks[i].active = false;
+    }
+    for ( size_t i = 1; i < tasks.size(); i ++ ){
+        started[i] = ( pthread_create( &threads[i], NULL,
+                                       &gradientThread,
+                                       &tasks[i] ) == 0 );
+    }
+}
+
+void SphereCollisionHelper::stopWorkers(){
+    pthread_mutex_lock( &pool_mutex );
+    stopping = true;
+    pthread_cond_broadcast( &work_cond );
+    pthread_mutex_unlock( &pool_mutex );
+
+    for ( size_t i = 1; i < threads.size(); i ++ ){
+        if ( started[i] ){ pthread_join( threads[i], NULL ); }
+    }
+
+    pthread_cond_destroy( &done_cond );
+    pthread_cond_destroy( &work_cond );
+    pthread_mutex_destroy( &pool_mutex );
+}
+
+void SphereCollisionHelper::runTask( GradientTask & task ){
+    task.failed = false;
+    if ( !task.active ){ return; }
+
+    try {
+        task.helper->addToGradient( *task.ws, task.start, task.end,
+                                    *task.xi, *task.pinit, *task.pgoal,
+                                    task.dt, *task.g );
+    }catch ( const std::exception & e ){
+        task.failed = true;
+        task.error = e.what();
+    }catch ( ... ){
+        task.failed = true;
+        task.error = "unknown error in a gradient worker";
+    }
+}
+
+void * SphereCollisionHelper::gradientThread( void * data ){
+    GradientTask & task = *reinterpret_cast< GradientTask * >( data );
+    SphereCollisionHelper & helper = *task.helper;
+
+    //the workers are started before the first generation, so a
+    //  worker that starts late still sees it.
+    unsigned long seen = 0;
+
+    pthread_mutex_lock( &helper.pool_mutex );
+    while ( true ){
+        while ( helper.generation == seen && !helper.stopping ){
+            pthread_cond_wait( &helper.work_cond, &helper.pool_mutex );
+        }
+        if ( helper.stopping ){ break; }
+        seen = helper.generation;
+        pthread_mutex_unlock( &helper.pool_mutex );
+
+        runTask( task );
+
+        pthread_mutex_lock( &helper.pool_mutex );
+        if ( --helper.pending == 0 ){
+            pthread_cond_signal( &helper.done_cond );
+        }
+    }
+    pthread_mutex_unlock( &helper.pool_mutex );
+
+    return NULL;
+}
+
 double SphereCollisionHelper::addToGradient(const chomp::MatX& xi,
                                             const chomp::MatX& pinit,
                                             const chomp::MatX& pgoal,
@@ -101,26 +214,172 @@ double SphereCollisionHelper::addToGradient(const chomp::MatX& xi,
     
     //timer.start( "collision" );
 
-    q1 = chomp::getTickBorderRepeat(-1, xi, pinit, pgoal, dt).transpose();
-    q2 = chomp::getTickBorderRepeat(0, xi, pinit, pgoal, dt).transpose();
+    //every iteration sees one frame of the point cloud, even while
+    //  the next one is being fused.
+    {
+        ScopedLock lock( &module->pointcloud_mutex );
+        if ( module->pointcloud_stream ){
+            module->pointcloud_stream->publish(
+                                module->sdfs[ module->pointcloud_sdf ] );
+        }
+    }
 
     inv_dt = 1/dt;
-    const double inv_dt_squared = inv_dt * inv_dt;
-    double total_cost = 0.0;
+
+    const int n_timesteps = xi.rows();
+    timestep_costs.resize( n_timesteps );
+
+    //when the number of timesteps changes (on a new multigrid level),
+    //  start each timestep from the order of the closest old one.
+    if ( int( timestep_orders.size() ) != n_timesteps ){
+        std::vector< std::vector< int > > old_orders;
+        old_orders.swap( timestep_orders );
+        timestep_orders.resize( n_timesteps );
+
+        for ( int i = 0; i < n_timesteps && !old_orders.empty(); i ++ ){
+            timestep_orders[i] = 
+                    old_orders[ ( i * old_orders.size() ) / n_timesteps ];
+        }
+    }
     
-    for ( int current_time=0; current_time < xi.rows(); ++current_time)
+    //there is no point in having more threads than timesteps.
+    const int n_workers = std::min( int( workspaces.size() ), n_timesteps );
+
+    if ( n_workers <= 1 ){
+        addToGradient( *workspaces[0], 0, n_timesteps,
+                       xi, pinit, pgoal, dt, g );
+    }
+    else {
+        //give each worker a contiguous block of timesteps, so that
+        //  the spheres move coherently from one sort to the next.
+        for ( size_t i = 0; i < tasks.size(); i ++ ){
+            GradientTask & task = tasks[i];
+            task.active = int( i ) < n_workers;
+            task.start = ( n_timesteps * int( i ) ) / n_workers;
+            task.end = ( n_timesteps * int( i+1 ) ) / n_workers;
+            task.xi = &xi;
+            task.pinit = &pinit;
+            task.pgoal = &pgoal;
+            task.dt = dt;
+            task.g = &g;
+        }
+
+        //wake the workers, and do the first block on the calling
+        //  thread, along with the blocks of the threads that could
+        //  not be created.
+        pthread_mutex_lock( &pool_mutex );
+        pending = 0;
+        for ( size_t i = 1; i < tasks.size(); i ++ ){
+            if ( started[i] ){ pending ++; }
+        }
+        generation ++;
+        pthread_cond_broadcast( &work_cond );
+        pthread_mutex_unlock( &pool_mutex );
+
+        runTask( tasks[0] );
+        for ( size_t i = 1; i < tasks.size(); i ++ ){
+            if ( !started[i] ){ runTask( tasks[i] ); }
+        }
+
+        pthread_mutex_lock( &pool_mutex );
+        while ( pending > 0 ){
+            pthread_cond_wait( &done_cond, &pool_mutex );
+        }
+        pthread_mutex_unlock( &pool_mutex );
+
+        for ( size_t i = 0; i < tasks.size(); i ++ ){
+            if ( tasks[i].failed ){
+                throw OpenRAVE::openrave_exception( tasks[i].error );
+            }
+        }
+    }
+
+    //sum the costs in timestep order.
+    double total_cost = 0.0;
+    for ( int i = 0; i < n_timesteps; i ++ ){
+        total_cost += timestep_costs[i];
+    }
+
+    size_t n_sorts = 0, n_swaps = 0;
+    for ( size_t i = 0; i < workspaces.size(); i ++ ){
+        n_sorts += workspaces[i]->pruner->n_sorts;
+        n_swaps += workspaces[i]->pruner->n_swaps;
+        workspaces[i]->pruner->resetCounters();
+    }
+    if ( n_sorts > 0 ){
+        RAVELOG_DEBUG( "Pruner swaps per sort: %f\n",
+                       double( n_swaps ) / double( n_sorts ) );
+    }
+
+    //timer.stop( "collision" );
+    return total_cost;
+
+}
+
+void SphereCollisionHelper::selectKernel(){
+    typedef SphereCollisionHelper H;
+
+    switch ( ncspace ){
+    case 6:  gradient_kernel = &H::addToGradientKernel< 6 >; break;
+    case 7:  gradient_kernel = &H::addToGradientKernel< 7 >; break;
+    case 14: gradient_kernel = &H::addToGradientKernel< 14 >; break;
+    default: gradient_kernel = &H::addToGradientKernel< Eigen::Dynamic >;
+    }
+}
+
+void SphereCollisionHelper::addToGradient( CollisionWorkspace & ws,
+                                           int start, int end,
+                                           const chomp::MatX& xi,
+                                           const chomp::MatX& pinit,
+                                           const chomp::MatX& pgoal,
+                                           double dt,
+                                           chomp::MatX& g)
+{
+    (this->*gradient_kernel)( ws, start, end, xi, pinit, pgoal, dt, g );
+}
+
+template <int DOF>
+void SphereCollisionHelper::addToGradientKernel( CollisionWorkspace & ws,
+                                                 int start, int end,
+                                                 const chomp::MatX& xi,
+                                                 const chomp::MatX& pinit,
+                                                 const chomp::MatX& pgoal,
+                                                 double dt,
+                                                 chomp::MatX& g)
+{
+    const double inv_dt_squared = inv_dt * inv_dt;
+
+    //the ticks are written in place, so that the loop does not
+    //  allocate once the workspace has its sizes.
+    ws.q0.resize( xi.cols(), 1 );
+    ws.q1.resize( xi.cols(), 1 );
+    ws.q2.resize( xi.cols(), 1 );
+
+    chomp::getTickBorderRepeat(start-1, xi, pinit, pgoal, dt,
+                               ws.q1.transpose());
+    chomp::getTickBorderRepeat(start, xi, pinit, pgoal, dt,
+                               ws.q2.transpose());
+
+    for ( int current_time=start; current_time < end; ++current_time)
     {
-       
         //timer.start( "FK" );
         //Set the positions of all of the spheres,
-        //  for the current configuration.
-        setSpherePositions( q1, !inactive_spheres_have_been_set );
+        //  for the current configuration. The native kinematics do
+        //  not touch the robot, so they do not need the lock.
+        //  The pruner starts from this timestep's last order.
+        ws.pruner->setOrder( timestep_orders[ current_time ] );
+        {
+            ScopedLock lock( kinematicsMutex() );
+            setSpherePositions( ws, ws.q1,
+                                !ws.inactive_spheres_have_been_set );
+        }
+        ws.pruner->getOrder( timestep_orders[ current_time ] );
         //timer.stop( "FK" );
         
         //timer.start( "sdf collision");
         //set all of the sphere costs to zero
-        for ( std::vector<SphereCost>::iterator i = sphere_costs.begin();
-              i != sphere_costs.end();
+        for ( std::vector<SphereCost>::iterator i = ws.sphere_costs.begin();
+              i != ws.sphere_costs.end();
               i ++ )
         {
             i->setZero();
@@ -128,51 +387,189 @@ double SphereCollisionHelper::addToGradient(const chomp::MatX& xi,
         
         //get all of the potential collisions, and test those
         //  for collision
-        CollisionReport potential;
-        pruner->getPotentialCollisions( potential );
-        
-        for ( CollisionReport::iterator i = potential.begin();
-              i != potential.end();
-              ++i )
-        {
-            getCollisionCostAndGradient(i->first, i->second );
-        }
+        getCollisionCostsAndGradients( ws );
 
         //timer.stop( "sdf collision");
         
         //timer.start( "projection" );
-        q0 = q1;
-        q1 = q2;
-        q2 = chomp::getTickBorderRepeat(current_time+1, xi,
-                                        pinit, pgoal, dt).transpose();
+        
+        //get the jacobians of the spheres that have a cost. The native
+        //  kinematics get them from the joint frames of this timestep.
+        //  Otherwise they come from openrave, and if another thread may
+        //  have moved the robot since the sphere positions were set,
+        //  the robot needs to be moved back to this configuration.
+        bool has_cost = false;
+        ScopedLock lock( kinematicsMutex(), false );
+        for ( size_t i = 0; i < nbodies; i ++ ){
+            if ( ws.sphere_costs[i].getCost( obs_factor,
+                                             obs_factor_self ) <= 0 ){
+                continue;
+            }
+            if ( !has_cost && !kinematics && workspaces.size() > 1 ){
+                lock.lock();
+                chomp::matToVec( ws.q1, ws.state );
+                module->robot->SetActiveDOFValues( ws.state, false );
+            }
+            has_cost = true;
+            setJacobianVector( ws, i );
+        }
+        lock.unlock();
 
-        cspace_vel = 0.5 * (q2 - q0) * inv_dt;        
-        cspace_accel = (q0 - 2.0*q1 + q2) * inv_dt_squared;
+        ws.q0.swap( ws.q1 );
+        ws.q1.swap( ws.q2 );
+        chomp::getTickBorderRepeat(current_time+1, xi, pinit, pgoal, dt,
+                                   ws.q2.transpose());
 
-        for ( size_t i = 0; i < nbodies; i ++ ){
-            total_cost += projectGradient( i, g.row( current_time ));
+        ws.cspace_vel = 0.5 * (ws.q2 - ws.q0) * inv_dt;        
+        ws.cspace_accel = (ws.q0 - 2.0*ws.q1 + ws.q2) * inv_dt_squared;
+
+        double cost = 0.0;
+        if ( has_cost ){
+            for ( size_t i = 0; i < nbodies; i ++ ){
+                cost += projectGradient<DOF>( ws, i, g.row( current_time ));
+            }
         }
+        timestep_costs[ current_time ] = cost;
 
         //timer.stop( "projection" );
     }
+}
 
-    //timer.stop( "collision" );
-    return total_cost;
+void SphereCollisionHelper::getCollisionCostsAndGradients(
+                                            CollisionWorkspace & ws )
+{
+    ws.potential.clear();
+    ws.pruner->getPotentialCollisions( ws.potential );
+
+    //split the potential collisions into batches. The pruner has
+    //  already dropped the ignored pairs, and the pairs of inactive
+    //  spheres.
+    ws.sphere_pairs.clear();
+    ws.sdf_pairs.clear();
+    for ( CollisionReport::const_iterator it = ws.potential.begin();
+          it != ws.potential.end();
+          ++it )
+    {
+        const int index1 = std::min( it->first, it->second );
+        const int index2 = std::max( it->first, it->second );
+
+        if ( index2 < int( spheres.size() ) ){
+            ws.sphere_pairs.push_back( index1, index2 );
+        }
+        else { ws.sdf_pairs.push_back( index1, index2 - spheres.size() ); }
+    }
+
+    computeSphereSphereCosts( ws.sphere_centers, sphere_radii,
+                              epsilon_self, ws.sphere_pairs );
+
+    //each sdf samples all of its spheres in one call, then the costs
+    //  are computed together.
+    CollisionBatch & sdf_pairs = ws.sdf_pairs;
+    sdf_pairs.resizeResults();
+    for ( size_t j = 0; j < module->sdfs.size(); j ++ ){
+
+        ws.sdf_pair_indices.clear();
+        for ( size_t i = 0; i < sdf_pairs.size(); i ++ ){
+            if ( sdf_pairs.second[i] == int( j ) ){
+                ws.sdf_pair_indices.push_back( i );
+            }
+        }
+        const size_t n = ws.sdf_pair_indices.size();
+        if ( n == 0 ){ continue; }
+
+        ws.sdf_points.resize( n );
+        ws.sdf_gradients.resize( n );
+        ws.sdf_dists.resize( n );
+        for ( size_t k = 0; k < n; k ++ ){
+            const int sphere_index = 
+                            sdf_pairs.first[ ws.sdf_pair_indices[k] ];
+            ws.sdf_points.x[k] = ws.sphere_centers.x[ sphere_index ];
+            ws.sdf_points.y[k] = ws.sphere_centers.y[ sphere_index ];
+            ws.sdf_points.z[k] = ws.sphere_centers.z[ sphere_index ];
+        }
+
+        module->sdfs[j].getDists( n, &ws.sdf_points.x[0],
+                                     &ws.sdf_points.y[0],
+                                     &ws.sdf_points.z[0],
+                                  &ws.sdf_dists[0],
+                                  &ws.sdf_gradients.x[0],
+                                  &ws.sdf_gradients.y[0],
+                                  &ws.sdf_gradients.z[0] );
+
+        for ( size_t k = 0; k < n; k ++ ){
+            const size_t i = ws.sdf_pair_indices[k];
+            const OpenRAVE::dReal dist = ws.sdf_dists[k];
+
+            //far away spheres get no cost.
+            if (dist == HUGE_VAL || dist >= epsilon ){
+                sdf_pairs.dist[i] = epsilon;
+                sdf_pairs.gx[i] = sdf_pairs.gy[i] = sdf_pairs.gz[i] = 0.0;
+                continue;
+            }
+            sdf_pairs.dist[i] = dist - sphere_radii[ sdf_pairs.first[i] ];
+            sdf_pairs.gx[i] = ws.sdf_gradients.x[k];
+            sdf_pairs.gy[i] = ws.sdf_gradients.y[k];
+            sdf_pairs.gz[i] = ws.sdf_gradients.z[k];
+        }
+    }
+    computeSphereSDFCosts( epsilon, sdf_pairs );
+
+    //add the costs into the spheres, in the order that the pruner
+    //  reported them.
+    std::vector< SphereCost > & sphere_costs = ws.sphere_costs;
+    const CollisionBatch & sphere_pairs = ws.sphere_pairs;
+    for ( size_t i = 0; i < sphere_pairs.size(); i ++ ){
+        const double cost = sphere_pairs.cost[i];
+        if ( cost <= 0.0 ){ continue; }
+
+        const Eigen::Vector3d gradient( sphere_pairs.gx[i],
+                                        sphere_pairs.gy[i],
+                                        sphere_pairs.gz[i] );
+        const int index1 = sphere_pairs.first[i];
+        const int index2 = sphere_pairs.second[i];
+
+        sphere_costs[ index1 ].self_cost += cost;
+        sphere_costs[ index1 ].self_gradient += gradient;
+
+        //if the other sphere is active, store those costs,
+        //  but store the negative gradient.
+        if ( index2 < int( nbodies ) ){
+            sphere_costs[ index2 ].self_cost += cost;
+            sphere_costs[ index2 ].self_gradient -= gradient;
+        }
+    }
+
+    for ( size_t i = 0; i < sdf_pairs.size(); i ++ ){
+        const double cost = sdf_pairs.cost[i];
+        if ( cost <= 0.0 ){ continue; }
 
+        SphereCost & sphere_cost = sphere_costs[ sdf_pairs.first[i] ];
+        sphere_cost.sdf_cost += cost;
+        sphere_cost.sdf_gradient += Eigen::Vector3d( sdf_pairs.gx[i],
+                                                     sdf_pairs.gy[i],
+                                                     sdf_pairs.gz[i] );
+    }
 }
 
-void SphereCollisionHelper::getCollisionCostAndGradient( int index1,
-                                                         int index2)
+void SphereCollisionHelper::getCollisionCostAndGradient(
+                                            CollisionWorkspace & ws,
+                                            int index1,
+                                            int index2)
 {
     if ( index1 > index2 ){ std::swap( index1, index2 ); }
     
+    //when the inactive spheres are sorted along with the active ones,
+    //  the pruner also reports inactive pairs. Those have no cost.
+    if ( index1 >= int( nbodies ) ){ return; }
+
     double cost;
     Eigen::Vector3d gradient;
+    std::vector< SphereCost > & sphere_costs = ws.sphere_costs;
     
     //if both indices are for spheres.
     if ( index2 < int( spheres.size() ) ){
 
-        cost = sphereOnSphereCollision( index1, index2, gradient);
+        cost = sphereOnSphereCollision( ws, index1, index2, gradient);
 
         //if the cost is greater than zero
         if ( cost > 0.0 ){
@@ -193,7 +590,8 @@ void SphereCollisionHelper::getCollisionCostAndGradient( int index1,
     
     //if the potential collision is between an active sphere and an sdf.
     else {
-        cost = getSDFCollision(index1, index2-spheres.size(), gradient);
+        cost = getSDFCollision( ws, index1, index2-spheres.size(),
+                                gradient);
 
         //if the cost is greater than zero
         if ( cost > 0.0 ){
@@ -206,28 +604,32 @@ void SphereCollisionHelper::getCollisionCostAndGradient( int index1,
 }
 
 
-template <class Derived>
-double SphereCollisionHelper::projectGradient(size_t body_index, 
+template <int DOF, class Derived>
+double SphereCollisionHelper::projectGradient(CollisionWorkspace & ws,
+                                size_t body_index, 
                                 Eigen::MatrixBase<Derived> const & g )
 {
+    typedef Eigen::Matrix< double, 3, DOF, Eigen::RowMajor > Jacobian;
+    typedef Eigen::Matrix< double, DOF, 1 > VecDOF;
 
-    double cost = sphere_costs[body_index].getCost( obs_factor,
-                                                    obs_factor_self);
+    const SphereCost & sphere_cost = ws.sphere_costs[body_index];
+    double cost = sphere_cost.getCost( obs_factor, obs_factor_self);
 
     if ( cost <= 0 ){ return 0.0; }
 
-    Eigen::Vector3d grad = obs_factor * 
-                           sphere_costs[body_index].sdf_gradient
-                         + obs_factor_self * 
-                           sphere_costs[body_index].self_gradient;
+    Eigen::Vector3d grad = obs_factor * sphere_cost.sdf_gradient
+                         + obs_factor_self * sphere_cost.self_gradient;
 
-    setJacobianVector( body_index );
-    Eigen::Map<const chomp::MatXR> dx_dq( jacobian_vector.data(),
-                                         nwkspace,
-                                         ncspace );
+    assert( nwkspace == 3 );
+    Eigen::Map<const Jacobian> dx_dq( 
+                            &ws.jacobians[ body_index*nwkspace*ncspace ],
+                            nwkspace,
+                            ncspace );
+    Eigen::Map<const VecDOF> cspace_vel( ws.cspace_vel.data(), ncspace );
+    Eigen::Map<const VecDOF> cspace_accel( ws.cspace_accel.data(), ncspace );
 
-    wkspace_vel = dx_dq * cspace_vel;
-    wkspace_accel = dx_dq * cspace_accel;
+    Eigen::Vector3d wkspace_vel = dx_dq * cspace_vel;
+    Eigen::Vector3d wkspace_accel = dx_dq * cspace_accel;
     
     float wv_norm = wkspace_vel.norm();
     //this prevents nans from propogating in the case that the norm
@@ -239,28 +641,31 @@ double SphereCollisionHelper::projectGradient(size_t body_index,
     //change gamma depending on if it is self or sdf collision
     double scl = wv_norm / inv_dt * gamma;
 
-    P = chomp::MatX::Identity(nwkspace, nwkspace)
-        - (wkspace_vel * wkspace_vel.transpose());
+    const Eigen::Matrix3d P = Eigen::Matrix3d::Identity()
+                            - wkspace_vel * wkspace_vel.transpose();
+
+    const Eigen::Vector3d K = (P * wkspace_accel) / (wv_norm * wv_norm);
 
-    K = (P * wkspace_accel) / (wv_norm * wv_norm);
+    //P * grad - cost * K, of size 3-by-1
+    const Eigen::Vector3d wkspace_grad = P * grad - cost * K;
    
-    //scalar * M-by-W        * (WxW * Wx1   - scalar * Wx1)
-    const_cast<Eigen::MatrixBase<Derived> &>(g)
-                  += (scl * (dx_dq.transpose() *
-                     (P * grad - cost * K) ).transpose());
+    //scalar * (1-by-3             * 3-by-M)
+    const_cast<Eigen::MatrixBase<Derived> &>(g).noalias()
+                  += scl * (wkspace_grad.transpose() * dx_dq);
 
     return cost * scl;
 }
 
 //If the given sphere overlaps with the given sdf, return true.
-double SphereCollisionHelper::getSDFCollision(int sphere_index, 
+double SphereCollisionHelper::getSDFCollision(CollisionWorkspace & ws,
+                                              int sphere_index, 
                                               int sdf_index,
                                               Eigen::Vector3d & gradient)
 {
     vec3 gradient_vec; 
     //get the distance and gradient.
     OpenRAVE::dReal dist = module->sdfs[sdf_index].getDist( 
-                                    sphere_positions[sphere_index], 
+                                    ws.sphere_positions[sphere_index], 
                                     gradient_vec );
 
     if (dist == HUGE_VAL || dist >= epsilon ){ return 0.0; }
@@ -280,6 +685,8 @@ bool SphereCollisionHelper::getSDFCollisions(size_t body_index)
 {
     
     const double radius = spheres[body_index].radius;
+    const std::vector< OpenRAVE::Vector > & sphere_positions =
+                                             workspaces[0]->sphere_positions;
 
     for ( size_t i = 0; i < module->sdfs.size(); i ++ ){
         OpenRAVE::dReal dist =
@@ -301,20 +708,23 @@ bool SphereCollisionHelper::getSDFCollision(size_t body_index,
 {
     
     const OpenRAVE::dReal dist = module->sdfs[sdf_index].getDist(
-                                         sphere_positions[body_index]);
+                                 workspaces[0]->sphere_positions[body_index]);
         
     return (dist - spheres[body_index].radius < 0 );
 }
 
 double SphereCollisionHelper::sphereOnSphereCollision(
+                                CollisionWorkspace & ws,
                                 size_t index1, size_t index2,
                                 Eigen::Vector3d & gradient,
                                 bool ignore){
 
     const Sphere & sphere1 = spheres[index1];
     const Sphere & sphere2 = spheres[index2];
+    const std::vector< OpenRAVE::Vector > & sphere_positions =
+                                             ws.sphere_positions;
 
-    if ( ignore && ignoreSphereCollision( sphere1, sphere2 ) ){ 
+    if ( ignore && ignoreSphereCollision( index1, index2 ) ){ 
         return 0.0;
     }
 
@@ -362,8 +772,10 @@ bool SphereCollisionHelper::sphereOnSphereCollision( size_t index1,
                                                      bool ignore){
     const Sphere & sphere1 = spheres[index1];
     const Sphere & sphere2 = spheres[index2];
+    const std::vector< OpenRAVE::Vector > & sphere_positions =
+                                             workspaces[0]->sphere_positions;
 
-    if ( ignore && ignoreSphereCollision( sphere1, sphere2 ) ){ 
+    if ( ignore && ignoreSphereCollision( index1, index2 ) ){ 
         return false;
     }
 
@@ -414,38 +826,67 @@ bool SphereCollisionHelper::checkCollision( size_t body1, size_t body2 )
 
 bool SphereCollisionHelper::isCollided()
 {
-    bool collision = pruner->checkPotentialCollisions( this );
+    bool collision = workspaces[0]->pruner->checkPotentialCollisions(this);
 
     return collision;
 }
 
 void SphereCollisionHelper::setSpherePositions( const chomp::MatX & q,
                                                 bool setInactive){
-    if ( sphere_positions.size() != spheres.size()){
-        sphere_positions.resize( spheres.size() );
-    }
+    setSpherePositions( *workspaces[0], q, setInactive );
+}
+ 
+void SphereCollisionHelper::setSpherePositions(
+                            const std::vector<OpenRAVE::dReal> & state,
+                            bool setInactive)
+{   
+    setSpherePositions( *workspaces[0], state, setInactive );
+}
 
-    std::vector< OpenRAVE::dReal > vec;
-    chomp::matToVec( q, vec );
+void SphereCollisionHelper::setSpherePositions( CollisionWorkspace & ws,
+                                                const chomp::MatX & q,
+                                                bool setInactive){
+    chomp::matToVec( q, ws.state );
     
-    setSpherePositions( vec, setInactive );
+    setSpherePositions( ws, ws.state, setInactive );
 }
  
 void SphereCollisionHelper::setSpherePositions(
+                            CollisionWorkspace & ws,
                             const std::vector<OpenRAVE::dReal> & state,
                             bool setInactive)
 {   
 
+    //if setInactive is true, then set all of the spheres,
+    //  otherwise, only set the active spheres.
+    const size_t size = ( setInactive ? spheres.size() : nbodies );
+
+    if ( kinematics ){
+        kinematics->getSpherePositions( state, size, ws.sphere_positions,
+                                        ws.joint_frames );
+    }
+    else { setSpherePositionsFromRobot( ws, state, size ); }
+
+    for ( size_t i = 0; i < size; i ++ ){
+        ws.sphere_centers.set( i, ws.sphere_positions[i] );
+    }
+
+    if (ws.pruner){ ws.pruner->sort( ws.sphere_positions, size); }
+    if ( setInactive ){ ws.inactive_spheres_have_been_set = true;}
+
+}
+
+void SphereCollisionHelper::setSpherePositionsFromRobot(
+                            CollisionWorkspace & ws,
+                            const std::vector<OpenRAVE::dReal> & state,
+                            size_t size)
+{   
     module->robot->SetActiveDOFValues(state, false);
     
     OpenRAVE::Transform t;
     int current_link_index = -1;
     OpenRAVE::KinBody * current_body = NULL;
     
-    //if setInactive is true, then set all of the spheres,
-    //  otherwise, only set the active spheres.
-    const size_t size = ( setInactive ? spheres.size() : nbodies );
-
     //get the positions of all of the spheres
     for ( size_t i=0; i < size; i ++ )
     {
@@ -467,12 +908,8 @@ void SphereCollisionHelper::setSpherePositions(
         }
 
         //get the transformation from the body to the sphere.
-        sphere_positions[i] = t * sphere.position;
+        ws.sphere_positions[i] = t * sphere.position;
     }
-
-    if (pruner){ pruner->sort( sphere_positions, size); }
-    if ( setInactive ){ inactive_spheres_have_been_set = true;}
-
 }
 
 std::vector< OpenRAVE::dReal > const &
@@ -495,20 +932,35 @@ SphereCollisionHelper::getJacobian( size_t sphere_index )
     //actually get the jacobian
     module->robot->CalculateActiveJacobian(
                    sphere.linkindex, 
-                   sphere_positions[sphere_index],
+                   workspaces[0]->sphere_positions[sphere_index],
                    inserted_element.first->second);
 
 
     return inserted_element.first->second;
 }
 
-inline void SphereCollisionHelper::setJacobianVector(size_t sphere_index)
+inline void SphereCollisionHelper::setJacobianVector(
+                                            CollisionWorkspace & ws,
+                                            size_t sphere_index)
 {
+    double * jacobian = &ws.jacobians[ sphere_index*nwkspace*ncspace ];
+
+    if ( kinematics ){
+        kinematics->computeSphereJacobian( ws.joint_frames.data(),
+                                           sphere_index,
+                                           ws.sphere_positions[sphere_index],
+                                           jacobian );
+        return;
+    }
+
     //actually get the jacobian
     module->robot->CalculateActiveJacobian(
                    spheres[ sphere_index ].linkindex, 
-                   sphere_positions[sphere_index],
-                   jacobian_vector);
+                   ws.sphere_positions[sphere_index],
+                   ws.jacobian_vector);
+
+    std::copy( ws.jacobian_vector.begin(), ws.jacobian_vector.end(),
+               jacobian );
 }
 
 OpenRAVE::KinBodyPtr SphereCollisionHelper::createCube( 
@@ -532,8 +984,8 @@ void SphereCollisionHelper::colorFromDist( double dist,
 
     const DistanceField & df = module->sdfs[ sdf_index ];
 
-    const double min = df.grid.minDist();
-    const double max = df.grid.maxDist();
+    OpenRAVE::dReal min, max;
+    df.getDistRange( min, max );
     
     const double cutoff1 = (max - min) / 3;
     const double cutoff2 = cutoff1 * 2;
@@ -569,14 +1021,16 @@ void SphereCollisionHelper::visualizeSDFSlice( size_t sdf_index,
     
     const DistanceField & df = module->sdfs[ sdf_index ];
     
+    //a merged field has no kinbody to hide.
     bool was_visible = false;
-    if ( df.kinbody->IsVisible() ){
+    if ( df.kinbody.get() && df.kinbody->IsVisible() ){
         df.kinbody->SetVisible( false );
         was_visible = true;
     }
 
     
-    size_t bounds[6] = { 0,0,0, df.grid.nx(), df.grid.ny(), df.grid.nz() };
+    const Grid3_t< OpenRAVE::dReal > & layout = df.getLayout();
+    size_t bounds[6] = { 0,0,0, layout.nx(), layout.ny(), layout.nz() };
     bounds[ axis ] = slice_index;
     bounds[axis + 3] = slice_index + 1;
 
@@ -586,7 +1040,7 @@ void SphereCollisionHelper::visualizeSDFSlice( size_t sdf_index,
     for( size_t j = bounds[1]; j < bounds[4]; j ++ ){
     for( size_t k = bounds[2]; k < bounds[5]; k ++ ){
 
-        double dist = df.grid( i, j, k );
+        double dist = df.getCellDist( i, j, k );
         OpenRAVE::Transform center;
         df.getCenterFromIndex( i,j,k, center );
 
@@ -676,7 +1130,8 @@ void SphereCollisionHelper::benchmark( int num_trials,
         timer.start( "sphere fk" );
         //this will set the inactive spheres, if they have not
         //  already been set.
-        setSpherePositions( mat, !inactive_spheres_have_been_set );
+        setSpherePositions( mat,
+                            !workspaces[0]->inactive_spheres_have_been_set );
         timer.stop( "sphere fk" );
 
         timer.start("sphere sdf");
@@ -855,6 +1310,174 @@ void SphereCollisionHelper::benchmark( int num_trials,
 
 }
 
+void SphereCollisionHelper::benchmarkBroadphase( int num_trials ){
+
+    const char * types[] = { "sap", "hash" };
+    const size_t n_types = sizeof( types ) / sizeof( types[0] );
+
+    std::vector< Broadphase * > pruners( n_types );
+    std::vector< size_t > n_pairs( n_types, 0 );
+    for ( size_t i = 0; i < n_types; i ++ ){
+        pruners[i] = createBroadphase( types[i], spheres, module->sdfs,
+                                       &ignore_mask );
+    }
+
+    const std::vector< OpenRAVE::Vector > & sphere_positions =
+                                             workspaces[0]->sphere_positions;
+    CollisionReport report;
+    Timer broadphase_timer;
+
+    for ( int trial = 0; trial < num_trials; trial ++ ){
+        chomp::MatX mat;
+        module->getRandomState( mat );
+        setSpherePositions( mat,
+                            !workspaces[0]->inactive_spheres_have_been_set );
+
+        //the inactive spheres only need to be given to each pruner once.
+        const size_t n_set = ( trial == 0 ? spheres.size() : nbodies );
+
+        for ( size_t i = 0; i < n_types; i ++ ){
+            report.clear();
+            broadphase_timer.start( types[i] );
+            pruners[i]->sort( sphere_positions, n_set );
+            pruners[i]->getPotentialCollisions( report );
+            broadphase_timer.stop( types[i] );
+            n_pairs[i] += report.size();
+        }
+    }
+
+    for ( size_t i = 0; i < n_types; i ++ ){
+        RAVELOG_INFO( "Broadphase %s: %f pairs, %f ms per configuration\n",
+                      types[i],
+                      double( n_pairs[i] ) / std::max( num_trials, 1 ),
+                      1000 * broadphase_timer.getTotal( types[i] )
+                           / std::max( num_trials, 1 ) );
+        delete pruners[i];
+    }
+}
+
+
+void SphereCollisionHelper::benchmarkSDF( int num_trials, int num_configs,
+                                          const std::string & trace_in,
+                                          const std::string & trace_out ){
+
+    //get the sphere positions to sample the fields at.
+    std::vector< OpenRAVE::dReal > x, y, z;
+    if ( !trace_in.empty() ){
+        std::ifstream in( trace_in.c_str() );
+        if ( !in ){
+            throw OpenRAVE::openrave_exception(
+                    "Could not open the sdf trace: " + trace_in );
+        }
+        OpenRAVE::dReal px, py, pz;
+        while ( in >> px >> py >> pz ){
+            x.push_back( px );
+            y.push_back( py );
+            z.push_back( pz );
+        }
+    }else {
+        const std::vector< OpenRAVE::Vector > & sphere_positions =
+                                             workspaces[0]->sphere_positions;
+        for ( int i = 0; i < num_configs; i ++ ){
+            chomp::MatX mat;
+            module->getRandomState( mat );
+            setSpherePositions( mat,
+                            !workspaces[0]->inactive_spheres_have_been_set );
+            for ( size_t j = 0; j < nbodies; j ++ ){
+                x.push_back( sphere_positions[j][0] );
+                y.push_back( sphere_positions[j][1] );
+                z.push_back( sphere_positions[j][2] );
+            }
+        }
+    }
+
+    if ( !trace_out.empty() ){
+        std::ofstream out( trace_out.c_str() );
+        out.precision( 17 );
+        for ( size_t i = 0; i < x.size(); i ++ ){
+            out << x[i] << " " << y[i] << " " << z[i] << "\n";
+        }
+    }
+
+    const size_t n = x.size();
+    RAVELOG_INFO( "Benchmarking distance fields on %d sphere positions\n",
+                  int( n ));
+    if ( n == 0 ){ return; }
+
+    double max_radius = 0;
+    for ( size_t i = 0; i < nbodies; i ++ ){
+        max_radius = std::max( max_radius, spheres[i].radius );
+    }
+
+    const char * types[] = { "dense", "band", "quantized",
+                             "quantized band" };
+    const size_t n_types = sizeof( types ) / sizeof( types[0] );
+
+    std::vector< OpenRAVE::dReal > ref( n ), ref_gx( n ), ref_gy( n ),
+                                   ref_gz( n ), dists( n ), gx( n ),
+                                   gy( n ), gz( n );
+
+    for ( size_t i = 0; i < module->sdfs.size(); i ++ ){
+        const DistanceField & reference = module->sdfs[i];
+        if ( reference.isSparse() ){
+            RAVELOG_WARN( "Distance field %d is already sparse, so it can "
+                          "not be compared to a dense field\n", int( i ));
+            continue;
+        }
+
+        //the smallest band that keeps every collision cost the same.
+        const double band = epsilon + max_radius
+                          + 2*reference.grid.cellSize();
+
+        reference.getDists( n, &x[0], &y[0], &z[0], &ref[0],
+                            &ref_gx[0], &ref_gy[0], &ref_gz[0] );
+
+        Timer sdf_timer;
+        for ( size_t t = 0; t < n_types; t ++ ){
+            DistanceField field( reference );
+            if ( t == 1 ){ field.makeSparse( band ); }
+            else if ( t == 2 ){
+                field.makeSparse( field.grid.maxDist(), true );
+            }
+            else if ( t == 3 ){ field.makeSparse( band, true ); }
+
+            sdf_timer.start( types[t] );
+            for ( int trial = 0; trial < num_trials; trial ++ ){
+                field.getDists( n, &x[0], &y[0], &z[0], &dists[0],
+                                &gx[0], &gy[0], &gz[0] );
+            }
+            sdf_timer.stop( types[t] );
+
+            //only the spheres closer than epsilon have a cost.
+            double max_error = 0, max_gradient_error = 0;
+            for ( size_t j = 0; j < n; j ++ ){
+                if ( ref[j] == HUGE_VAL || ref[j] >= epsilon ){ continue; }
+                const double dx = gx[j] - ref_gx[j];
+                const double dy = gy[j] - ref_gy[j];
+                const double dz = gz[j] - ref_gz[j];
+                max_error = std::max( max_error,
+                                      fabs( dists[j] - ref[j] ));
+                max_gradient_error = std::max( max_gradient_error,
+                                      sqrt( dx*dx + dy*dy + dz*dz ));
+            }
+
+            const size_t bytes = field.isSparse() ?
+                                 field.sparse_grid.memoryUsage() :
+                                 field.grid.size()
+                                    * ( field.grid.hasGradients() ? 4 : 1 )
+                                    * sizeof( OpenRAVE::dReal );
+
+            RAVELOG_INFO( "Field %d %s: %f ns per query, %f MB, "
+                          "max error %f, max gradient error %f\n",
+                          int( i ), types[t],
+                          1e9 * sdf_timer.getTotal( types[t] )
+                              / ( double( n ) * std::max( num_trials, 1 )),
+                          bytes / ( 1024.0*1024.0 ),
+                          max_error, max_gradient_error );
+        }
+    }
+}
+
 
 bool SphereCollisionHelper::isCollidedSDF( bool checkAll ){
     bool isInCollision = false; 
@@ -1001,6 +1624,36 @@ void SphereCollisionHelper::getSpheres(){
     spheres.insert( spheres.end(), inactive_spheres.begin(),
                                    inactive_spheres.end() );
 
+    sphere_radii.resize( spheres.size() );
+    for ( size_t i = 0; i < spheres.size(); i ++ ){
+        sphere_radii[i] = spheres[i].radius;
+    }
+
+}
+
+void SphereCollisionHelper::checkSparseBands() const {
+    double max_radius = 0;
+    for ( size_t i = 0; i < nbodies; i ++ ){
+        max_radius = std::max( max_radius, spheres[i].radius );
+    }
+
+    //a sphere has a cost when its center is closer than its radius
+    //  plus epsilon, and the interpolation reads the cells up to one
+    //  cell farther out.
+    for ( size_t i = 0; i < module->sdfs.size(); i ++ ){
+        const DistanceField & field = module->sdfs[i];
+        if ( !field.isSparse() ){ continue; }
+
+        const double needed = epsilon + max_radius
+                            + field.getLayout().cellSize();
+        if ( field.sparse_grid.band() < needed ){
+            RAVELOG_ERROR( "Distance field %d has a band of %f, but the "
+                           "collision costs need at least %f\n", int( i ),
+                           double( field.sparse_grid.band() ), needed );
+            throw OpenRAVE::openrave_exception(
+                    "The band of a sparse distance field is too small!" );
+        }
+    }
 }
 
 inline int SphereCollisionHelper::getKey( int linkindex1,
@@ -1042,10 +1695,117 @@ inline bool SphereCollisionHelper::ignoreSphereCollision(
     return false;
 }
 
+void SphereCollisionHelper::initWorkspaces(){
+    workspaces.resize( n_threads );
+    for ( size_t i = 0; i < workspaces.size(); i ++ ){
+        workspaces[i] = new CollisionWorkspace();
+        workspaces[i]->sphere_positions.resize( spheres.size() );
+        workspaces[i]->sphere_centers.resize( spheres.size() );
+        workspaces[i]->sphere_costs.resize( nbodies );
+        workspaces[i]->jacobians.resize( nbodies * nwkspace * ncspace );
+    }
+}
+
+void SphereCollisionHelper::initIgnoreMask(){
+    ignore_mask.init( nbodies, spheres.size() );
+    for ( size_t i = 0; i < nbodies; i ++ ){
+        for ( size_t j = i; j < spheres.size(); j ++ ){
+            if ( ignoreSphereCollision( spheres[i], spheres[j] ) ){
+                ignore_mask.set( i, j );
+            }
+        }
+    }
+}
+
 void SphereCollisionHelper::initPruner(){
-    if ( !pruner ){
-        pruner = new ArrayCollisionPruner( 0, spheres, module->sdfs );
-    }  
+    for ( size_t i = 0; i < workspaces.size(); i ++ ){
+        if ( !workspaces[i]->pruner ){
+            workspaces[i]->pruner = createBroadphase( broadphase, spheres,
+                                                      module->sdfs,
+                                                      &ignore_mask );
+        }
+    }
+}
+
+void SphereCollisionHelper::initKinematics(){
+    try {
+        kinematics = new KinematicChain( module->robot, spheres );
+    }catch ( const OpenRAVE::openrave_exception & e ){
+        RAVELOG_ERROR( "Cannot use the native kinematics: %s\n", e.what() );
+        return;
+    }
+
+    const double error = checkKinematics();
+    RAVELOG_INFO( "Native kinematics error: %g\n", error );
+
+    if ( error > NATIVE_FK_TOLERANCE ){
+        RAVELOG_ERROR( "The native kinematics do not match openrave, "
+                       "using openrave instead.\n" );
+        delete kinematics;
+        kinematics = NULL;
+    }
+}
+
+double SphereCollisionHelper::checkKinematics( int num_trials ){
+    
+    if ( !kinematics ){ return 0.0; }
+
+    std::vector< OpenRAVE::dReal > start_state, state( ncspace );
+    module->robot->GetActiveDOFValues( start_state );
+
+    std::vector< OpenRAVE::Vector > positions( spheres.size() );
+    std::vector< double > frames, jacobian( nwkspace*ncspace ),
+                          openrave_jacobian;
+    double max_error = 0.0;
+
+    //the states come from a generator of their own, so that checking
+    //  does not change the sequence of the seeded global one.
+    unsigned int seed = 1;
+
+    for ( int trial = 0; trial < num_trials; trial ++ ){
+
+        //get a random state within the joint limits
+        for ( size_t i = 0; i < ncspace; i ++ ){
+            const double rand_val = double( rand_r( &seed ) )
+                                  / double(RAND_MAX);
+            state[i] = module->lowerJointLimits[i] 
+                     + (module->upperJointLimits[i]
+                       -module->lowerJointLimits[i]) * rand_val;
+        }
+
+        kinematics->getSpherePositions( state, spheres.size(),
+                                        positions, frames );
+        module->robot->SetActiveDOFValues( state, false );
+
+        for ( size_t i = 0; i < spheres.size(); i ++ ){
+            const OpenRAVE::Vector diff = positions[i] - 
+                      spheres[i].link->GetTransform() * spheres[i].position;
+            max_error = std::max( max_error,
+                                  double( sqrt( diff.lengthsqr3() ) ));
+        }
+
+        //the jacobians of the active spheres should match as well.
+        for ( size_t i = 0; i < nbodies; i ++ ){
+            kinematics->computeSphereJacobian( frames.data(), i,
+                                               positions[i],
+                                               jacobian.data() );
+            module->robot->CalculateActiveJacobian( spheres[i].linkindex,
+                                                    positions[i],
+                                                    openrave_jacobian );
+            for ( size_t k = 0; k < jacobian.size(); k ++ ){
+                max_error = std::max( max_error, 
+                            fabs( jacobian[k] - openrave_jacobian[k] ) );
+            }
+        }
+    }
+
+    module->robot->SetActiveDOFValues( start_state, false );
+    return max_error;
+}
+
+inline pthread_mutex_t * SphereCollisionHelper::kinematicsMutex(){
+    if ( kinematics || workspaces.size() <= 1 ){ return NULL; }
+    return &kinematics_mutex;
 }
 
 inline bool SphereCollisionHelper::ignoreSphereCollision(
@@ -1054,6 +1814,11 @@ inline bool SphereCollisionHelper::ignoreSphereCollision(
 {
 
     
+    //the mask only holds the pairs with an active sphere.
+    if ( std::min( sphere_index1, sphere_index2 ) < ignore_mask.rows() ){
+        return ignore_mask.isIgnored( sphere_index1, sphere_index2 );
+    }
+
     const Sphere & sphere1 = spheres[sphere_index1]; 
     const Sphere & sphere2 = spheres[sphere_index2];
     
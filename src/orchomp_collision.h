@@ -4,17 +4,22 @@
 
 #include "orchomp_kdata.h"
 #include "orchomp_distancefield.h"
+#include "orchomp_collision_pruner.h"
+#include "orchomp_kinematics.h"
+#include "orchomp_sphere_kernels.h"
 #include "chomp-multigrid/chomp/ChompGradient.h"
 
 #include <openrave/openrave.h>
 #include <boost/unordered_map.hpp>
 #include <boost/unordered_set.hpp>
+#include <pthread.h>
 
 namespace orchomp{
 
 class CollisionPruner;
 class ArrayCollisionPruner;
 class mod;
+class SphereCollisionHelper;
 
 //this is a data structure to hold sphere collision cost and gradient
 //  info.
@@ -33,11 +38,114 @@ class SphereCost{
         sdf_gradient.setZero();
     }
 
-    inline double getCost( double obs_factor, double obs_factor_self ){
+    inline double getCost( double obs_factor,
+                           double obs_factor_self ) const {
         return obs_factor * sdf_cost + obs_factor_self * self_cost;
     }
 };
 
+//this holds all of the state that changes from timestep to timestep
+//  while computing the collision gradient. Every thread gets its own
+//  workspace, so that timesteps can be processed concurrently.
+class CollisionWorkspace{
+  public:
+    //the positions of the spheres for a given configuration.
+    std::vector< OpenRAVE::Vector > sphere_positions;
+    std::vector< SphereCost > sphere_costs;
+
+    //the same positions, as a structure of arrays for the kernels.
+    SphereArrays sphere_centers;
+
+    //the potential collisions of the current timestep, split into
+    //  sphere on sphere, and sphere on sdf batches.
+    CollisionBatch sphere_pairs, sdf_pairs;
+
+    //the sphere centers, and the results, of the sdf pairs that
+    //  involve a single sdf.
+    std::vector< int > sdf_pair_indices;
+    SphereArrays sdf_points, sdf_gradients;
+    std::vector< double > sdf_dists;
+
+    //the pruner is sorted in place, so it cannot be shared.
+    Broadphase * pruner;
+    CollisionReport potential;
+
+    //the jacobians of the active spheres for the current timestep.
+    //  Each one is nwkspace x ncspace (row major), stored back to back.
+    std::vector< OpenRAVE::dReal > jacobians;
+    std::vector< OpenRAVE::dReal > jacobian_vector;
+
+    //the joint frames computed by the native kinematics.
+    std::vector< double > joint_frames;
+
+    //the configuration of the current timestep, as openrave wants it.
+    std::vector< OpenRAVE::dReal > state;
+
+    //all of this is from the chomp collision gradient helper. The
+    //  workspace side of the projection is 3 dimensional, so it is
+    //  done on fixed size matrices in projectGradient.
+    chomp::MatX q0, q1, q2;
+    chomp::MatX cspace_vel, cspace_accel;
+
+    //the inactive spheres never move, so they only need to be set once.
+    bool inactive_spheres_have_been_set;
+
+    CollisionWorkspace() : pruner( NULL ),
+                           inactive_spheres_have_been_set( false ){}
+    ~CollisionWorkspace();
+};
+
+//the arguments handed to each gradient worker thread.
+struct GradientTask{
+    SphereCollisionHelper * helper;
+    CollisionWorkspace * ws;
+    int start, end;
+    const chomp::MatX * xi;
+    const chomp::MatX * pinit;
+    const chomp::MatX * pgoal;
+    double dt;
+    chomp::MatX * g;
+
+    //exceptions cannot cross thread boundaries, so they are
+    //  caught in the worker and rethrown on the calling thread.
+    bool failed;
+    std::string error;
+
+    //false for the workers that have no timesteps this time.
+    bool active;
+};
+
+//holds a mutex while it is in scope, so that an exception cannot
+//  leave it locked. A NULL mutex is never locked.
+class ScopedLock{
+  public:
+    explicit ScopedLock( pthread_mutex_t * mutex, bool lock_now=true ) :
+        mutex( mutex ), locked( false ) {
+        if ( lock_now ){ lock(); }
+    }
+    ~ScopedLock(){ unlock(); }
+
+    void lock(){
+        if ( mutex && !locked ){
+            pthread_mutex_lock( mutex );
+            locked = true;
+        }
+    }
+    void unlock(){
+        if ( locked ){
+            pthread_mutex_unlock( mutex );
+            locked = false;
+        }
+    }
+
+  private:
+    pthread_mutex_t * mutex;
+    bool locked;
+
+    ScopedLock( const ScopedLock & );
+    ScopedLock & operator=( const ScopedLock & );
+};
+
 OpenRAVE::dReal computeCostFromDist( OpenRAVE::dReal dist,
                                      double epsilon,
                                      Eigen::Vector3d & gradient );
@@ -56,13 +164,19 @@ public:
     //and the number of bodies.
     size_t ncspace, nwkspace, nbodies;
     
-    ArrayCollisionPruner * pruner;
-
     // a pointer to the module for acces to stuff like the collision
     //  geometry
     mod * module;
     
-    bool inactive_spheres_have_been_set;
+    //the number of threads used to compute the collision gradient.
+    size_t n_threads;
+
+    //the type of pruner, see createBroadphase.
+    std::string broadphase;
+
+    //if this is not NULL, it is used to compute the sphere positions
+    //  instead of setting the state of the openrave robot.
+    KinematicChain * kinematics;
 
     //the magnitude of the gradient update
     double gamma;
@@ -71,29 +185,38 @@ public:
     //the percent contribution of self and environmental collisions
     double obs_factor, obs_factor_self;
 
-    //all of this is from the chomp collision gradient helper.
-    chomp::MatX q0, q1, q2;
-    chomp::MatX cspace_vel, cspace_accel;
-    chomp::MatX wkspace_vel, wkspace_accel;
-    chomp::MatX P;
-    chomp::MatX K;
-    
     double inv_dt;
 
-    //the positions of the spheres for a given configuration.
-    std::vector< OpenRAVE::Vector > sphere_positions;
-    std::vector< SphereCost > sphere_costs;
+    //one workspace per thread. The serial path, and all of the
+    //  visualization and benchmarking code, use workspaces[0].
+    std::vector< CollisionWorkspace * > workspaces;
+
+    //the collision cost of each timestep. These are summed in order,
+    //  so the total does not depend on the number of threads.
+    std::vector< double > timestep_costs;
+
+    //the sorted pruner order of every timestep, from the last time the
+    //  gradient was computed. The trajectory only moves a little between
+    //  iterations, so starting from these makes the sorts nearly linear.
+    std::vector< std::vector< int > > timestep_orders;
+
+    //the robot's kinematics live in the shared openrave environment,
+    //  so only one thread may move the robot at a time.
+    pthread_mutex_t kinematics_mutex;
 
     map jacobians; //an unordered map of the jacobians.
 
     std::vector< Sphere > spheres; // the container holding spheres.
-    
-    std::vector<double> jacobian_vector;
+    std::vector< double > sphere_radii; // the radii of the spheres.
 
     //This is a set, used to hold joint pairs that can be ignored
     //  during collision checking.
     boost::unordered_set<int> ignorables;
 
+    //the sphere pairs that are ignored, built from the ignorables
+    //  once the spheres are known.
+    SpherePairMask ignore_mask;
+
     //used to time stuff.
     Timer timer;
 
@@ -106,7 +229,10 @@ public:
                            double epsilon=0.1, 
                            double obs_factor=0.7,
                            double epsilon_self=0.01,
-                           double obs_factor_self=0.3);
+                           double obs_factor_self=0.3,
+                           size_t n_threads=1,
+                           bool use_native_fk=false,
+                           const std::string & broadphase="sap");
     ~SphereCollisionHelper();
 
     //The main call for this class.
@@ -127,19 +253,46 @@ public:
                                  double dt,
                                  chomp::MatMap& g);
 
+    //Compute the collision gradient for the timesteps in [start, end)
+    //  using the given workspace. Each timestep only touches its own
+    //  row of g, so disjoint blocks can run on different threads.
+    void addToGradient( CollisionWorkspace & ws, int start, int end,
+                        const chomp::MatX& xi,
+                        const chomp::MatX& pinit,
+                        const chomp::MatX& pgoal,
+                        double dt,
+                        chomp::MatX& g);
+
+    //the above, compiled for DOF c-space dimensions. DOF is
+    //  Eigen::Dynamic for the robots that have no kernel of their own.
+    template <int DOF>
+    void addToGradientKernel( CollisionWorkspace & ws, int start, int end,
+                              const chomp::MatX& xi,
+                              const chomp::MatX& pinit,
+                              const chomp::MatX& pgoal,
+                              double dt,
+                              chomp::MatX& g);
+
+    //get the costs and gradients of all of the potential collisions
+    //  in the workspace's pruner, with the batched kernels, and store
+    //  them in the sphere_costs vector.
+    void getCollisionCostsAndGradients( CollisionWorkspace & ws );
+
     //get the cost and gradient of a potential collision pair.
     //  store the costs and gradient in the sphere_costs vector.
-    void getCollisionCostAndGradient( int index1, int index2 );
+    void getCollisionCostAndGradient( CollisionWorkspace & ws,
+                                      int index1, int index2 );
     
     //Multiply the workspace gradient through the jacobian, and add it into
     //   the c-space gradient.
-    template <class Derived>
-    double projectGradient( size_t body_index, 
+    template <int DOF, class Derived>
+    double projectGradient( CollisionWorkspace & ws, size_t body_index, 
                             Eigen::MatrixBase<Derived> const & g);
     
     //get collisions with the environment from a list of signed distance
     //  fields.
-    double getSDFCollision( int sphere_index, int sdf_index,
+    double getSDFCollision( CollisionWorkspace & ws,
+                            int sphere_index, int sdf_index,
                             Eigen::Vector3d & gradient  );
     //return true if the sphere corresponding to body_index,
     //  and the sdf corresponding to sdf_index are in collision
@@ -147,7 +300,8 @@ public:
     bool getSDFCollisions( size_t body_index );
 
     //calculate the cost and direction for a collision between two spheres.
-    double sphereOnSphereCollision( size_t index1, size_t index2,
+    double sphereOnSphereCollision( CollisionWorkspace & ws,
+                                    size_t index1, size_t index2,
                                     Eigen::Vector3d & direction,
                                     bool ignore=true);
     bool sphereOnSphereCollision( size_t index1, size_t index2,
@@ -160,7 +314,11 @@ public:
     //gets the jacobian of the sphere.
     std::vector< OpenRAVE::dReal > const& getJacobian(size_t sphere_index );
 
-    void setJacobianVector( size_t sphere_index );
+    //store the jacobian of the sphere in the workspace's jacobians.
+    //  With the native kinematics, this uses the workspace's joint
+    //  frames. Otherwise, the robot must be at the configuration the
+    //  workspace's sphere positions were computed for.
+    void setJacobianVector( CollisionWorkspace & ws, size_t sphere_index );
 
     //for a given configuration q, set the sphere_positions vector, to the
     //  positions of the spheres for the configuration.
@@ -169,6 +327,18 @@ public:
     virtual void setSpherePositions(
                             const std::vector<OpenRAVE::dReal> & state,
                             bool setInactive=false);
+    void setSpherePositions( CollisionWorkspace & ws,
+                             const chomp::MatX & q,
+                             bool setInactive=false);
+    void setSpherePositions( CollisionWorkspace & ws,
+                             const std::vector<OpenRAVE::dReal> & state,
+                             bool setInactive=false);
+
+    //set the positions of the first size spheres, by setting the state
+    //  of the openrave robot.
+    void setSpherePositionsFromRobot( CollisionWorkspace & ws,
+                             const std::vector<OpenRAVE::dReal> & state,
+                             size_t size );
 
     bool checkCollision( size_t body1, size_t body2 );
 
@@ -187,6 +357,11 @@ public:
                             size_t slice_index, double time);
   
   public: 
+    //compare the native kinematics against openrave at random
+    //  configurations, and return the largest error in the sphere
+    //  positions or the jacobians of the active spheres.
+    double checkKinematics( int num_trials = 10 );
+
     bool isCollidedSDF( bool checkAll=true);
     bool isCollidedSelf( bool checkAll=true);
     void benchmark( int num_trials = 100,
@@ -194,11 +369,75 @@ public:
                     double pause_time = 0.0,
                     bool print = false);
 
+    //time every type of pruner on the same random configurations, and
+    //  report the number of potential collisions that each one finds.
+    void benchmarkBroadphase( int num_trials = 100 );
+
+    //compare the sampling speed, accuracy and memory use of the
+    //  compact ways of storing each distance field against the dense
+    //  field, on the sphere positions of num_configs random
+    //  configurations, or on the positions read from trace_in. The
+    //  positions are written to trace_out, if it is given, so that
+    //  later runs can replay the same queries.
+    void benchmarkSDF( int num_trials = 100, int num_configs = 1000,
+                       const std::string & trace_in = "",
+                       const std::string & trace_out = "" );
+
 
   private:
 
     void getSpheres();
+
+    //throws an openrave_exception if the band of a sparse distance
+    //  field is too narrow to hold every distance that has a cost.
+    void checkSparseBands() const;
+
+    void initIgnoreMask();
     void initPruner();
+    void initWorkspaces();
+    void initKinematics();
+
+    //point gradient_kernel at the addToGradientKernel compiled for
+    //  ncspace, which is fixed once the helper is created.
+    void selectKernel();
+
+    typedef void (SphereCollisionHelper::*GradientKernel)(
+                        CollisionWorkspace & ws, int start, int end,
+                        const chomp::MatX& xi,
+                        const chomp::MatX& pinit,
+                        const chomp::MatX& pgoal,
+                        double dt,
+                        chomp::MatX& g);
+    GradientKernel gradient_kernel;
+
+    //the mutex that guards the robot's kinematics, or NULL when
+    //  only a single thread is used, or the native kinematics are,
+    //  so that nothing needs to be locked.
+    pthread_mutex_t * kinematicsMutex();
+
+    //start and stop the gradient workers, which live as long as the
+    //  helper. Worker i runs tasks[i] every time that generation goes
+    //  up, and the calling thread runs tasks[0].
+    void startWorkers();
+    void stopWorkers();
+
+    //run a task, catching anything that it throws.
+    static void runTask( GradientTask & task );
+
+    //the entry point for the gradient worker threads.
+    static void * gradientThread( void * task );
+
+    std::vector< GradientTask > tasks;
+    std::vector< pthread_t > threads;
+    std::vector< bool > started;
+
+    //pending is the number of workers that have not finished the
+    //  current generation yet.
+    pthread_mutex_t pool_mutex;
+    pthread_cond_t work_cond, done_cond;
+    unsigned long generation;
+    int pending;
+    bool stopping;
 
     //inline methods for ignoring sphere collisions.
     int getKey( int linkindex1, int linkindex2 ) const;
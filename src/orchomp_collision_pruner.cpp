@@ -1,5 +1,6 @@
 #include "orchomp_collision_pruner.h"
 #include "orchomp_collision.h"
+#include <algorithm>
 
 namespace orchomp{
 
@@ -273,14 +274,48 @@ namespace orchomp{
 
 
 
+//////////////////////////////////////////////////////////////
+//Broadphase /////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////
+    bool Broadphase::checkPotentialCollisions(
+                               SphereCollisionHelper * checker )
+    {
+        CollisionReport collisions;
+        getPotentialCollisions( collisions );
+
+        for ( size_t i = 0; i < collisions.size(); i ++ ){
+            if ( checker->checkCollision( collisions[i].first,
+                                          collisions[i].second )){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    Broadphase * createBroadphase( const std::string & type,
+                               const std::vector< Sphere > & spheres,
+                               const std::vector< DistanceField> & sdfs,
+                               const SpherePairMask * ignore_mask )
+    {
+        if ( type == "sap" ){
+            return new ArrayCollisionPruner( 0, spheres, sdfs, ignore_mask );
+        }
+        if ( type == "hash" ){
+            return new SpatialHashPruner( spheres, sdfs, 0.0, ignore_mask );
+        }
+        throw OpenRAVE::openrave_exception( "Unknown broadphase: " + type );
+    }
+
+
 //////////////////////////////////////////////////////////////
 //Array List Collision Pruning ///////////////////////////////
 //////////////////////////////////////////////////////////////
    ArrayCollisionPruner::ArrayCollisionPruner (
                           int axis, 
                           const std::vector< Sphere > & spheres,
-                          const std::vector< DistanceField> & sdfs ) :
-        axis(axis), spheres(spheres), sdfs(sdfs)
+                          const std::vector< DistanceField> & sdfs,
+                          const SpherePairMask * ignore_mask ) :
+        axis(axis), spheres(spheres), sdfs(sdfs), ignore_mask( ignore_mask )
     {
 
 
@@ -344,6 +379,7 @@ namespace orchomp{
     
     void ArrayCollisionPruner::sortArray(){
 
+        n_sorts ++;
         for ( std::vector<ArrayNode*>::iterator i = sorted_nodes.begin()+1;
               i != sorted_nodes.end();
               ++i )
@@ -353,18 +389,43 @@ namespace orchomp{
                  j-- )
             {
                 std::iter_swap( j, j-1);
+                n_swaps ++;
             }
         }
     }
+
+    //each endpoint is stored as twice the index of its node, plus one
+    //  if it is the upper endpoint.
+    void ArrayCollisionPruner::getOrder( std::vector< int > & order ) const
+    {
+        order.resize( sorted_nodes.size() );
+        for ( size_t i = 0; i < sorted_nodes.size(); i ++ ){
+            const size_t index = sorted_nodes[i]->second;
+            order[i] = 2*index + ( sorted_nodes[i] == &nodes[index].second );
+        }
+    }
+
+    void ArrayCollisionPruner::setOrder( const std::vector< int > & order )
+    {
+        if ( order.size() != sorted_nodes.size() ){ return; }
+
+        for ( size_t i = 0; i < order.size(); i ++ ){
+            std::pair< ArrayNode, ArrayNode > & node = nodes[ order[i]/2 ];
+            sorted_nodes[i] = ( order[i] % 2 ? &node.second : &node.first );
+        }
+    }
     
     inline void ArrayCollisionPruner::addCollisions(
                                     CollisionReport & collisions,
                                     int index1, Interval* current )
     {
         while ( current != NULL ){
-            collisions.resize( collisions.size() + 1 );
-            collisions.back().first = index1;
-            collisions.back().second = current->index;
+            if ( !ignore_mask ||
+                 !ignore_mask->isIgnored( index1, current->index ) ){
+                collisions.resize( collisions.size() + 1 );
+                collisions.back().first = index1;
+                collisions.back().second = current->index;
+            }
 
             current = current->next;
         }
@@ -455,5 +516,159 @@ namespace orchomp{
     }
 
 
+//////////////////////////////////////////////////////////////
+//Spatial Hash Collision Pruning /////////////////////////////
+//////////////////////////////////////////////////////////////
+    SpatialHashPruner::SpatialHashPruner(
+                          const std::vector< Sphere > & spheres,
+                          const std::vector< DistanceField> & sdfs,
+                          double cell_size,
+                          const SpherePairMask * ignore_mask ) :
+        n_active( 0 ), spheres( spheres ), sdfs( sdfs ),
+        ignore_mask( ignore_mask ), cell_size( cell_size )
+    {
+        //by default, a cell is two typical sphere diameters wide, so
+        //  most spheres touch only a few cells.
+        if ( this->cell_size <= 0.0 ){
+            std::vector< double > radii;
+            for ( size_t i = 0; i < spheres.size(); i ++ ){
+                radii.push_back( spheres[i].radius );
+            }
+            this->cell_size = 0.1;
+            if ( !radii.empty() ){
+                std::nth_element( radii.begin(),
+                                  radii.begin() + radii.size()/2,
+                                  radii.end() );
+                if ( radii[ radii.size()/2 ] > 0 ){
+                    this->cell_size = 4 * radii[ radii.size()/2 ];
+                }
+            }
+        }
+        inv_cell_size = 1.0 / this->cell_size;
+
+        bounds.resize( 6 * ( spheres.size() + sdfs.size() ) );
+        for ( size_t i = 0; i < sdfs.size(); i ++ ){
+            OpenRAVE::Vector lower, upper;
+            sdfs[i].getBounds( lower, upper );
+            
+            double * b = &bounds[ 6 * ( spheres.size() + i ) ];
+            for ( size_t k = 0; k < 3; k ++ ){
+                b[k] = lower[k];
+                b[k+3] = upper[k];
+            }
+        }
+    }
+
+    void SpatialHashPruner::sort(
+              const std::vector< OpenRAVE::Vector > & positions, 
+              size_t n_set_positions )
+    {
+        n_active = n_set_positions;
+        n_sorts ++;
+
+        for ( size_t i = 0; i < n_set_positions; i ++ ){
+            const double rad = spheres[i].radius;
+            double * b = &bounds[ 6*i ];
+            for ( size_t k = 0; k < 3; k ++ ){
+                b[k] = positions[i][k] - rad;
+                b[k+3] = positions[i][k] + rad;
+            }
+        }
+    }
+
+    inline int SpatialHashPruner::getCell( double value ) const {
+        return int( floor( value * inv_cell_size ) );
+    }
+
+    //pack the three cell coordinates into 21 bits each.
+    inline uint64_t SpatialHashPruner::getKey( int x, int y, int z ) const {
+        const uint64_t mask = 0x1FFFFF;
+        return ( ( uint64_t( x + (1<<20) ) & mask ) << 42 )
+             | ( ( uint64_t( y + (1<<20) ) & mask ) << 21 )
+             |   ( uint64_t( z + (1<<20) ) & mask );
+    }
+
+    inline bool SpatialHashPruner::overlaps( size_t index1,
+                                             size_t index2 ) const
+    {
+        const double * b1 = &bounds[ 6*index1 ];
+        const double * b2 = &bounds[ 6*index2 ];
+        for ( size_t k = 0; k < 3; k ++ ){
+            if ( b1[k] > b2[k+3] || b2[k] > b1[k+3] ){ return false; }
+        }
+        return true;
+    }
+
+    void SpatialHashPruner::getPotentialCollisions(
+                    CollisionReport & collisions)
+    {
+        //put every sphere into the cells that it touches.
+        cells.clear();
+        for ( size_t i = 0; i < spheres.size(); i ++ ){
+            const double * b = &bounds[ 6*i ];
+            const int x1 = getCell( b[0] ), x2 = getCell( b[3] );
+            const int y1 = getCell( b[1] ), y2 = getCell( b[4] );
+            const int z1 = getCell( b[2] ), z2 = getCell( b[5] );
+
+            for ( int x = x1; x <= x2; x ++ ){
+            for ( int y = y1; y <= y2; y ++ ){
+            for ( int z = z1; z <= z2; z ++ ){
+                cells.push_back( std::make_pair( getKey( x, y, z ), i ) );
+            }
+            }
+            }
+        }
+        std::sort( cells.begin(), cells.end() );
+
+        //test the spheres that share a cell.
+        for ( size_t start = 0; start < cells.size(); ){
+            size_t end = start + 1;
+            while ( end < cells.size() &&
+                    cells[end].first == cells[start].first ){ end ++; }
+
+            for ( size_t i = start; i < end; i ++ ){
+                for ( size_t j = i+1; j < end; j ++ ){
+                    const int index1 = cells[i].second;
+                    const int index2 = cells[j].second;
+
+                    if ( index1 >= n_active && index2 >= n_active ){
+                        continue;
+                    }
+                    if ( !overlaps( index1, index2 ) ){ continue; }
+
+                    //two spheres can share several cells, so only
+                    //  report them from the cell that holds the lower
+                    //  corner of their overlap.
+                    const double * b1 = &bounds[ 6*index1 ];
+                    const double * b2 = &bounds[ 6*index2 ];
+                    const uint64_t key = getKey(
+                                    getCell( std::max( b1[0], b2[0] ) ),
+                                    getCell( std::max( b1[1], b2[1] ) ),
+                                    getCell( std::max( b1[2], b2[2] ) ) );
+                    if ( key != cells[start].first ){ continue; }
+
+                    if ( ignore_mask &&
+                         ignore_mask->isIgnored( index1, index2 ) ){
+                        continue;
+                    }
+                    collisions.push_back( std::make_pair( index1, index2 ));
+                }
+            }
+            start = end;
+        }
+
+        //there are only a few sdfs, so test them directly.
+        for ( int i = 0; i < n_active && i < int( spheres.size() ); i ++ ){
+            for ( size_t j = 0; j < sdfs.size(); j ++ ){
+                const int sdf_index = spheres.size() + j;
+                if ( !overlaps( i, sdf_index ) ){ continue; }
+                if ( ignore_mask && ignore_mask->isIgnored( i, sdf_index ) ){
+                    continue;
+                }
+                collisions.push_back( std::make_pair( i, sdf_index ) );
+            }
+        }
+    }
+
 
 }//namespace
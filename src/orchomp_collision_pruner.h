@@ -6,6 +6,7 @@
 #include "orchomp_distancefield.h"
 #include "orchomp_kdata.h"
 #include <set>
+#include <stdint.h>
 
 namespace orchomp{
 
@@ -155,7 +156,88 @@ class ArrayInterval{
 };
 
 
-class ArrayCollisionPruner{
+//A dense bitset over sphere pairs, marking the pairs whose collisions
+//  are ignored. There is a row for every active sphere, and a column
+//  for every sphere. Pairs of inactive spheres never move relative to
+//  each other, so they are always ignored, and pairs with an sdf never
+//  are.
+class SpherePairMask{
+
+  private:
+    size_t n_rows, n_cols, row_words;
+    std::vector< uint64_t > bits;
+
+  public:
+    SpherePairMask() : n_rows( 0 ), n_cols( 0 ), row_words( 0 ){}
+
+    void init( size_t rows, size_t cols ){
+        n_rows = rows;
+        n_cols = cols;
+        row_words = ( cols + 63 ) / 64;
+        bits.assign( rows * row_words, 0 );
+    }
+
+    size_t rows() const { return n_rows; }
+
+    //mark the pair as ignored. At least one of them must be active.
+    void set( size_t index1, size_t index2 ){
+        if ( index1 > index2 ){ std::swap( index1, index2 ); }
+        assert( index1 < n_rows && index2 < n_cols );
+        bits[ index1*row_words + index2/64 ] |= uint64_t(1) << (index2%64);
+    }
+
+    inline bool isIgnored( size_t index1, size_t index2 ) const {
+        if ( index1 > index2 ){ std::swap( index1, index2 ); }
+        if ( index1 >= n_rows ){ return true; }
+        if ( index2 >= n_cols ){ return false; }
+        return ( bits[ index1*row_words + index2/64 ]
+                 >> (index2%64) ) & 1;
+    }
+};
+
+//This is the interface to the broadphase collision pruners. Every
+//  timestep, the pruner is sorted with the new sphere positions, and
+//  then it reports the pairs of objects whose bounds overlap. Indices
+//  past the end of the spheres are sdfs. At least one object in each
+//  pair is active (its index is less than n_set_positions).
+class Broadphase{
+
+  public:
+    //the number of sorts, and the total number of swaps they needed,
+    //  since the counters were last reset.
+    size_t n_sorts, n_swaps;
+
+    Broadphase() : n_sorts( 0 ), n_swaps( 0 ){}
+    virtual ~Broadphase(){}
+
+    virtual void sort( const std::vector< OpenRAVE::Vector > & positions, 
+                       size_t n_set_positions) = 0;
+    virtual void getPotentialCollisions( CollisionReport & collisions) = 0;
+
+    //return true as soon as the checker finds one of the potential
+    //  collisions to be a collision.
+    virtual bool checkPotentialCollisions( SphereCollisionHelper * checker );
+
+    //get the current sorted state, or start from a state saved earlier,
+    //  so that the next sort only has to fix up what has moved since.
+    //  Pruners that do not sort have no state to save.
+    virtual void getOrder( std::vector< int > & order ) const {
+        order.clear();
+    }
+    virtual void setOrder( const std::vector< int > & order ){}
+
+    void resetCounters(){ n_sorts = n_swaps = 0; }
+};
+
+//make a pruner by name: "sap" for sweep and prune along the x axis,
+//  or "hash" for a uniform spatial hash. Throws an openrave_exception
+//  for any other name.
+Broadphase * createBroadphase( const std::string & type,
+                               const std::vector< Sphere > & spheres,
+                               const std::vector< DistanceField> & sdfs,
+                               const SpherePairMask * ignore_mask = NULL);
+
+class ArrayCollisionPruner : public Broadphase{
     
   private:
 
@@ -172,14 +254,23 @@ class ArrayCollisionPruner{
     
     std::vector< Interval > intervals;
 
+    //if this is set, the ignored pairs are not reported by
+    //  getPotentialCollisions.
+    const SpherePairMask * ignore_mask;
+
   public:
     ArrayCollisionPruner( int axis, 
                           const std::vector< Sphere > & spheres,
-                          const std::vector< DistanceField> & sdfs);
+                          const std::vector< DistanceField> & sdfs,
+                          const SpherePairMask * ignore_mask = NULL);
     virtual void sort( const std::vector< OpenRAVE::Vector > & positions, 
                        size_t n_set_positions);
-    bool checkPotentialCollisions( SphereCollisionHelper * checker );
-    void getPotentialCollisions( CollisionReport & collisions);
+
+    //the order of the endpoints. An order of the wrong size is ignored.
+    virtual void getOrder( std::vector< int > & order ) const;
+    virtual void setOrder( const std::vector< int > & order );
+    virtual bool checkPotentialCollisions( SphereCollisionHelper * checker );
+    virtual void getPotentialCollisions( CollisionReport & collisions);
 
   private:
     void assertSorted();
@@ -193,6 +284,47 @@ class ArrayCollisionPruner{
 
 };
 
+//A uniform grid, hashed by cell. Every sphere is put into each cell
+//  that its bounding box touches, and spheres that share a cell are
+//  tested against each other. Unlike sweep and prune, this tests the
+//  bounds along all three axes, so it does not matter which way the
+//  robot is stretched out.
+class SpatialHashPruner : public Broadphase{
+
+  private:
+    int n_active;
+    const std::vector< Sphere > & spheres;
+    const std::vector< DistanceField> & sdfs;
+    const SpherePairMask * ignore_mask;
+
+    double cell_size, inv_cell_size;
+
+    //the lower then upper corner of the bounding box of every sphere
+    //  and sdf, 6 values each.
+    std::vector< double > bounds;
+
+    //the key of every cell that a sphere touches, and the sphere,
+    //  sorted by key.
+    std::vector< std::pair< uint64_t, int > > cells;
+
+  public:
+    //if cell_size is not positive, the cells are sized from the
+    //  median radius of the spheres.
+    SpatialHashPruner( const std::vector< Sphere > & spheres,
+                       const std::vector< DistanceField> & sdfs,
+                       double cell_size = 0.0,
+                       const SpherePairMask * ignore_mask = NULL);
+
+    virtual void sort( const std::vector< OpenRAVE::Vector > & positions, 
+                       size_t n_set_positions);
+    virtual void getPotentialCollisions( CollisionReport & collisions);
+
+  private:
+    int getCell( double value ) const;
+    uint64_t getKey( int x, int y, int z ) const;
+    bool overlaps( size_t index1, size_t index2 ) const;
+};
+
 }//namespace
 
 #endif
@@ -13,10 +13,10 @@ void UnifiedConstraint::evaluateConstraints( const chomp::MatX& qt,
 
     const int DoF = qt.size();
 
-    std::vector< chomp::MatX > h_vec;
-    std::vector< chomp::MatX > H_vec;
-    h_vec.resize( constraints.size() );
-    H_vec.resize( constraints.size() );
+    if ( h_vec.size() != constraints.size() ){
+        h_vec.resize( constraints.size() );
+        H_vec.resize( constraints.size() );
+    }
     
     //get all of the constraints
     num_outputs = 0;
@@ -151,22 +151,23 @@ void ORTSRConstraint::computeJacobian(
     
     OpenRAVE::Transform t = module->robot->GetLinks()[ ee_link_index ]
                                   ->GetTransform();
-    std::vector< OpenRAVE::dReal > translationJacobian;
-    std::vector< OpenRAVE::dReal > rotationJacobian;
+    bool got_translation = false, got_rotation = false;
 
     //get the jacobians 
     for ( size_t i = 0; i < active_dims.size(); i++ ){
-        if ( active_dims[i] < 3 && translationJacobian.size() == 0){
+        if ( active_dims[i] < 3 && !got_translation ){
             module->robot->CalculateActiveJacobian( ee_link_index,
                                                 t.trans,
                                                 translationJacobian);
+            got_translation = true;
 
             assert( translationJacobian.size() == size_t( DOF * 3 ));
         }
-        else if ( active_dims[i] >= 3 && rotationJacobian.size() == 0 ){
+        else if ( active_dims[i] >= 3 && !got_rotation ){
             module->robot->CalculateActiveRotationJacobian( ee_link_index,
                                                 t.rot,
                                                 rotationJacobian);
+            got_rotation = true;
             assert( rotationJacobian.size() == size_t( DOF * 3 ) );
         }
     }
@@ -291,101 +292,5 @@ chomp::Constraint* ORConstraintFactory::getConstraint(size_t t,
     return unified;
 }
     
-void ORConstraintFactory::evaluate(
-                const std::vector<chomp::Constraint*>& constraints, 
-                const chomp::MatX& xi, chomp::MatX& h_tot,
-                chomp::MatX& H_tot, int step)
-{
-
-    //debugStream << "Evaluating Constraints" <<std::endl; 
-
-    size_t DoF = xi.cols();
-
-    assert(size_t(xi.rows()) == constraints.size());
-
-    //the number of rows in the complete matrices.
-    size_t numCons = 0;
-    
-    //the number of total constraints,
-    // and the number of timesteps we are actually looking at.
-    const size_t size = constraints.size();
-    size_t time_steps = 0;
-    
-    std::vector< chomp::MatX > H_vec, h_vec;
-
-    //annoyingly, with the use of the step, this is the
-    //  correct size of the vectors.
-    H_vec.resize( (size - 1)/step + 1  );
-    h_vec.resize( (size - 1)/step + 1  );
-    
-
-    
-    //keeps track of the timestep, while i keeps track of the
-    //  vector index.
-    std::vector<size_t> constrained_timesteps;
-
-    //get all of the jacobians and cost vectors
-    for (size_t t=0, i=0; t< size; t+=step, i++) {
-        chomp::Constraint* c = constraints[t];
-
-        time_steps ++;
-        
-        //if the constraint does not exist, continue.
-        if ( !c ){ continue; }
-
-        c->evaluateConstraints( xi.row(t), h_vec[i], H_vec[i] );
-        numCons += h_vec[i].size();
-        
-        if ( h_vec[i].size() != 0 ){
-            assert( h_vec[i].rows() == h_vec[i].size() );
-            assert( h_vec[i].cols() == 1);
-
-            constrained_timesteps.push_back( i );
-        }
-
-    }
-    
-    //bail out if there are no constraints.
-    if ( constrained_timesteps.size() == 0 ){
-        h_tot.resize( 0,0 );
-        H_tot.resize( 0,0 );
-
-        //debugStream << "Done Evaluating Constraints" <<std::endl; 
-        return;
-    }
-
-    assert( time_steps == (size - 1)/step + 1  );
-    
-    //h_tot is a row vector of length eqivalent to the number of
-    //  constraints.
-    //H_tot is a block diagonal matrix.
-    // make h_tot and H_tot
-    h_tot.resize( numCons, 1 );
-    H_tot.resize( numCons, DoF*time_steps );
-    H_tot.setZero(); 
-   
-    
-    //since we don't which of the steps is 0, 
-    int row_start = 0;
-    for (size_t i=0; i < constrained_timesteps.size(); i ++) {
-        
-        const size_t index = constrained_timesteps[i];
-        const int height = H_vec[index].rows();
-        
-        //set h block;
-        h_tot.block(row_start, 0, height, 1 ) = h_vec[index];
-
-        for (size_t j = 0; j < DoF; j ++ ){
-            const size_t col_index = j * time_steps + index;
-            H_tot.block(row_start, col_index , height, 1) = 
-                                            H_vec[index].col( j );
-
-        }
-        row_start += height;
-    }
-    //debugStream << "Done Evaluating Constraints" <<std::endl; 
-    
-}
-
 
 }// namespace
@@ -31,6 +31,11 @@ class UnifiedConstraint : public chomp::Constraint{
     UnifiedConstraint() : num_outputs(1){}
     ~UnifiedConstraint(){}
 
+  private:
+    //the outputs of each constraint, kept from one evaluation to the
+    //  next so that they are not allocated again.
+    std::vector< chomp::MatX > h_vec, H_vec;
+
 };
 
 class ORTSRConstraint : public chomp::TSRConstraint {
@@ -61,6 +66,10 @@ class ORTSRConstraint : public chomp::TSRConstraint {
                                   const chomp::Transform & pose_world_ee,
                                   chomp::MatX & jacobian,
                                   std::vector< int > & active_dims);
+
+  private:
+    //the jacobians from openrave, kept to reuse their storage.
+    std::vector< OpenRAVE::dReal > translationJacobian, rotationJacobian;
 };
 
 
@@ -96,9 +105,6 @@ class ORConstraintFactory : public chomp::ConstraintFactory {
     
     void addConstraint( chomp::Constraint * c, double start, double end );
     void removeConstraint( size_t index );
-    virtual void evaluate( const std::vector<chomp::Constraint*>& constraints, 
-                   const chomp::MatX& xi, chomp::MatX& h_tot,
-                   chomp::MatX& H_tot, int step);
 
 };
 
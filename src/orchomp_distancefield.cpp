@@ -2,6 +2,10 @@
 #include "orchomp_distancefield.h"
 #include "orchomp_mod.h"
 #include <stack>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <pthread.h>
 
 #define COLLISION -2
 #define NOCOLLISION -1
@@ -15,11 +19,36 @@
 
 namespace orchomp {
 
+//the cache directory is $ORCHOMP_SDF_CACHE if it is set, or else
+//  ~/.orchomp/sdf_cache.
+static std::string getDefaultCacheDir(){
+    const char * dir = getenv( "ORCHOMP_SDF_CACHE" );
+    if ( dir ){ return dir; }
+
+    const char * home = getenv( "HOME" );
+    if ( home ){ return std::string( home ) + "/.orchomp/sdf_cache"; }
+
+    return "";
+}
+
 
 // a simple consturctor that initializes some values
 DistanceField::DistanceField() : aabb_padding(0.2), cube_extent(0.02), 
-    splitting_threshold( 100 ), fill( OCTREEFILL )
+    band( 0 ), quantize( false ), store_gradients( true ), tiled( false ),
+    splitting_threshold( 100 ), n_threads( 1 ), fill( SCANFILL ),
+    cache_dir( getDefaultCacheDir() ), cache_max_bytes( 1024*1024*1024 )
+{
+}
+
+DistanceField::fill_t DistanceField::getFillFromName(
+                                        const std::string & name )
 {
+    if ( name == "simple" ){ return SIMPLEFILL; }
+    if ( name == "octree" ){ return OCTREEFILL; }
+    if ( name == "kdtree" ){ return KDTREEFILL; }
+    if ( name == "scan" ){ return SCANFILL; }
+
+    throw OpenRAVE::openrave_exception( "Unknown fill method: " + name );
 }
 
 //a simple test function to see if two grids are the same;
@@ -58,6 +87,19 @@ bool DistanceField::isCollided( OpenRAVE::KinBodyPtr cube,
                                             int z1, int z2 )
 {
 
+    OpenRAVE::Transform world_to_cube = 
+                        getBoxTransform( x1, x2, y1, y2, z1, z2 );
+
+    bool returnval =  isCollided( cube, world_to_cube );
+
+
+    return returnval;
+}
+
+OpenRAVE::Transform DistanceField::getBoxTransform( int x1, int x2,
+                                                    int y1, int y2,
+                                                    int z1, int z2 ) const
+{
     const int xdist = x2-x1;
     const int ydist = y2-y1;
     const int zdist = z2-z1;
@@ -71,12 +113,7 @@ bool DistanceField::isCollided( OpenRAVE::KinBodyPtr cube,
     pose_grid_cube.trans[1] = ydist*cube_extent + y1*cube_length;
     pose_grid_cube.trans[2] = zdist*cube_extent + z1*cube_length;
 
-    OpenRAVE::Transform world_to_cube = pose_world_grid * pose_grid_cube;
-
-    bool returnval =  isCollided( cube, world_to_cube );
-
-
-    return returnval;
+    return pose_world_grid * pose_grid_cube;
 }
 
 bool DistanceField::isCollided( OpenRAVE::KinBodyPtr cube,
@@ -97,7 +134,7 @@ void DistanceField::setupGrid(size_t x, size_t y, size_t z )
     grid.clear();
     grid.resize( x, y, z, DtGrid::AXIS_Z,
                  cube_extent * 2,
-                 vec3( 0,0,0));
+                 vec3( 0,0,0), getCellLayout() );
 
     start_index = size_t( aabb_padding / grid.cellSize() );
     RAVELOG_INFO( "Start index: %d\n" , start_index );
@@ -114,9 +151,10 @@ void DistanceField::getBounds( OpenRAVE::Vector & lower,
     
     lower = upper = pose_world_grid.trans;
     
-    OpenRAVE::Vector v ( grid.getLength(0),
-                         grid.getLength(1),
-                         grid.getLength(2) );
+    const Grid3_t< OpenRAVE::dReal > & layout = getLayout();
+    OpenRAVE::Vector v ( layout.getLength(0),
+                         layout.getLength(1),
+                         layout.getLength(2) );
 
     OpenRAVE::TransformMatrix rot;
     OpenRAVE::geometry::matrixFromQuat( rot, pose_world_grid.rot );
@@ -137,7 +175,7 @@ void DistanceField::getCenterFromIndex( size_t x, size_t y, size_t z,
                                                OpenRAVE::Transform & t ) const {
 
     OpenRAVE::Transform pose_grid_cube;
-    vec3 center = grid.cellCenter( x,y,z );
+    vec3 center = getLayout().cellCenter( x,y,z );
     pose_grid_cube.trans[0] = center[0];
     pose_grid_cube.trans[1] = center[1];
     pose_grid_cube.trans[2] = center[2];
@@ -155,36 +193,488 @@ void DistanceField::createField( OpenRAVE::EnvironmentBasePtr & env,
 {
     //get the environment
     this->environment = env;
+    sparse_grid.clear();
+
+    //Without a filename, the field is named by the hash of its
+    //  inputs in the cache directory.
+    SDFCache cache( filename == "NULL" ? cache_dir : "", cache_max_bytes );
+    std::string path = filename;
+
+    if ( cache.isEnabled() ){
+        path = cache.getPath( getGeometryHash() );
+        RAVELOG_INFO("Using cached distance field '%s'\n", path.c_str() );
+    }
 
     //If the filename is not null, try to load the file
-    if ( filename != "NULL" && grid.load( filename.c_str() ) )
+    if ( path != "NULL" && grid.load( path.c_str(), store_gradients ) )
     {
         RAVELOG_INFO("Loaded Distance field from file '%s'\n",
-                     filename.c_str() );
+                     path.c_str() );
 
         cube_extent = grid.cellSize() / 2;
         computeTransforms();
 
         if ( !isCorrectSize() ){
 
-            createFieldFromScratch( filename );
+            createFieldFromScratch( path );
         }
     }
     else {
-        createFieldFromScratch( filename );
+        createFieldFromScratch( path );
+    }
+
+    if ( cache.isEnabled() ){
+        cache.touch( path );
+        cache.evict( path );
+    }
+
+    if ( band > 0 ){ makeSparse( band, quantize ); }
+    else if ( quantize ){ makeSparse( grid.maxDist(), true ); }
+}
+
+void DistanceField::createEmpty( OpenRAVE::EnvironmentBasePtr & env,
+                                 const OpenRAVE::Vector & lower,
+                                 const OpenRAVE::Vector & upper,
+                                 double cube_extent, double max_dist )
+{
+    this->environment = env;
+    this->cube_extent = cube_extent;
+    aabb_padding = 0;
+    kinbody.reset();
+    sparse_grid.clear();
+
+    pose_world_grid = OpenRAVE::Transform();
+    for ( int i = 0; i < 3; i ++ ){
+        pose_world_grid.trans[i] = lower[i];
+    }
+    pose_grid_world = pose_world_grid.inverse();
+
+    size_t sizes[3];
+    for ( int i = 0; i < 3; i ++ ){
+        sizes[i] = std::max( size_t( 1 ), size_t( ceil(
+                        ( upper[i] - lower[i] ) / ( 2*cube_extent ) )));
+    }
+
+    grid.clear();
+    grid.resize( sizes[0], sizes[1], sizes[2], DtGrid::AXIS_Z,
+                 cube_extent * 2, vec3( 0,0,0 ), getCellLayout() );
+
+    for ( size_t i = 0; i < grid.size(); i ++ ){
+        grid[i] = max_dist;
+    }
+
+    grid.recomputeExtents();
+    if ( store_gradients ){ grid.computeGradients(); }
+}
+
+void DistanceField::makeSparse( double band, bool quantize )
+{
+    const size_t dense_bytes = grid.size() * ( grid.hasGradients() ? 4 : 1 )
+                             * sizeof( OpenRAVE::dReal );
+
+    sparse_grid.build( grid, band, quantize );
+    
+    //this also drops the mapping of a cached field.
+    grid.clear();
+
+    RAVELOG_INFO( "Kept %d bricks within %f of the surface, %f MB "
+                  "instead of %f MB\n", int( sparse_grid.numBricks() ),
+                  band, sparse_grid.memoryUsage() / ( 1024.0*1024.0 ),
+                  dense_bytes / ( 1024.0*1024.0 ));
+    if ( quantize ){
+        RAVELOG_INFO( "Quantized the distances to within %f\n",
+                      sparse_grid.quantizationError() );
     }
 }
 
+void DistanceField::updateOccupancy( const std::string & name,
+                                     bool occupied, double band )
+{
+    if ( isSparse() ){
+        throw OpenRAVE::openrave_exception(
+                "A sparse distance field can not be updated!");
+    }
+    if ( grid.empty() ){
+        throw OpenRAVE::openrave_exception(
+                "The distance field has not been created yet!");
+    }
+
+    timer.start( "update" );
+
+    //a body that is added again has moved, so its old cells go first.
+    size_t changed = 0;
+    std::map< std::string, AddedBody >::iterator added =
+                                            added_bodies.find( name );
+    if ( added != added_bodies.end() ){
+        const AddedBody cells = added->second;
+        added_bodies.erase( added );
+        changed = applyOccupancy( name, cells, false, band );
+        if ( !occupied ){
+            RAVELOG_INFO( "Removed %d cells of %s and updated the "
+                          "distances in %f\n", int( changed ),
+                          name.c_str(), timer.stop( "update" ));
+            return;
+        }
+    }
+
+    OpenRAVE::KinBodyPtr body = environment->GetKinBody( name );
+    if ( !body.get() ){
+        timer.stop( "update" );
+        std::string error = "Could not find kinbody named: " + name;
+        throw OpenRAVE::openrave_exception( error );
+    }
+
+    AddedBody cells;
+    if ( !scanBody( body, cells ) ){
+        RAVELOG_WARN( "%s is not inside of the distance field\n",
+                      name.c_str() );
+        timer.stop( "update" );
+        return;
+    }
+
+    changed = applyOccupancy( name, cells, occupied, band );
+    if ( occupied ){ added_bodies[ name ] = cells; }
+
+    RAVELOG_INFO( "%s %d cells of %s and updated the distances in %f\n",
+                  occupied ? "Added" : "Removed", int( changed ),
+                  name.c_str(), timer.stop( "update" ));
+}
+
+bool DistanceField::scanBody( OpenRAVE::KinBodyPtr body,
+                              AddedBody & cells ) const
+{
+    TriMesh3_t< OpenRAVE::dReal > mesh;
+    getGridMesh( body, mesh );
+
+    //the box of cells around the body, with a free cell on every side
+    //  for the flood fill.
+    const double cell_size = grid.cellSize();
+    vec3 lower( HUGE_VAL ), upper( -HUGE_VAL );
+    for ( size_t i = 0; i < mesh.verts.size(); i ++ ){
+        for ( int j = 0; j < 3; j ++ ){
+            lower[j] = std::min( lower[j], mesh.verts[i][j] );
+            upper[j] = std::max( upper[j], mesh.verts[i][j] );
+        }
+    }
+
+    int lo[3], hi[3];
+    for ( int j = 0; j < 3; j ++ ){
+        lo[j] = std::max( int( floor( lower[j] / cell_size )) - 1, 0 );
+        hi[j] = std::min( int( floor( upper[j] / cell_size )) + 2,
+                          int( grid.dims()[j] ));
+        if ( mesh.verts.empty() || lo[j] >= hi[j] ){ return false; }
+    }
+
+    //scan convert the body into a grid that just covers the box, the
+    //  same way as the scan fill.
+    DtGrid box;
+    box.resize( hi[0]-lo[0], hi[1]-lo[1], hi[2]-lo[2], DtGrid::AXIS_Z,
+                cell_size,
+                vec3( lo[0]*cell_size, lo[1]*cell_size, lo[2]*cell_size ));
+    for ( size_t i = 0; i < box.size(); i ++ ){
+        box[i] = DtGrid::DT_INF;
+    }
+    box.scanConvert( mesh );
+    for ( size_t i = 0; i < box.size(); i ++ ){
+        box[i] = ( box[i] <= cube_extent ? COLLISION : NOCOLLISION );
+    }
+    floodFill( box, 0, box.nx(), 0, box.ny(), 0, box.nz() );
+
+    cells.lo = vec3u( lo[0], lo[1], lo[2] );
+    cells.dims = box.dims();
+    cells.occupied.resize( box.size() );
+    for ( size_t k = 0; k < box.nz(); k ++ ){
+    for ( size_t j = 0; j < box.ny(); j ++ ){
+    for ( size_t i = 0; i < box.nx(); i ++ ){
+        cells.occupied[ i + box.nx()*( j + box.ny()*k ) ] = box( i,j,k ) <= 0;
+    }
+    }
+    }
+    return true;
+}
+
+size_t DistanceField::applyOccupancy( const std::string & name,
+                                      const AddedBody & cells,
+                                      bool occupied, double band )
+{
+    const vec3u & lo = cells.lo;
+    const vec3u hi = cells.lo + cells.dims;
+
+    //a cell that is given back keeps the occupancy of the kinbody of
+    //  the field, if it has one.
+    OpenRAVE::KinBodyPtr cube;
+    if ( !occupied && kinbody.get() ){
+        std::string cube_name = "unitCube";
+        cube = createCube( environment, pose_world_grid, cube_name );
+    }
+
+    //the cells of the body are written as occupancy, and every other
+    //  cell keeps its distance, whose sign is its occupancy.
+    size_t changed = 0;
+    for ( size_t z = lo[2]; z < hi[2]; z ++ ){
+    for ( size_t y = lo[1]; y < hi[1]; y ++ ){
+    for ( size_t x = lo[0]; x < hi[0]; x ++ ){
+        const size_t index = ( x - lo[0] ) + cells.dims[0] *
+                             ( ( y - lo[1] ) + cells.dims[1] * ( z - lo[2] ) );
+        if ( !cells.occupied[ index ] ){ continue; }
+        if ( !occupied && cube.get() && isCollided( cube, x, y, z ) ){
+            continue;
+        }
+
+        grid( x, y, z ) = ( occupied ? COLLISION : NOCOLLISION_EXPLORED );
+        changed ++;
+    }
+    }
+    }
+
+    if ( cube.get() ){ environment->Remove( cube ); }
+
+    //the cells of the other added bodies are occupied again.
+    if ( !occupied ){
+        for ( std::map< std::string, AddedBody >::const_iterator it =
+                                                added_bodies.begin();
+              it != added_bodies.end(); ++it )
+        {
+            if ( it->first == name ){ continue; }
+
+            const AddedBody & other = it->second;
+            size_t olo[3], ohi[3];
+            for ( int j = 0; j < 3; j ++ ){
+                olo[j] = std::max( lo[j], other.lo[j] );
+                ohi[j] = std::min( hi[j], other.lo[j] + other.dims[j] );
+            }
+            for ( size_t z = olo[2]; z < ohi[2]; z ++ ){
+            for ( size_t y = olo[1]; y < ohi[1]; y ++ ){
+            for ( size_t x = olo[0]; x < ohi[0]; x ++ ){
+                const size_t index = ( x - other.lo[0] ) + other.dims[0] *
+                                     ( ( y - other.lo[1] ) + other.dims[1] *
+                                       ( z - other.lo[2] ) );
+                if ( other.occupied[ index ] ){
+                    grid( x,y,z ) = COLLISION;
+                }
+            }
+            }
+            }
+        }
+    }
+
+    grid.updateDistsFromBinary( lo, hi,
+                                size_t( ceil( band / grid.cellSize() )),
+                                band );
+
+    return changed;
+}
+
+const Grid3_t< OpenRAVE::dReal > & DistanceField::getLayout() const
+{
+    if ( isSparse() ){ return sparse_grid; }
+    return grid;
+}
+
+OpenRAVE::dReal DistanceField::getCellDist( size_t x, size_t y,
+                                            size_t z ) const
+{
+    if ( isSparse() ){ return sparse_grid( x, y, z ); }
+    return grid( x, y, z );
+}
+
+void DistanceField::getDistRange( OpenRAVE::dReal & min,
+                                  OpenRAVE::dReal & max ) const
+{
+    if ( isSparse() ){
+        min = sparse_grid.minDist();
+        max = sparse_grid.maxDist();
+    }else {
+        min = grid.minDist();
+        max = grid.maxDist();
+    }
+}
+
+void DistanceField::createComposite(
+                    const std::vector< const DistanceField * > & fields,
+                    double cube_extent )
+{
+    if ( fields.empty() ){
+        throw OpenRAVE::openrave_exception(
+                "Need at least one distance field to merge!");
+    }
+
+    this->cube_extent = cube_extent;
+    aabb_padding = 0;
+    kinbody.reset();
+    environment = fields[0]->environment;
+    sparse_grid.clear();
+
+    //the grid covers the union of the bounds of the fields.
+    OpenRAVE::Vector lower, upper;
+    fields[0]->getBounds( lower, upper );
+    for ( size_t i = 1; i < fields.size(); i ++ ){
+        OpenRAVE::Vector field_lower, field_upper;
+        fields[i]->getBounds( field_lower, field_upper );
+        for ( int j = 0; j < 3; j ++ ){
+            lower[j] = std::min( lower[j], field_lower[j] );
+            upper[j] = std::max( upper[j], field_upper[j] );
+        }
+    }
+
+    //the grid is not rotated, so the world frame and the grid frame
+    //  only differ by the corner of the grid.
+    pose_world_grid = OpenRAVE::Transform();
+    for ( int i = 0; i < 3; i ++ ){
+        pose_world_grid.trans[i] = lower[i];
+    }
+    pose_grid_world = pose_world_grid.inverse();
+
+    size_t sizes[3];
+    for ( int i = 0; i < 3; i ++ ){
+        sizes[i] = std::max( size_t( 1 ), size_t( ceil(
+                        ( upper[i] - lower[i] ) / ( 2*cube_extent ) )));
+        RAVELOG_INFO("Composite Grid Sizes [%d]: %d\n", i, sizes[i]);
+    }
+
+    grid.clear();
+    grid.resize( sizes[0], sizes[1], sizes[2], DtGrid::AXIS_Z,
+                 cube_extent * 2, vec3( 0,0,0 ), getCellLayout() );
+
+    //every field is sampled at the centers of one xy slice of cells
+    //  at a time, so that the lookups are batched.
+    const size_t n = sizes[0] * sizes[1];
+    std::vector< OpenRAVE::dReal > x( n ), y( n ), z( n ), mins( n ),
+                                   dists( n );
+    OpenRAVE::dReal max_dist = -HUGE_VAL;
+
+    for ( size_t k = 0; k < sizes[2]; k ++ ){
+        for ( size_t j = 0; j < sizes[1]; j ++ ){
+        for ( size_t i = 0; i < sizes[0]; i ++ ){
+            const size_t index = j*sizes[0] + i;
+            const vec3 center = grid.cellCenter( i, j, k );
+            x[index] = center[0] + lower[0];
+            y[index] = center[1] + lower[1];
+            z[index] = center[2] + lower[2];
+            mins[index] = HUGE_VAL;
+        }
+        }
+
+        //only the distances are merged, so no gradients are computed.
+        for ( size_t f = 0; f < fields.size(); f ++ ){
+            fields[f]->getDists( n, &x[0], &y[0], &z[0], &dists[0],
+                                 NULL, NULL, NULL );
+            for ( size_t index = 0; index < n; index ++ ){
+                mins[index] = std::min( mins[index], dists[index] );
+            }
+        }
+
+        for ( size_t j = 0; j < sizes[1]; j ++ ){
+        for ( size_t i = 0; i < sizes[0]; i ++ ){
+            const OpenRAVE::dReal dist = mins[ j*sizes[0] + i ];
+            grid( i, j, k ) = dist;
+            if ( dist != HUGE_VAL ){ max_dist = std::max( max_dist, dist ); }
+        }
+        }
+    }
+
+    if ( max_dist == -HUGE_VAL ){
+        throw OpenRAVE::openrave_exception(
+                "The merged distance fields do not cover any cells!");
+    }
+
+    //the cells that are outside of every field, where the corners of
+    //  the bounds stick out past rotated fields, are as far from
+    //  anything as the farthest cell that is covered. Leaving them at
+    //  HUGE_VAL would make the gradients next to them infinite.
+    for ( size_t k = 0; k < sizes[2]; k ++ ){
+    for ( size_t j = 0; j < sizes[1]; j ++ ){
+    for ( size_t i = 0; i < sizes[0]; i ++ ){
+        if ( grid( i, j, k ) == HUGE_VAL ){ grid( i, j, k ) = max_dist; }
+    }
+    }
+    }
+
+    grid.recomputeExtents();
+    if ( store_gradients ){ grid.computeGradients(); }
+
+    RAVELOG_INFO( "Merged %d distance fields\n", int( fields.size() ));
+}
+
+GeometryHash DistanceField::getGeometryHash() const
+{
+    GeometryHash hash;
+
+    //the format of the saved fields, in case it changes.
+    hash.add( int( 1 ) );
+    hash.add( int( sizeof( OpenRAVE::dReal ) ) );
+
+    hash.add( double( cube_extent ) );
+    hash.add( double( aabb_padding ) );
+    hash.add( int( fill ) );
+
+    //tiled fields are larger, so they are kept apart from the others.
+    if ( tiled ){ hash.add( int( DtGrid::LAYOUT_TILED ) ); }
+
+    const OpenRAVE::Transform pose_kinbody_world = 
+                                    kinbody->GetTransform().inverse();
+
+    //the link poses come out of a product of transforms, so they pick
+    //  up rounding errors when the body is moved or loaded again. They
+    //  are hashed at a resolution far below the size of a cell.
+    const double trans_step = cube_extent * 1e-3;
+    const double rot_step = 1e-6;
+
+    const std::vector< OpenRAVE::KinBody::LinkPtr > & links =
+                                                kinbody->GetLinks();
+    for ( size_t i = 0; i < links.size(); i ++ ){
+        if ( !links[i]->IsEnabled() ){ continue; }
+
+        const OpenRAVE::Transform pose_kinbody_link = 
+                            pose_kinbody_world * links[i]->GetTransform();
+
+        //q and -q are the same rotation.
+        const double sign = ( pose_kinbody_link.rot[0] < 0 ? -1 : 1 );
+        for ( int j = 0; j < 4; j ++ ){
+            hash.addQuantized( sign * pose_kinbody_link.rot[j], rot_step );
+        }
+        for ( int j = 0; j < 3; j ++ ){
+            hash.addQuantized( pose_kinbody_link.trans[j], trans_step );
+        }
+
+        const OpenRAVE::TriMesh & data = links[i]->GetCollisionData();
+        hash.add( data.vertices.size() );
+        for ( size_t j = 0; j < data.vertices.size(); j ++ ){
+            for ( int k = 0; k < 3; k ++ ){
+                hash.add( double( data.vertices[j][k] ) );
+            }
+        }
+        hash.add( data.indices.size() );
+        for ( size_t j = 0; j < data.indices.size(); j ++ ){
+            hash.add( int( data.indices[j] ) );
+        }
+    }
+
+    return hash;
+}
+
 //this will 
 bool DistanceField::isCorrectSize(){
     
     const vec3u & dims = grid.dims();
+
+    if ( grid.layout() != getCellLayout() ){
+        RAVELOG_ERROR( "Loaded distance field does not have the "
+                       "requested layout, calculating field from "
+                       "geometry\n" );
+        return false;
+    }
     
     for ( int i = 0; i < 3; i ++ ){
 
         RAVELOG_INFO( "SDF dim[%d] has size: %d\n", i, dims[i] ); 
-        if ( ceil((aabb.extents[i] + aabb_padding) / cube_extent)
-             != dims[i] ){
+        size_t size = size_t( ceil((aabb.extents[i] + aabb_padding) 
+                                   / cube_extent ));
+        if ( tiled ){
+            size = ( size + DtGrid::TILE_MASK ) 
+                 & ~size_t( DtGrid::TILE_MASK );
+        }
+        if ( size != dims[i] ){
             RAVELOG_ERROR( "Loaded distance field does "
                             "not have the correct dimensions, "
                             "calculating field from geometry\n" );
@@ -225,9 +715,12 @@ void DistanceField::createFieldFromScratch(const std::string & filename){
     }
 
 
-    //create a cube to do collision detection
-    std::string cube_name = "unitCube";
-    unitCube = createCube( environment, pose_world_grid, cube_name);
+    //create a cube to do collision detection. The parallel fill makes
+    //  its own cubes, in the cloned environments.
+    if ( fill != SCANFILL && n_threads <= 1 ){
+        std::string cube_name = "unitCube";
+        unitCube = createCube( environment, pose_world_grid, cube_name);
+    }
 
 
     //setup the grid object for computing the occupancy grid,
@@ -240,26 +733,34 @@ void DistanceField::createFieldFromScratch(const std::string & filename){
     RAVELOG_INFO("computing occupancy grid ...\n");
     
 
-    if ( fill == SIMPLEFILL ){ startSimpleFill(); }
+    if ( fill != SCANFILL && n_threads > 1 ){ startParallelFill(); }
+    else if ( fill == SIMPLEFILL ){ startSimpleFill(); }
     else if ( fill == OCTREEFILL ){ startOctreeFill(); }
     else if ( fill == KDTREEFILL ){ startKdtreeFill(); }
+    else if ( fill == SCANFILL ){ startScanFill(); }
     
     RAVELOG_INFO( "Flood filling the occupancy grid\n");
     //floodfill the object to make sure that hollow objects do not have
     //  holes.
-    floodFill( 0, grid.nx(), 0, grid.ny(), 0, grid.nz() );
+    floodFill( grid, 0, grid.nx(), 0, grid.ny(), 0, grid.nz() );
 
     RAVELOG_INFO( "Done flood filling, computing distance field\n");
     //delete the cube , because we don't need this anymore
-    environment->Remove( unitCube );
+    if ( unitCube.get() ){
+        environment->Remove( unitCube );
+        unitCube.reset();
+    }
     
-    grid.computeDistsFromBinary();
+    grid.computeDistsFromBinary( store_gradients );
 
     RAVELOG_INFO( "Done computing distance field\n");
     
     if ( filename != "NULL" ){
         RAVELOG_INFO( "Saving distance field as '%s'\n", filename.c_str());
-        grid.save( filename.c_str() );
+        if ( !SDFCache::save( grid, filename ) ){
+            RAVELOG_WARN( "Could not save distance field to '%s'\n",
+                          filename.c_str() );
+        }
     }
 }
 
@@ -305,6 +806,13 @@ OpenRAVE::dReal DistanceField::getDist( const OpenRAVE::Vector & pos,
     //  bounds, return huge_val;
     vec3 trans( grid_point[0], grid_point[1], grid_point[2] );
 
+    if ( isSparse() ){
+        if( !sparse_grid.isInside( trans )){
+            return HUGE_VAL;
+        }
+        return sparse_grid.sample( trans, gradient );
+    }
+
     if( !grid.isInside( trans )){
         return HUGE_VAL;
     }
@@ -321,6 +829,13 @@ OpenRAVE::dReal DistanceField::getDist( const OpenRAVE::Vector & pos )
     //  bounds, return huge_val;
     vec3 trans( grid_point[0], grid_point[1], grid_point[2] );
 
+    if ( isSparse() ){
+        if( !sparse_grid.isInside( trans )){
+            return HUGE_VAL;
+        }
+        return sparse_grid.sample( trans );
+    }
+
     if( !grid.isInside( trans )){
         return HUGE_VAL;
     }
@@ -329,18 +844,84 @@ OpenRAVE::dReal DistanceField::getDist( const OpenRAVE::Vector & pos )
 }
 
 
-//fills the reachable area with NOCOLLISION_EXPLORED
-void DistanceField::floodFill(int x1, int x2, 
-                              int y1, int y2,
-                              int z1, int z2 ){
+void DistanceField::getDists( size_t n, const OpenRAVE::dReal * x,
+                                         const OpenRAVE::dReal * y,
+                                         const OpenRAVE::dReal * z,
+                               OpenRAVE::dReal * dists,
+                               OpenRAVE::dReal * gx,
+                               OpenRAVE::dReal * gy,
+                               OpenRAVE::dReal * gz ) const
+{
+    //the points are moved into the grid frame in blocks, so that the
+    //  scratch space fits on the stack.
+    const size_t BLOCK = 64;
+    OpenRAVE::dReal grid_x[BLOCK], grid_y[BLOCK], grid_z[BLOCK];
+
+    const OpenRAVE::TransformMatrix m( pose_grid_world );
+    const DtGrid::Box3 box = getLayout().bbox();
+
+    for ( size_t start = 0; start < n; start += BLOCK ){
+        const size_t size = std::min( BLOCK, n - start );
+
+        OpenRAVE::dReal * block_gx = gx ? gx + start : NULL;
+        OpenRAVE::dReal * block_gy = gy ? gy + start : NULL;
+        OpenRAVE::dReal * block_gz = gz ? gz + start : NULL;
+
+        for ( size_t i = 0; i < size; i ++ ){
+            const size_t k = start + i;
+            grid_x[i] = m.m[0]*x[k] + m.m[1]*y[k] + m.m[2]*z[k]
+                      + m.trans[0];
+            grid_y[i] = m.m[4]*x[k] + m.m[5]*y[k] + m.m[6]*z[k]
+                      + m.trans[1];
+            grid_z[i] = m.m[8]*x[k] + m.m[9]*y[k] + m.m[10]*z[k]
+                      + m.trans[2];
+        }
+
+        if ( isSparse() ){
+            sparse_grid.sample( size, grid_x, grid_y, grid_z, dists + start,
+                                block_gx, block_gy, block_gz );
+        }else {
+            grid.sample( size, grid_x, grid_y, grid_z, dists + start,
+                         block_gx, block_gy, block_gz );
+        }
+
+        //check the bounds of the box, the same way as getDist.
+        for ( size_t i = 0; i < size; i ++ ){
+            if ( box.p0[0] > grid_x[i] || box.p1[0] < grid_x[i] ||
+                 box.p0[1] > grid_y[i] || box.p1[1] < grid_y[i] ||
+                 box.p0[2] > grid_z[i] || box.p1[2] < grid_z[i] ){
+                dists[ start + i ] = HUGE_VAL;
+            }
+        }
+    }
+}
+
+
+//fills the area that is reachable from the faces of the box with
+//  NOCOLLISION_EXPLORED
+void DistanceField::floodFill( DtGrid & grid,
+                               int x1, int x2, 
+                               int y1, int y2,
+                               int z1, int z2 ){
 
     vec3u lower( x1,y1,z1 ), upper( x2,y2,z2 );
 
     std::stack< vec3u > stack;
-    stack.push( vec3u( x1,y1,z1 ) );
 
-    assert( grid(x1,y1,z1) == NOCOLLISION );
-    grid(x1,y1,z1) = NOCOLLISION_EXPLORED;
+    //start from every free cell on the faces, in case the object
+    //  reaches past some of them.
+    for ( int i = x1; i < x2; i ++ ){
+    for ( int j = y1; j < y2; j ++ ){
+    for ( int k = z1; k < z2; k ++ ){
+        const bool face = i == x1 || i == x2-1 || j == y1 || j == y2-1 ||
+                          k == z1 || k == z2-1;
+        if ( face && grid( i,j,k ) == NOCOLLISION ){
+            grid( i,j,k ) = NOCOLLISION_EXPLORED;
+            stack.push( vec3u( i,j,k ) );
+        }
+    }
+    }
+    }
     
     while( !stack.empty() ){
         
@@ -410,11 +991,18 @@ DistanceField::createCube( OpenRAVE::EnvironmentBasePtr & env,
 
 
 OpenRAVE::KinBodyPtr DistanceField::createCube( int xdist, int ydist, int zdist )
+{
+    return createCube( environment, xdist, ydist, zdist );
+}
+
+OpenRAVE::KinBodyPtr DistanceField::createCube( 
+                                    OpenRAVE::EnvironmentBasePtr env,
+                                    int xdist, int ydist, int zdist )
 {
 
     //create a cube to be used for collision detection in the world.
     //  create an object and name that object 'cube'
-    OpenRAVE::KinBodyPtr cube = RaveCreateKinBody( environment );
+    OpenRAVE::KinBodyPtr cube = RaveCreateKinBody( env );
 
     std::stringstream ss;
     ss   << kinbody->GetName() << "_"
@@ -437,7 +1025,7 @@ OpenRAVE::KinBodyPtr DistanceField::createCube( int xdist, int ydist, int zdist
     cube->InitFromBoxes(vaabbs, false);
     
     //add the cube to the environment
-    environment->Add( cube );
+    env->Add( cube );
 
     return cube;
 
@@ -456,6 +1044,8 @@ void DistanceField::startSimpleFill(){
     RAVELOG_INFO("Time to compute collisions for SimpleFill(): %f\n" , 
                  timer.reset( "collision" ) );
 
+    logFillRate( "SimpleFill" );
+
 }
 void DistanceField::startOctreeFill(){
     timer.start( "fill" );
@@ -470,6 +1060,8 @@ void DistanceField::startOctreeFill(){
     RAVELOG_INFO("Time to compute collisions for OctreeFill(): %f\n" , 
                  timer.reset( "collision" ) );
 
+    logFillRate( "OctreeFill" );
+
 }
 
 
@@ -491,6 +1083,60 @@ void DistanceField::startKdtreeFill(){
     RAVELOG_INFO("Time to compute collisions for KdtreeFill(): %f\n" , 
                  timer.reset( "collision" ) );
 
+    logFillRate( "KdtreeFill" );
+
+}
+
+void DistanceField::startScanFill(){
+    timer.start( "fill" );
+
+    TriMesh3_t< OpenRAVE::dReal > mesh;
+    getGridMesh( kinbody, mesh );
+
+    //the grid starts out empty, and the scan conversion stores the
+    //  signed distance of every cell near the surface.
+    for ( size_t i = 0; i < grid.size(); i ++ ){
+        grid[i] = DtGrid::DT_INF;
+    }
+    grid.scanConvert( mesh );
+
+    //A cell is occupied if it is inside of the mesh, or if the
+    //  surface passes within half a cell of its center. The cells on
+    //  the surface form a closed shell, so the flood fill still fills
+    //  hollow objects.
+    for ( size_t i = 0; i < grid.size(); i ++ ){
+        grid[i] = ( grid[i] <= cube_extent ? COLLISION : NOCOLLISION );
+    }
+
+    RAVELOG_INFO("Time to compute ScanFill() with %d triangles: %f\n" , 
+                 int( mesh.faces.size() ), timer.stop( "fill" ) );
+
+    logFillRate( "ScanFill" );
+}
+
+void DistanceField::getGridMesh( OpenRAVE::KinBodyPtr body,
+                                 TriMesh3_t< OpenRAVE::dReal > & mesh ) const
+{
+    const std::vector< OpenRAVE::KinBody::LinkPtr > & links =
+                                                    body->GetLinks();
+    for ( size_t i = 0; i < links.size(); i ++ ){
+        if ( !links[i]->IsEnabled() ){ continue; }
+
+        const OpenRAVE::TriMesh & data = links[i]->GetCollisionData();
+        const OpenRAVE::Transform pose_grid_link =
+                                pose_grid_world * links[i]->GetTransform();
+        const size_t base = mesh.verts.size();
+
+        for ( size_t j = 0; j < data.vertices.size(); j ++ ){
+            const OpenRAVE::Vector v = pose_grid_link * data.vertices[j];
+            mesh.addVertex( v[0], v[1], v[2] );
+        }
+        for ( size_t j = 0; j + 2 < data.indices.size(); j += 3 ){
+            mesh.addTriangle( base + data.indices[j],
+                              base + data.indices[j+1],
+                              base + data.indices[j+2] );
+        }
+    }
 }
 
 void DistanceField::setGrid( int x1, int x2, int y1, int y2, int z1, int z2, int value ){
@@ -797,4 +1443,342 @@ void DistanceField::kdtreefill( Bound b, int AXIS){
 
 }
 
+void DistanceField::logFillRate( const char * name ){
+    const size_t n_cells = ( end_index[0] - start_index ) *
+                           ( end_index[1] - start_index ) *
+                           ( end_index[2] - start_index );
+    const double seconds = timer.getWallElapsed( "fill" );
+    
+    RAVELOG_INFO( "%s() filled %d cells in %f s (wall), %f cells per "
+                  "second\n", name, int( n_cells ), seconds,
+                  ( seconds > 0 ? n_cells / seconds : 0.0 ) );
+}
+
+
+//a box of cells to fill, and for the kdtree fill, the last axis that
+//  it was split along.
+struct DistanceField::FillTask {
+    int bounds[6];
+    int axis;
+};
+
+struct DistanceField::FillWorker {
+    FillPool * pool;
+    size_t index;
+
+    //this worker's copy of the environment, and of the kinbody in it.
+    OpenRAVE::EnvironmentBasePtr env;
+    OpenRAVE::KinBodyPtr kinbody;
+
+    //the cubes that have been made in env, by their dimensions.
+    std::map< std::vector< int >, OpenRAVE::KinBodyPtr > cubes;
+
+    //the tasks are taken from the back by this worker, and from the
+    //  front by the others, so the others get the larger boxes.
+    std::deque< FillTask > tasks;
+    pthread_mutex_t mutex;
+
+    size_t n_queries;
+    bool failed;
+    std::string error;
+};
+
+struct DistanceField::FillPool {
+    DistanceField * field;
+    std::vector< FillWorker > workers;
+
+    //the number of tasks that are queued or being run. The fill is
+    //  done when this reaches 0.
+    int outstanding;
+
+    //the number of times that tasks have been queued. A worker with
+    //  nothing to do waits on cond until this changes, or the fill is
+    //  done.
+    unsigned long pushes;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void DistanceField::startParallelFill(){
+    timer.start( "fill" );
+
+    FillPool pool;
+    pool.field = this;
+    pool.outstanding = 0;
+    pool.pushes = 0;
+    pool.workers.resize( n_threads );
+    pthread_mutex_init( &pool.mutex, NULL );
+    pthread_cond_init( &pool.cond, NULL );
+
+    //clone the environment for every worker, while nothing else can
+    //  change it.
+    timer.start( "clone" );
+    {
+        OpenRAVE::EnvironmentMutex::scoped_lock lock(
+                                            environment->GetMutex() );
+        for ( size_t i = 0; i < n_threads; i ++ ){
+            FillWorker & worker = pool.workers[i];
+            worker.pool = &pool;
+            worker.index = i;
+            worker.env = environment->CloneSelf( OpenRAVE::Clone_Bodies );
+            worker.kinbody = worker.env->GetKinBody( kinbody->GetName() );
+            worker.n_queries = 0;
+            worker.failed = false;
+            pthread_mutex_init( &worker.mutex, NULL );
+        }
+    }
+    
+    timer.stop( "clone" );
+    RAVELOG_INFO("Time to clone %d environments: %f\n", int( n_threads ),
+                 timer.getWallElapsed( "clone" ) );
+
+    //a worker without the kinbody fails its first task, and the
+    //  error is reported once all of the workers are done.
+    for ( size_t i = 0; i < n_threads; i ++ ){
+        if ( !pool.workers[i].kinbody.get() ){
+            pool.workers[i].failed = true;
+            pool.workers[i].error = "Could not find " + kinbody->GetName()
+                                    + " in a cloned environment";
+        }
+    }
+
+    //The simple fill has one task per x slice. The others start with
+    //  the whole box, and split it up as they go.
+    std::deque< FillTask > & first = pool.workers[0].tasks;
+    if ( fill == SIMPLEFILL ){
+        for ( size_t x = start_index; x < end_index[0]; x ++ ){
+            FillTask task = { { int(x), int(x+1), 
+                                int(start_index), int(end_index[1]),
+                                int(start_index), int(end_index[2]) },
+                              ZAXIS };
+            first.push_back( task );
+        }
+    }
+    else {
+        FillTask task = { { int(start_index), int(end_index[0]), 
+                            int(start_index), int(end_index[1]),
+                            int(start_index), int(end_index[2]) },
+                          ZAXIS };
+        first.push_back( task );
+    }
+    pool.outstanding = first.size();
+
+    //the first worker runs on the calling thread. If a thread cannot
+    //  be created, the other workers take its tasks.
+    std::vector< pthread_t > threads( n_threads );
+    std::vector< bool > started( n_threads, false );
+    for ( size_t i = 1; i < n_threads; i ++ ){
+        started[i] = ( pthread_create( &threads[i], NULL, &fillThread,
+                                       &pool.workers[i] ) == 0 );
+    }
+    fillThread( &pool.workers[0] );
+    for ( size_t i = 1; i < n_threads; i ++ ){
+        if ( started[i] ){ pthread_join( threads[i], NULL ); }
+    }
+
+    timer.stop( "fill" );
+
+    size_t n_queries = 0;
+    std::string error;
+    for ( size_t i = 0; i < n_threads; i ++ ){
+        FillWorker & worker = pool.workers[i];
+        n_queries += worker.n_queries;
+        if ( worker.failed ){ error = worker.error; }
+
+        pthread_mutex_destroy( &worker.mutex );
+        worker.cubes.clear();
+        worker.kinbody.reset();
+        worker.env->Destroy();
+        worker.env.reset();
+    }
+    pthread_cond_destroy( &pool.cond );
+    pthread_mutex_destroy( &pool.mutex );
+
+    if ( !error.empty() ){
+        throw OpenRAVE::openrave_exception( error );
+    }
+
+    RAVELOG_INFO("Time to compute parallel fill with %d threads: %f, "
+                 "%d collision checks\n", int( n_threads ),
+                 timer.getWallElapsed( "fill" ), int( n_queries ) );
+
+    logFillRate( "ParallelFill" );
+}
+
+void * DistanceField::fillThread( void * arg ){
+    FillWorker & worker = *static_cast< FillWorker * >( arg );
+    FillPool & pool = *worker.pool;
+    const size_t n_workers = pool.workers.size();
+
+    OpenRAVE::EnvironmentMutex::scoped_lock lock( worker.env->GetMutex() );
+
+    while ( true ){
+        FillTask task;
+        bool found = false;
+
+        pthread_mutex_lock( &pool.mutex );
+        const unsigned long pushes = pool.pushes;
+        pthread_mutex_unlock( &pool.mutex );
+
+        //take a task from the back of this worker's queue, or else
+        //  from the front of someone else's.
+        for ( size_t i = 0; i < n_workers && !found; i ++ ){
+            FillWorker & other = pool.workers[ (worker.index + i) 
+                                                % n_workers ];
+            pthread_mutex_lock( &other.mutex );
+            if ( !other.tasks.empty() ){
+                if ( i == 0 ){
+                    task = other.tasks.back();
+                    other.tasks.pop_back();
+                }else {
+                    task = other.tasks.front();
+                    other.tasks.pop_front();
+                }
+                found = true;
+            }
+            pthread_mutex_unlock( &other.mutex );
+        }
+
+        //wait for the other workers to queue more tasks, unless they
+        //  have since the queues were looked at.
+        if ( !found ){
+            pthread_mutex_lock( &pool.mutex );
+            while ( pool.outstanding > 0 && pool.pushes == pushes ){
+                pthread_cond_wait( &pool.cond, &pool.mutex );
+            }
+            const bool done = ( pool.outstanding == 0 );
+            pthread_mutex_unlock( &pool.mutex );
+
+            if ( done ){ break; }
+            continue;
+        }
+
+        try {
+            if ( !worker.failed ){ pool.field->runFillTask( worker, task ); }
+        }catch ( const std::exception & e ){
+            worker.failed = true;
+            worker.error = e.what();
+        }
+
+        pthread_mutex_lock( &pool.mutex );
+        if ( --pool.outstanding == 0 ){
+            pthread_cond_broadcast( &pool.cond );
+        }
+        pthread_mutex_unlock( &pool.mutex );
+    }
+
+    return NULL;
+}
+
+bool DistanceField::isCollided( FillWorker & worker,
+                                int x1, int x2,
+                                int y1, int y2,
+                                int z1, int z2 )
+{
+    std::vector< int > dims( 3 );
+    dims[0] = x2 - x1;
+    dims[1] = y2 - y1;
+    dims[2] = z2 - z1;
+
+    OpenRAVE::KinBodyPtr & cube = worker.cubes[ dims ];
+    if ( !cube.get() ){
+        cube = createCube( worker.env, dims[0], dims[1], dims[2] );
+    }
+
+    worker.n_queries ++;
+    cube->SetTransform( getBoxTransform( x1, x2, y1, y2, z1, z2 ) );
+    return worker.env->CheckCollision( cube, worker.kinbody );
+}
+
+void DistanceField::runFillTask( FillWorker & worker,
+                                 const FillTask & task )
+{
+    const int * b = task.bounds;
+    const int dists[3] = { b[1] - b[0], b[3] - b[2], b[5] - b[4] };
+
+    //small boxes are checked one cell at a time. Every task covers
+    //  its own cells, so the workers never write to the same cell.
+    if ( fill == SIMPLEFILL || 
+         splitting_threshold > dists[0] * dists[1] * dists[2] ||
+         ( dists[0] == 1 && dists[1] == 1 && dists[2] == 1 ) )
+    {
+        for ( int i = b[0]; i < b[1]; i ++ ){
+        for ( int j = b[2]; j < b[3]; j ++ ){
+        for ( int k = b[4]; k < b[5]; k ++ ){
+            grid( i, j, k ) = 
+                ( isCollided( worker, i, i+1, j, j+1, k, k+1 ) ?
+                  COLLISION : NOCOLLISION );
+        }
+        }
+        }
+        return;
+    }
+
+    //split the box the same way as octreefill or kdtreefill.
+    std::vector< FillTask > children;
+
+    if ( fill == OCTREEFILL ){
+        int mid[3];
+        for ( int a = 0; a < 3; a ++ ){
+            mid[a] = b[2*a] + ( dists[a] - 1 )/2 + 1;
+        }
+        for ( int octant = 0; octant < 8; octant ++ ){
+            FillTask child;
+            child.axis = task.axis;
+            bool valid = true;
+            for ( int a = 0; a < 3; a ++ ){
+                const bool upper = ( octant >> a ) & 1;
+                if ( upper && dists[a] <= 1 ){ valid = false; }
+                child.bounds[2*a] = upper ? mid[a] : b[2*a];
+                child.bounds[2*a+1] = upper ? b[2*a+1] : mid[a];
+            }
+            if ( valid ){ children.push_back( child ); }
+        }
+    }
+    else {
+        int axis = task.axis;
+        for ( int i = 0; i < 3; i ++ ){
+            axis = ( axis + 1 ) % 3;
+            if ( dists[axis] > 1 ){ break; }
+        }
+        const int mid = b[2*axis] + ( dists[axis] - 1 )/2 + 1;
+
+        FillTask lower = task, upper = task;
+        lower.axis = upper.axis = axis;
+        lower.bounds[2*axis+1] = mid;
+        upper.bounds[2*axis] = mid;
+        children.push_back( lower );
+        children.push_back( upper );
+    }
+
+    std::vector< FillTask > colliding;
+    for ( size_t i = 0; i < children.size(); i ++ ){
+        const int * c = children[i].bounds;
+        if ( isCollided( worker, c[0], c[1], c[2], c[3], c[4], c[5] ) ){
+            colliding.push_back( children[i] );
+        }else {
+            setGrid( c[0], c[1], c[2], c[3], c[4], c[5], NOCOLLISION );
+        }
+    }
+
+    //count the new tasks before they can be taken, so that the pool
+    //  is never seen as empty while there is work left.
+    pthread_mutex_lock( &worker.pool->mutex );
+    worker.pool->outstanding += colliding.size();
+    pthread_mutex_unlock( &worker.pool->mutex );
+
+    pthread_mutex_lock( &worker.mutex );
+    for ( size_t i = 0; i < colliding.size(); i ++ ){
+        worker.tasks.push_back( colliding[i] );
+    }
+    pthread_mutex_unlock( &worker.mutex );
+
+    if ( !colliding.empty() ){
+        pthread_mutex_lock( &worker.pool->mutex );
+        worker.pool->pushes ++;
+        pthread_cond_broadcast( &worker.pool->cond );
+        pthread_mutex_unlock( &worker.pool->mutex );
+    }
+}
+
 } // namespace orchomp
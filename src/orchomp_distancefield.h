@@ -3,9 +3,12 @@
 
 
 #include "chomp-multigrid/mzcommon/DtGrid.h"
+#include "chomp-multigrid/mzcommon/SparseDtGrid.h"
 #include <openrave/openrave.h>
 #include <openrave/planningutils.h>
 #include "utils/timer.h"
+#include "orchomp_sdf_cache.h"
+#include <map>
 
 namespace orchomp{
 
@@ -14,6 +17,9 @@ typedef vec3_t< OpenRAVE::dReal > vec3;
 // The structure that holds the distance field, and the gradients
 typedef DtGrid_t<OpenRAVE::dReal> DtGrid;
 
+// The narrow band copy of the distance field.
+typedef SparseDtGrid_t<OpenRAVE::dReal> SparseDtGrid;
+
 class DistanceField{
 
     //a small helper struct to keep track of bounds for the
@@ -68,16 +74,127 @@ public:
     
     DtGrid grid;
 
+    //if the field has been made sparse, this holds the distances, and
+    //  grid is empty.
+    SparseDtGrid sparse_grid;
+
+    //when this is more than zero, createField only keeps the parts of
+    //  the field that are closer than this to the surface, and
+    //  everything farther away reads as this distance. It has to be
+    //  more than the largest sphere radius plus epsilon, plus a cell
+    //  for the gradients, or the collision costs change, so the
+    //  collider refuses a field with a smaller band.
+    double band;
+
+    //store the sparse field as 16 bit distances instead of doubles.
+    //  Without a band, every brick of the field is kept.
+    bool quantize;
+
+    //keep the gradient of every cell of a dense field. Without them,
+    //  the field takes a quarter of the memory, and the gradient of a
+    //  query is that of the interpolated distances.
+    bool store_gradients;
+
+    //store the cells of the dense field in 4x4x4 tiles, so that the
+    //  cells around a query are close together in memory. The grid is
+    //  rounded up to whole tiles.
+    bool tiled;
+
     int splitting_threshold;
+
+    //the number of threads used by the simple, octree, and kdtree
+    //  fills. With more than one, every thread checks for collisions
+    //  in its own clone of the environment.
+    size_t n_threads;
+
+    //the ways of computing the occupancy grid. SCANFILL scan converts
+    //  the kinbody's collision meshes straight into the grid, the
+    //  others place a cube in the environment and check it for
+    //  collisions with the kinbody.
+    enum fill_t { SIMPLEFILL,
+                  OCTREEFILL,
+                  KDTREEFILL,
+                  SCANFILL,
+                };
+    
+    fill_t fill;
+
+    //get the fill method from its name: simple, octree, kdtree or
+    //  scan. Throws an openrave_exception if the name is not known.
+    static fill_t getFillFromName( const std::string & name );
+
+    //the directory that fields are cached in when no filename is
+    //  given to createField, and the most that the cached fields can
+    //  use, in bytes. An empty directory disables the cache.
+    std::string cache_dir;
+    size_t cache_max_bytes;
     
     //PUBLIC FUNCTIONS:
 
     // a simple constructor that just initializes some values.
     DistanceField();
     
-    //the main function that creates the distance field
+    //the main function that creates the distance field. If filename
+    //  is "NULL", the field is looked up in the cache directory.
     void createField( OpenRAVE::EnvironmentBasePtr & environment,
                       const std::string & filename="NULL");
+
+    //make this field the pointwise minimum of the given fields,
+    //  resampled once into a grid that is aligned with the world axes
+    //  and covers all of them, so that a point costs one lookup
+    //  instead of one per field. The result has no kinbody, so it is
+    //  only right for as long as the merged bodies do not move.
+    //  cube_extent is half the width of a cell of the new grid.
+    void createComposite( const std::vector< const DistanceField * > & fields,
+                          double cube_extent );
+
+    //make this a field that is aligned with the world axes, covers the
+    //  box from lower to upper, and has nothing in it: every distance
+    //  is max_dist. It has no kinbody. See PointCloudStream.
+    void createEmpty( OpenRAVE::EnvironmentBasePtr & environment,
+                      const OpenRAVE::Vector & lower,
+                      const OpenRAVE::Vector & upper,
+                      double cube_extent, double max_dist );
+
+    //replace the dense grid with a narrow band copy of it. See band
+    //  and quantize.
+    void makeSparse( double band, bool quantize=false );
+
+    bool isSparse() const { return !sparse_grid.empty(); }
+
+    //add the occupancy of the named kinbody to the field, or take it
+    //  away, and update the distances within band of its bounding
+    //  box, instead of computing the whole field again. Removing a
+    //  body that was added here clears the cells that it was added
+    //  with, so it may have moved or left the environment since.
+    //  Adding it again moves it. Any other body is scan converted
+    //  where it is now. Afterwards, the distances of less than band
+    //  are exact, and the others are at least band. The cached copy
+    //  of the field is not changed. Throws an openrave_exception if
+    //  the field is sparse, or the body has to be scan converted and
+    //  is not in the environment.
+    void updateOccupancy( const std::string & name, bool occupied,
+                          double band );
+
+    //the dimensions, origin and cell size of the field, whether it is
+    //  dense or sparse.
+    const Grid3_t< OpenRAVE::dReal > & getLayout() const;
+
+    //the distance stored at the cell with the given indices.
+    OpenRAVE::dReal getCellDist( size_t x, size_t y, size_t z ) const;
+
+    //the smallest and largest distances in the field.
+    void getDistRange( OpenRAVE::dReal & min, OpenRAVE::dReal & max ) const;
+
+    //the order of the cells of the dense grid. See tiled.
+    DtGrid::Layout getCellLayout() const {
+        return tiled ? DtGrid::LAYOUT_TILED : DtGrid::LAYOUT_LINEAR;
+    }
+
+    //the hash of everything that the field is computed from: the
+    //  collision geometry of the kinbody in its own frame, the
+    //  resolution, the padding, and the fill method.
+    GeometryHash getGeometryHash() const;
     
     ~DistanceField(){}
 
@@ -85,6 +202,18 @@ public:
                                      vec3 & gradient);
     OpenRAVE::dReal getDist( const OpenRAVE::Vector & pos);
 
+    //get the distances and gradients of n points at once, given as
+    //  separate x, y and z arrays. Like getDist, points outside of the
+    //  field get a distance of HUGE_VAL. The gradient arrays may all
+    //  be NULL.
+    void getDists( size_t n, const OpenRAVE::dReal * x,
+                             const OpenRAVE::dReal * y,
+                             const OpenRAVE::dReal * z,
+                   OpenRAVE::dReal * dists,
+                   OpenRAVE::dReal * gx,
+                   OpenRAVE::dReal * gy,
+                   OpenRAVE::dReal * gz ) const;
+
     //gets the transform from the origin to the center of the cell at
     //  the specified indices.
     void getCenterFromIndex( size_t x, size_t y, size_t z,
@@ -99,13 +228,6 @@ private:
 
     OpenRAVE::geometry::aabb< OpenRAVE::dReal > aabb;
     
-    enum fill_t { SIMPLEFILL,
-                  OCTREEFILL,
-                  KDTREEFILL,
-                };
-    
-    fill_t fill;
-    
 
     bool isCorrectSize();
 
@@ -143,6 +265,8 @@ private:
                                 bool visible = false);
 
     OpenRAVE::KinBodyPtr createCube( int xdist, int ydist, int zdist );
+    OpenRAVE::KinBodyPtr createCube( OpenRAVE::EnvironmentBasePtr env,
+                                     int xdist, int ydist, int zdist );
 
     void binaryFill();
     
@@ -154,9 +278,61 @@ private:
     void startSimpleFill();
     void startOctreeFill();
     void startKdtreeFill();
+    void startScanFill();
+
+    //log how quickly a fill went through the cells of the grid.
+    void logFillRate( const char * name );
+
+    //The parallel versions of the collision checking fills. The
+    //  recursion is split into tasks, which the threads take from
+    //  each other's queues when their own run out.
+    struct FillTask;
+    struct FillWorker;
+    struct FillPool;
+
+    void startParallelFill();
+    static void * fillThread( void * arg );
+    void runFillTask( FillWorker & worker, const FillTask & task );
+    bool isCollided( FillWorker & worker, 
+                     int x1, int x2, int y1, int y2, int z1, int z2 );
+
+    //the transform from the world to the center of the box of cells
+    //  [x1,x2) x [y1,y2) x [z1,z2).
+    OpenRAVE::Transform getBoxTransform( int x1, int x2,
+                                         int y1, int y2,
+                                         int z1, int z2 ) const;
 
     //flood fill all of the reachable vaoxels in the grid.
-    void floodFill( int x1, int x2, int y1, int y2, int z1, int z2 );
+    static void floodFill( DtGrid & grid,
+                           int x1, int x2, int y1, int y2, int z1, int z2 );
+
+    //the collision meshes of the enabled links of body, in the grid
+    //  frame.
+    void getGridMesh( OpenRAVE::KinBodyPtr body,
+                      TriMesh3_t< OpenRAVE::dReal > & mesh ) const;
+
+    //the cells that updateOccupancy added for a body: the box of
+    //  cells from lo to lo + dims, and which of them the body occupies.
+    struct AddedBody {
+        vec3u lo, dims;
+        std::vector< bool > occupied;
+    };
+
+    //the bodies that have been added and not removed, by name, so that
+    //  removing a body does not clear the cells of another one that
+    //  overlaps it.
+    std::map< std::string, AddedBody > added_bodies;
+
+    //the cells that body occupies where it is now. Returns false if
+    //  it is not inside of the field.
+    bool scanBody( OpenRAVE::KinBodyPtr body, AddedBody & cells ) const;
+
+    //write the cells of the named body as occupied or free, put back
+    //  the other added bodies, and update the distances around them.
+    //  Returns the number of cells that were written.
+    size_t applyOccupancy( const std::string & name,
+                           const AddedBody & cells,
+                           bool occupied, double band );
 
     //fills the grid by simple iterating over every point and checking
     //  for collision.
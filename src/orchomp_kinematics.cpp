@@ -0,0 +1,283 @@
+#include "orchomp_kinematics.h"
+#include <Eigen/Dense>
+
+namespace orchomp {
+
+typedef Eigen::Matrix< double, 3, 3, Eigen::RowMajor > Rotation;
+typedef Eigen::Map< Rotation > RotationMap;
+typedef Eigen::Map< const Rotation > ConstRotationMap;
+typedef Eigen::Map< Eigen::Vector3d > VectorMap;
+typedef Eigen::Map< const Eigen::Vector3d > ConstVectorMap;
+
+
+KinematicChain::KinematicChain( OpenRAVE::RobotBasePtr robot,
+                                const std::vector< Sphere > & spheres ) :
+    n_joints( robot->GetActiveDOFIndices().size() ),
+    n_spheres( spheres.size() )
+{
+
+    //the active dof indices leave out the affine dofs of the base,
+    //  which the chain does not model.
+    if ( robot->GetAffineDOF() != 0 ){
+        throw OpenRAVE::openrave_exception(
+            "The native kinematics does not support an active base." );
+    }
+
+    const std::vector< int > & dofs = robot->GetActiveDOFIndices();
+    std::vector< OpenRAVE::dReal > values;
+    robot->GetActiveDOFValues( values );
+
+    std::vector< OpenRAVE::KinBody::JointPtr > joints( n_joints );
+    joint_type.resize( n_joints );
+    joint_parent.resize( n_joints, -1 );
+    joint_reference.resize( n_joints );
+    joint_axis.resize( 3*n_joints );
+    joint_anchor.resize( 3*n_joints );
+
+    //get the axis and anchor of every active joint at the current
+    //  configuration.
+    for ( size_t i = 0; i < n_joints; i ++ ){
+        OpenRAVE::KinBody::JointPtr joint =
+                                    robot->GetJointFromDOFIndex( dofs[i] );
+
+        if ( !joint || joint->GetDOF() != 1 || joint->IsMimic() ){
+            throw OpenRAVE::openrave_exception(
+                "The native kinematics only supports single dof joints "
+                "that are not mimic joints." );
+        }
+
+        if ( joint->IsRevolute( 0 ) ){ joint_type[i] = REVOLUTE; }
+        else if ( joint->IsPrismatic( 0 ) ){ joint_type[i] = PRISMATIC; }
+        else {
+            throw OpenRAVE::openrave_exception(
+                "The native kinematics only supports revolute and "
+                "prismatic joints." );
+        }
+
+        const OpenRAVE::Vector axis = joint->GetAxis( 0 );
+        const OpenRAVE::Vector anchor = joint->GetAnchor();
+        for ( size_t k = 0; k < 3; k ++ ){
+            joint_axis[3*i + k] = axis[k];
+            joint_anchor[3*i + k] = anchor[k];
+        }
+        joint_reference[i] = values[i];
+        joints[i] = joint;
+    }
+
+    //find the active joints that move each joint. The ancestors of a
+    //  joint form a chain, so the closest one is the one with the most
+    //  ancestors of its own.
+    std::vector< std::vector< int > > ancestors( n_joints );
+    for ( size_t i = 0; i < n_joints; i ++ ){
+        const int parent_link =
+                    joints[i]->GetHierarchyParentLink()->GetIndex();
+
+        for ( size_t k = 0; k < n_joints; k ++ ){
+            if ( k != i && robot->DoesAffect( joints[k]->GetJointIndex(),
+                                              parent_link ) ){
+                ancestors[i].push_back( k );
+            }
+        }
+    }
+
+    for ( size_t i = 0; i < n_joints; i ++ ){
+        size_t depth = 0;
+        for ( size_t k = 0; k < ancestors[i].size(); k ++ ){
+            const int ancestor = ancestors[i][k];
+            if ( joint_parent[i] < 0 ||
+                 ancestors[ ancestor ].size() >= depth ){
+                joint_parent[i] = ancestor;
+                depth = ancestors[ ancestor ].size();
+            }
+        }
+    }
+
+    joint_moves.resize( n_joints * n_joints, 0 );
+    for ( size_t i = 0; i < n_joints; i ++ ){
+        joint_moves[ i*n_joints + i ] = 1;
+        for ( size_t k = 0; k < ancestors[i].size(); k ++ ){
+            joint_moves[ i*n_joints + ancestors[i][k] ] = 1;
+        }
+    }
+
+    //parents must be computed before their children, so sort the
+    //  joints by the number of ancestors.
+    joint_order.resize( n_joints );
+    for ( size_t i = 0; i < n_joints; i ++ ){ joint_order[i] = i; }
+    for ( size_t i = 1; i < n_joints; i ++ ){
+        for ( size_t j = i; j > 0 && ancestors[ joint_order[j] ].size() <
+                                     ancestors[ joint_order[j-1] ].size();
+              j -- )
+        {
+            std::swap( joint_order[j], joint_order[j-1] );
+        }
+    }
+
+    //get the closest joint that moves each sphere, and the position of
+    //  the sphere at the current configuration.
+    sphere_joint.resize( n_spheres, -1 );
+    sphere_reference.resize( 3*n_spheres );
+
+    for ( size_t i = 0; i < n_spheres; i ++ ){
+        const Sphere & sphere = spheres[i];
+
+        size_t depth = 0;
+        for ( size_t k = 0; k < n_joints; k ++ ){
+            if ( !robot->DoesAffect( joints[k]->GetJointIndex(),
+                                     sphere.linkindex ) ){
+                continue;
+            }
+            if ( sphere_joint[i] < 0 || ancestors[k].size() >= depth ){
+                sphere_joint[i] = k;
+                depth = ancestors[k].size();
+            }
+        }
+
+        const OpenRAVE::Vector position =
+                            sphere.link->GetTransform() * sphere.position;
+        for ( size_t k = 0; k < 3; k ++ ){
+            sphere_reference[3*i + k] = position[k];
+        }
+    }
+}
+
+void KinematicChain::computeJointFrames( const double * q,
+                                         double * frames ) const
+{
+    for ( size_t o = 0; o < n_joints; o ++ ){
+
+        const int i = joint_order[o];
+        const double theta = q[i] - joint_reference[i];
+
+        ConstVectorMap axis( &joint_axis[3*i] );
+        ConstVectorMap anchor( &joint_anchor[3*i] );
+
+        //the motion of this joint, about its reference axis.
+        Rotation rotation;
+        Eigen::Vector3d translation;
+
+        if ( joint_type[i] == REVOLUTE ){
+            const double s = sin( theta );
+            const double c = cos( theta );
+
+            //rodrigues' formula
+            Rotation cross;
+            cross <<        0, -axis[2],  axis[1],
+                      axis[2],        0, -axis[0],
+                     -axis[1],  axis[0],        0;
+
+            rotation = Rotation::Identity() + s * cross
+                     + (1 - c) * cross * cross;
+            translation = anchor - rotation * anchor;
+        }
+        else {
+            rotation.setIdentity();
+            translation = theta * axis;
+        }
+
+        RotationMap frame_rotation( frames + FRAME_SIZE*i );
+        VectorMap frame_translation( frames + FRAME_SIZE*i + 9 );
+
+        //apply the motion of the parent joint after this one.
+        const int parent = joint_parent[i];
+        if ( parent < 0 ){
+            frame_rotation = rotation;
+            frame_translation = translation;
+        }
+        else {
+            ConstRotationMap parent_rotation( frames + FRAME_SIZE*parent );
+            ConstVectorMap parent_translation( frames + FRAME_SIZE*parent
+                                                      + 9 );
+
+            frame_rotation.noalias() = parent_rotation * rotation;
+            frame_translation = parent_rotation * translation
+                              + parent_translation;
+        }
+
+        //this joint's own motion does not move its axis, so the world
+        //  axis and anchor come from the frame of the joint itself.
+        VectorMap world_axis( frames + FRAME_SIZE*i + 12 );
+        VectorMap world_anchor( frames + FRAME_SIZE*i + 15 );
+        world_axis = frame_rotation * axis;
+        world_anchor = frame_rotation * anchor + frame_translation;
+    }
+}
+
+void KinematicChain::computeSpherePositions( const double * frames,
+                        size_t n,
+                        std::vector< OpenRAVE::Vector > & positions ) const
+{
+    assert( n <= n_spheres && positions.size() >= n );
+
+    for ( size_t i = 0; i < n; i ++ ){
+        const double * p = &sphere_reference[3*i];
+        const int j = sphere_joint[i];
+
+        if ( j < 0 ){
+            positions[i] = OpenRAVE::Vector( p[0], p[1], p[2] );
+            continue;
+        }
+
+        const double * R = frames + FRAME_SIZE*j;
+        const double * t = R + 9;
+
+        positions[i] = OpenRAVE::Vector(
+                            R[0]*p[0] + R[1]*p[1] + R[2]*p[2] + t[0],
+                            R[3]*p[0] + R[4]*p[1] + R[5]*p[2] + t[1],
+                            R[6]*p[0] + R[7]*p[1] + R[8]*p[2] + t[2] );
+    }
+}
+
+void KinematicChain::computeSphereJacobian( const double * frames,
+                                            size_t sphere,
+                                            const OpenRAVE::Vector & position,
+                                            double * jacobian ) const
+{
+    std::fill( jacobian, jacobian + 3*n_joints, 0.0 );
+
+    const int j = sphere_joint[ sphere ];
+    if ( j < 0 ){ return; }
+
+    const char * moves = &joint_moves[ j*n_joints ];
+
+    for ( size_t k = 0; k < n_joints; k ++ ){
+        if ( !moves[k] ){ continue; }
+
+        const double * axis = frames + FRAME_SIZE*k + 12;
+        const double * anchor = frames + FRAME_SIZE*k + 15;
+
+        //a revolute joint moves the sphere along axis x (p - anchor),
+        //  a prismatic joint moves it along the axis.
+        if ( joint_type[k] == REVOLUTE ){
+            const double d[3] = { position[0] - anchor[0],
+                                  position[1] - anchor[1],
+                                  position[2] - anchor[2] };
+
+            jacobian[ k              ] = axis[1]*d[2] - axis[2]*d[1];
+            jacobian[ k +   n_joints ] = axis[2]*d[0] - axis[0]*d[2];
+            jacobian[ k + 2*n_joints ] = axis[0]*d[1] - axis[1]*d[0];
+        }
+        else {
+            jacobian[ k              ] = axis[0];
+            jacobian[ k +   n_joints ] = axis[1];
+            jacobian[ k + 2*n_joints ] = axis[2];
+        }
+    }
+}
+
+void KinematicChain::getSpherePositions(
+                             const std::vector< OpenRAVE::dReal > & q,
+                             size_t n,
+                             std::vector< OpenRAVE::Vector > & positions,
+                             std::vector< double > & frames ) const
+{
+    assert( q.size() == n_joints );
+
+    if ( frames.size() != FRAME_SIZE * n_joints ){
+        frames.resize( FRAME_SIZE * n_joints );
+    }
+    computeJointFrames( q.data(), frames.data() );
+    computeSpherePositions( frames.data(), n, positions );
+}
+
+} // namespace orchomp
@@ -0,0 +1,96 @@
+#ifndef _ORCHOMP_KINEMATICS_H_
+#define _ORCHOMP_KINEMATICS_H_
+
+#include <openrave/openrave.h>
+#include "orchomp_sphere.h"
+
+namespace orchomp{
+
+//This is a compact model of the kinematics of the robot's active dofs.
+//  It is used to compute the world positions of the collision spheres
+//  without setting the state of the openrave robot, so it does not need
+//  the environment lock, and many threads can use it at once.
+//
+//The model is a product of exponentials, built from the robot at its
+//  current (reference) configuration. Every active joint stores its world
+//  axis and anchor at the reference configuration, and every sphere
+//  stores its world position at the reference configuration. For a new
+//  configuration, the rigid motion of each joint is the motion of its
+//  parent joint, followed by a rotation about (or a translation along)
+//  its reference axis by the change in its joint value. Everything is
+//  stored in flat arrays, indexed by active joint or sphere.
+class KinematicChain{
+
+  public:
+
+    //the types of joints that the chain supports.
+    enum joint_t { REVOLUTE, PRISMATIC };
+
+    //the number of doubles used to store the frame of one joint:
+    //  a row major 3x3 rotation, a translation, and then the world
+    //  axis and anchor of the joint.
+    static const size_t FRAME_SIZE = 18;
+
+    //the number of active joints, one per active dof.
+    size_t n_joints;
+    //the number of spheres that the chain positions.
+    size_t n_spheres;
+
+    //for each joint: its type, the index of the closest active joint
+    //  that moves it (or -1), and its value at the reference config.
+    std::vector< int > joint_type;
+    std::vector< int > joint_parent;
+    std::vector< double > joint_reference;
+
+    //the joints, sorted so that every joint comes after its parent.
+    std::vector< int > joint_order;
+
+    //an n_joints x n_joints table, where joint_moves[j*n_joints + k]
+    //  is 1 if joint k is joint j or one of its ancestors.
+    std::vector< char > joint_moves;
+
+    //the world axes and anchors of the joints at the reference config,
+    //  3 values per joint.
+    std::vector< double > joint_axis;
+    std::vector< double > joint_anchor;
+
+    //for each sphere: the closest active joint that moves it (or -1 if
+    //  no active joint moves it), and its world position at the
+    //  reference config, 3 values per sphere.
+    std::vector< int > sphere_joint;
+    std::vector< double > sphere_reference;
+
+    //Build the chain from the robot's current configuration. The
+    //  spheres must already have their links set. Throws an
+    //  openrave_exception if an active joint is not supported, or if
+    //  the robot has active affine dofs.
+    KinematicChain( OpenRAVE::RobotBasePtr robot,
+                    const std::vector< Sphere > & spheres );
+
+    //Compute the world frame of every joint for the configuration q.
+    //  frames must hold FRAME_SIZE * n_joints doubles.
+    void computeJointFrames( const double * q, double * frames ) const;
+
+    //Using frames from computeJointFrames, compute the world positions
+    //  of the first n spheres.
+    void computeSpherePositions( const double * frames, size_t n,
+                        std::vector< OpenRAVE::Vector > & positions ) const;
+
+    //Using frames from computeJointFrames, and the position of the
+    //  sphere, compute the jacobian of the sphere's position with respect
+    //  to the active dofs, as a row major 3 x n_joints matrix.
+    void computeSphereJacobian( const double * frames, size_t sphere,
+                                const OpenRAVE::Vector & position,
+                                double * jacobian ) const;
+
+    //Do both of the above for the state q. frames is used as scratch.
+    void getSpherePositions( const std::vector< OpenRAVE::dReal > & q,
+                             size_t n,
+                             std::vector< OpenRAVE::Vector > & positions,
+                             std::vector< double > & frames ) const;
+
+};
+
+} // namespace orchomp
+
+#endif
@@ -40,8 +40,11 @@ mod::mod(OpenRAVE::EnvironmentBasePtr penv) :
     OpenRAVE::ModuleBase(penv), environment( penv ),
     chomper( NULL ),
     factory( NULL ), sphere_collider( NULL ),
-    observer( NULL ), hmc( NULL )
+    observer( NULL ), hmc( NULL ),
+    pointcloud_stream( NULL ), pointcloud_sdf( 0 )
 {
+    pthread_mutex_init( &pointcloud_mutex, NULL );
+
     RAVELOG_INFO( "Constructing\n");
       __description = "orchomp: implementation multigrid chomp";
       RegisterCommand("viewspheres",
@@ -50,6 +53,15 @@ mod::mod(OpenRAVE::EnvironmentBasePtr penv) :
       RegisterCommand("computedistancefield",
                boost::bind(&mod::computedistancefield,this,_1,_2),
                "compute distance field");
+      RegisterCommand("mergedistancefields",
+               boost::bind(&mod::mergedistancefields,this,_1,_2),
+               "merge distance fields into one world frame field");
+      RegisterCommand("updatedistancefield",
+               boost::bind(&mod::updatedistancefield,this,_1,_2),
+               "add or remove kinbodies in a distance field");
+      RegisterCommand("pointcloud",
+               boost::bind(&mod::pointcloud,this,_1,_2),
+               "fuse point clouds into a world distance field");
       RegisterCommand("addfield_fromobsarray",
             boost::bind( &mod::addfield_fromobsarray,this,_1,_2),
             "compute distance field");
@@ -108,7 +120,11 @@ bool mod::benchmark(std::ostream& sout, std::istream& sinput)
     bool lock_env = true;
     bool print = false;
     bool check_all = false;
+    bool broadphase = false;
+    bool sdf = false;
     int num_trials = 100;
+    int num_configs = 1000;
+    std::string trace_in, trace_out;
     double pause_time = 0.0;
     
     std::string cmd;
@@ -130,6 +146,16 @@ bool mod::benchmark(std::ostream& sout, std::istream& sinput)
             check_all = true;
         } else if ( cmd == "print" ){
             print = true;
+        } else if ( cmd == "broadphase" ){
+            broadphase = true;
+        } else if ( cmd == "sdf" ){
+            sdf = true;
+        } else if ( cmd == "configs" ){
+            sinput >> num_configs;
+        } else if ( cmd == "trace" ){
+            sinput >> trace_in;
+        } else if ( cmd == "record" ){
+            sinput >> trace_out;
         }
 
         //error case
@@ -141,7 +167,17 @@ bool mod::benchmark(std::ostream& sout, std::istream& sinput)
     if( lock_env ) OpenRAVE::EnvironmentMutex::scoped_lock lock( 
                                         environment->GetMutex() );
 
-    sphere_collider->benchmark( num_trials, check_all, pause_time, print);
+    if ( broadphase ){
+        sphere_collider->benchmarkBroadphase( num_trials );
+    }
+    else if ( sdf ){
+        sphere_collider->benchmarkSDF( num_trials, num_configs,
+                                       trace_in, trace_out );
+    }
+    else {
+        sphere_collider->benchmark( num_trials, check_all, pause_time,
+                                    print);
+    }
 
     return true;
 
@@ -251,7 +287,8 @@ bool mod::viewspheresVec(const chomp::MatX & q,
         //set the dimensions and transform of the sphere.
         std::vector< OpenRAVE::Vector > svec;
 
-        OpenRAVE::Vector position = sphere_collider->sphere_positions[ i ];
+        OpenRAVE::Vector position = 
+                    sphere_collider->workspaces[0]->sphere_positions[ i ];
 
         //set the radius of the sphere
         double size_value = sdf_cost/sphere_collider->epsilon + 
@@ -340,7 +377,7 @@ bool mod::visualizeWholeTrajectory( std::ostream& sout,
             std::vector< OpenRAVE::Vector > svec;
 
             OpenRAVE::Vector position = 
-                                sphere_collider->sphere_positions[ i ];
+                                sphere_collider->workspaces[0]->sphere_positions[ i ];
 
             position.w = current_sphere.radius*0.8; 
 
@@ -640,6 +677,64 @@ bool mod::computedistancefield(std::ostream& sout, std::istream& sinput)
     return true;
 }
 
+/* mergedistancefields kinbody table kinbody shelf cube_extent 0.02
+ * replaces the distance fields of the given kinbodies (or of all of
+ *  them) with a single field that is their pointwise minimum. The
+ *  fields of the kinbodies that are not named stay as they are, so
+ *  they can still be used for objects that move.
+ * */
+bool mod::mergedistancefields(std::ostream& sout, std::istream& sinput)
+{
+    
+    //lock the environment
+    OpenRAVE::EnvironmentMutex::scoped_lock lock(environment->GetMutex());
+    
+    parseMergeDistanceFields( sout, sinput );
+
+    return true;
+}
+
+/* updatedistancefield kinbody table add mug remove bowl band 0.2
+ * adds the occupancy of the kinbodies after add to the distance field
+ *  of the named kinbody (or of the field at index sdf), and removes
+ *  the occupancy of the ones after remove, in order. Only the
+ *  distances within band of the bodies are computed again. A body
+ *  that was added is removed from where it was added.
+ * */
+bool mod::updatedistancefield(std::ostream& sout, std::istream& sinput)
+{
+    
+    //lock the environment
+    OpenRAVE::EnvironmentMutex::scoped_lock lock(environment->GetMutex());
+    
+    parseUpdateDistanceField( sout, sinput );
+
+    return true;
+}
+
+/* pointcloud start lower -1 -1 0 upper 1 1 2 cube_extent 0.01 band 0.2
+ * pointcloud frame /dev/shm/cloud pose 1 0 0 0 0 0 1.5
+ * pointcloud status
+ * pointcloud stop
+ * start adds an empty world field that covers the box from lower to
+ *  upper, and starts a thread that fuses frames into it. frame hands
+ *  the thread a frame: a file of float xyz triples, which is best kept
+ *  in shared memory, in the frame given by pose (qw qx qy qz x y z).
+ *  The field changes to the latest fused frame at the start of every
+ *  CHOMP iteration. status writes the number of frames that were
+ *  fused and dropped, and the seconds that the last one took. stop
+ *  leaves the field as it is.
+ * */
+bool mod::pointcloud(std::ostream& sout, std::istream& sinput)
+{
+    //frames are added while CHOMP runs, which holds the environment
+    //  lock, so the parser only takes it to start, stop, or publish.
+    //  Everything else only takes pointcloud_mutex.
+    parsePointCloud( sout, sinput );
+
+    return true;
+}
+
 
 bool mod::visualizeslice(std::ostream& sout, std::istream& sinput)
 {
@@ -664,7 +759,7 @@ bool mod::visualizeslice(std::ostream& sout, std::istream& sinput)
     
     if( sphere_collider ){
         if (getwhole ){
-            for ( size_t i = 0; i < sdfs[sdf_index].grid.dims()[axis]; i ++ ){
+            for ( size_t i = 0; i < sdfs[sdf_index].getLayout().dims()[axis]; i ++ ){
                 sphere_collider->visualizeSDFSlice( sdf_index, axis,
                                                     i, time );
             }
@@ -752,6 +847,8 @@ void mod::printChompInfo(){
     RAVELOG_INFO( "Chomp.max_local_iter = %d\n", info.max_local_iter );
     RAVELOG_INFO( "Chomp.t_total = %f\n", info.t_total );
     RAVELOG_INFO( "Chomp.max_time = %f\n", info.timeout_seconds );
+    RAVELOG_INFO( "Chomp.n_threads = %d\n", info.n_threads );
+    RAVELOG_INFO( "Chomp.broadphase = %s\n", info.broadphase.c_str() );
 
     std::stringstream ss;
     std::string configuration;
@@ -814,7 +911,10 @@ bool mod::iterate(std::ostream& sout, std::istream& sinput)
                               info.epsilon,
                               info.obs_factor,
                               info.epsilon_self, 
-                              info.obs_factor_self );
+                              info.obs_factor_self,
+                              info.n_threads,
+                              info.use_native_fk,
+                              info.broadphase );
         
         chomper->gradient->ghelper = sphere_collider;
     }
@@ -39,6 +39,7 @@
 //classes for chomping
 #include "chomp-multigrid/chomp/Chomp.h"
 #include "orchomp_distancefield.h"
+#include "orchomp_pointcloud.h"
 #include "orchomp_sphere.h" 
 
 
@@ -100,8 +101,10 @@ public:
     //max_global_iter: the max # of global chomp interations,
     //min_local_iter: the min # of local smoothing iterations
     //max_local_iter: the max # of local smoothing iterations
+    //n_threads: the number of threads used to compute the collision
+    //           gradient.
     size_t n, n_max, min_global_iter, max_global_iter,
-                     min_local_iter, max_local_iter, seed;
+                     min_local_iter, max_local_iter, seed, n_threads;
 
     //doGlobal/doLocal: whether or not global and/or local chomp should
     //                  be done.
@@ -120,10 +123,16 @@ public:
     //                          a collision in the final trajectory
     // no_collision_details : do not spit out the details about the
     //                        collisions.
+    // use_native_fk : compute the sphere positions with the collider's
+    //                 own kinematics, instead of the openrave robot.
     bool doGlobal, doLocal, doObserve, noFactory, noCollider, 
          noSelfCollision, noEnvironmentalCollision, 
          no_collision_check, no_collision_exception, no_collision_details,
-         use_hmc, use_momentum, do_not_reject;
+         use_hmc, use_momentum, do_not_reject, use_native_fk;
+
+    //broadphase : the collision pruner, "sap" (sweep and prune) or
+    //             "hash" (a uniform spatial hash).
+    std::string broadphase;
 
     //a basic constructor to initialize values
     ChompInfo() :
@@ -134,12 +143,15 @@ public:
         n(100), n_max(100),
         min_global_iter( 0 ), max_global_iter( size_t(-1) ), 
         min_local_iter( 0 ), max_local_iter( size_t(-1)), seed(0),
+        n_threads( 1 ),
         doGlobal( true ),
         doLocal( false ), doObserve( true ), noFactory (false),
         noCollider( false ), noSelfCollision( false ),
         noEnvironmentalCollision( false ), no_collision_check(false), 
         no_collision_exception(false), no_collision_details(false),
-        use_hmc(false), use_momentum( false ), do_not_reject( true )
+        use_hmc(false), use_momentum( false ), do_not_reject( true ),
+        use_native_fk( false ),
+        broadphase( "sap" )
         {}
 };
 
@@ -176,6 +188,7 @@ public:
     std::string robot_name;            // the name of the robot
     std::vector< int > active_indices; // the active indices of the robot
     size_t n_dof;                      // the degree of freedom of the bot.
+    std::vector< OpenRAVE::dReal > active_dof_values; // setActiveDOFValues
     
     //holds the active manipulator of the robot. this is used for
     //  TSR constraints.
@@ -190,6 +203,17 @@ public:
                                     
     //This vector holds all of the sdf's.
     std::vector< DistanceField > sdfs;
+
+    //if this is not NULL, it fuses point clouds into the field at
+    //  sdfs[pointcloud_sdf], which is swapped to the latest fused
+    //  frame at the start of every CHOMP iteration.
+    PointCloudStream * pointcloud_stream;
+    size_t pointcloud_sdf;
+
+    //guards pointcloud_stream, which the pointcloud command uses while
+    //  CHOMP runs with the environment locked. When both are taken,
+    //  the environment lock is taken first.
+    pthread_mutex_t pointcloud_mutex;
     
     //this vector holds all of the TSR's 
     std::vector< ORTSRConstraint * > tsrs;
@@ -212,6 +236,18 @@ public:
     //compute the distance field for use in collision detection, and
     //   descending the gradient out of collision
     bool computedistancefield(std::ostream & sout, std::istream& sinput);
+
+    //merge the distance fields of bodies that do not move into one
+    //  world frame field.
+    bool mergedistancefields(std::ostream & sout, std::istream& sinput);
+
+    //add kinbodies to a distance field, or remove them, by updating
+    //  only the cells around them.
+    bool updatedistancefield(std::ostream & sout, std::istream& sinput);
+
+    //start or stop fusing point clouds into a world distance field,
+    //  and pass it frames.
+    bool pointcloud(std::ostream & sout, std::istream& sinput);
     
     //visualize a slice out of a signed distance field.
     bool visualizeslice(std::ostream& sout, std::istream& sinput);
@@ -272,6 +308,8 @@ public:
     //Destructor
     virtual ~mod() { 
         delete_items();
+        if ( pointcloud_stream ){ delete pointcloud_stream; }
+        pthread_mutex_destroy( &pointcloud_mutex );
         std::cout << "Done destruction" << std::endl;
     }
 
@@ -302,6 +340,11 @@ public:
                                    std::istream& sinput);
     void parseAddFieldFromObsArray(std::ostream & sout,
                                    std::istream& sinput);
+    void parseMergeDistanceFields(std::ostream & sout,
+                                  std::istream& sinput);
+    void parseUpdateDistanceField(std::ostream & sout,
+                                  std::istream& sinput);
+    void parsePointCloud(std::ostream & sout, std::istream& sinput);
     void parsePoint( std::istream & sinput, chomp::MatX & point);
     void parseExecute( std::ostream & sout , std::istream & sinput );
     void parseRobot( std::string & name );
@@ -28,6 +28,7 @@
 
 #include "orchomp_mod.h"
 #include "orchomp_constraint.h"
+#include "orchomp_collision.h"
 
 #define DOPARSE 0
 #define CREATEPARSE 1
@@ -271,6 +272,9 @@ void mod::parseCreate(std::ostream & sout, std::istream& sinput)
         else if (cmd == "noenvironmentalcollision"){
             info.noEnvironmentalCollision = true; 
         }   
+        else if (cmd == "n_threads"){ sinput >> info.n_threads; }
+        else if (cmd == "use_native_fk"){ info.use_native_fk = true; }
+        else if (cmd == "broadphase"){ sinput >> info.broadphase; }
         // These are unimplemented:
         else if (cmd == "starttraj" ){
             RAVELOG_ERROR( "Starttraj has not been implemented" );
@@ -402,6 +406,15 @@ void mod::parseComputeDistanceField(std::ostream & sout, std::istream& sinput)
     
     double aabb_padding( -1), cube_extent( -1);
     OpenRAVE::KinBodyPtr kinbody;
+    std::string fill;
+    int n_threads( -1 );
+    std::string cache_dir;
+    bool has_cache_dir = false;
+    double cache_max_mb( -1 );
+    double band( -1 );
+    bool quantize = false;
+    bool store_gradients = true;
+    bool tiled = false;
 
     bool getall = false;
 
@@ -440,6 +453,25 @@ void mod::parseComputeDistanceField(std::ostream & sout, std::istream& sinput)
             sinput >> cube_extent;
         }else if (cmd == "cache_filename"){
             sinput >> cache_filename;
+        }else if (cmd == "fill"){
+            sinput >> fill;
+            DistanceField::getFillFromName( fill );
+        }else if (cmd == "n_threads"){
+            sinput >> n_threads;
+        }else if (cmd == "cache_dir"){
+            sinput >> cache_dir;
+            has_cache_dir = true;
+            if ( cache_dir == "none" ){ cache_dir.clear(); }
+        }else if (cmd == "cache_max_mb"){
+            sinput >> cache_max_mb;
+        }else if (cmd == "band"){
+            sinput >> band;
+        }else if (cmd == "quantize"){
+            quantize = true;
+        }else if (cmd == "nogradients"){
+            store_gradients = false;
+        }else if (cmd == "tiled"){
+            tiled = true;
         }
         
         //handle bad arguments
@@ -460,6 +492,18 @@ void mod::parseComputeDistanceField(std::ostream & sout, std::istream& sinput)
         DistanceField & current_sdf = sdfs.back();
         if ( aabb_padding >= 0 ){ current_sdf.aabb_padding = aabb_padding; }
         if ( cube_extent >= 0 ){ current_sdf.cube_extent = cube_extent; }
+        if ( !fill.empty() ){
+            current_sdf.fill = DistanceField::getFillFromName( fill );
+        }
+        if ( n_threads > 0 ){ current_sdf.n_threads = n_threads; }
+        if ( has_cache_dir ){ current_sdf.cache_dir = cache_dir; }
+        if ( cache_max_mb >= 0 ){
+            current_sdf.cache_max_bytes = size_t( cache_max_mb*1024*1024 );
+        }
+        if ( band >= 0 ){ current_sdf.band = band; }
+        current_sdf.quantize = quantize;
+        current_sdf.store_gradients = store_gradients;
+        current_sdf.tiled = tiled;
         current_sdf.kinbody = kinbody;
  
         RAVELOG_INFO("Using kinbody %s.\n",
@@ -495,6 +539,19 @@ void mod::parseComputeDistanceField(std::ostream & sout, std::istream& sinput)
             if ( cube_extent >= 0 ){ 
                 current_sdf.cube_extent = cube_extent;
             }
+            if ( !fill.empty() ){
+                current_sdf.fill = DistanceField::getFillFromName( fill );
+            }
+            if ( n_threads > 0 ){ current_sdf.n_threads = n_threads; }
+            if ( has_cache_dir ){ current_sdf.cache_dir = cache_dir; }
+            if ( cache_max_mb >= 0 ){
+                current_sdf.cache_max_bytes = 
+                                    size_t( cache_max_mb*1024*1024 );
+            }
+            if ( band >= 0 ){ current_sdf.band = band; }
+            current_sdf.quantize = quantize;
+            current_sdf.store_gradients = store_gradients;
+            current_sdf.tiled = tiled;
             
             //
             current_sdf.kinbody = bodies[i];
@@ -513,6 +570,342 @@ void mod::parseComputeDistanceField(std::ostream & sout, std::istream& sinput)
     } 
 }
 
+void mod::parseMergeDistanceFields(std::ostream & sout, std::istream& sinput)
+{
+    std::vector< std::string > names;
+    bool mergeall = false;
+    double cube_extent( -1 ), band( 0 );
+    bool quantize = false;
+    bool store_gradients = true;
+    bool tiled = false;
+
+    std::string cmd;
+
+    /* parse command line arguments */
+    while (!sinput.eof () ){
+        sinput >> cmd;
+        debugStream << "\t-ExecutingCommand: " << cmd << std::endl;
+
+        if ( cmd == "kinbody" ){
+            std::string name;
+            sinput >> name;
+            names.push_back( name );
+        }else if ( cmd == "all" ){
+            mergeall = true;
+        }else if (cmd == "cube_extent"){
+            sinput >> cube_extent;
+        }else if (cmd == "band"){
+            sinput >> band;
+        }else if (cmd == "quantize"){
+            quantize = true;
+        }else if (cmd == "nogradients"){
+            store_gradients = false;
+        }else if (cmd == "tiled"){
+            tiled = true;
+        }
+        
+        //handle bad arguments
+        else{
+            while ( !sinput.eof() ){
+                std::string argument;
+                sinput >> argument;
+                RAVELOG_ERROR("argument %s not known!\n", argument.c_str());
+                throw OpenRAVE::openrave_exception("Bad arguments!");
+            }
+        }
+    }
+
+    //the collision helper keeps track of the fields by index.
+    if ( sphere_collider ){
+        throw OpenRAVE::openrave_exception(
+            "Distance fields must be merged before create, or after destroy!");
+    }
+
+    //so does the point cloud stream.
+    if ( pointcloud_stream ){
+        throw OpenRAVE::openrave_exception(
+            "Distance fields must be merged before a point cloud is started!");
+    }
+
+    if ( !mergeall && names.empty() ){
+        throw OpenRAVE::openrave_exception(
+                "Need kinbodies, or all, to merge distance fields!");
+    }
+
+    //split the fields into the ones to merge and the ones to keep.
+    std::vector< bool > merge( sdfs.size(), mergeall );
+    for ( size_t i = 0; i < names.size(); i ++ ){
+        bool found = false;
+        for ( size_t j = 0; j < sdfs.size(); j ++ ){
+            if ( sdfs[j].kinbody.get() && 
+                 sdfs[j].kinbody->GetName() == names[i] ){
+                merge[j] = found = true;
+            }
+        }
+        if ( !found ){
+            std::string error = 
+                    "There is no distance field for kinbody: " + names[i];
+            throw OpenRAVE::openrave_exception( error );
+        }
+    }
+
+    //by default, the merged field has the finest resolution of the
+    //  fields that go into it.
+    const bool finest = cube_extent < 0;
+    std::vector< const DistanceField * > fields;
+    for ( size_t i = 0; i < sdfs.size(); i ++ ){
+        if ( !merge[i] ){ continue; }
+        fields.push_back( &sdfs[i] );
+        if ( finest && ( cube_extent < 0 || 
+                         sdfs[i].cube_extent < cube_extent )){
+            cube_extent = sdfs[i].cube_extent;
+        }
+    }
+
+    if ( fields.empty() ){
+        throw OpenRAVE::openrave_exception(
+                "There are no distance fields to merge!");
+    }
+
+    RAVELOG_INFO("Merging %d distance fields.\n", int( fields.size() ));
+    
+    DistanceField composite;
+    composite.store_gradients = store_gradients;
+    composite.tiled = tiled;
+    composite.createComposite( fields, cube_extent );
+    if ( band > 0 ){ composite.makeSparse( band, quantize ); }
+    else if ( quantize ){
+        composite.makeSparse( composite.grid.maxDist(), true );
+    }
+
+    std::vector< DistanceField > kept;
+    for ( size_t i = 0; i < sdfs.size(); i ++ ){
+        if ( !merge[i] ){ kept.push_back( sdfs[i] ); }
+    }
+    kept.push_back( composite );
+    sdfs.swap( kept );
+}
+
+void mod::parseUpdateDistanceField(std::ostream & sout, std::istream& sinput)
+{
+    std::string name;
+    int sdf_index( -1 );
+    double band( 0.2 );
+
+    //the names of the bodies to add or remove, in order.
+    std::vector< std::pair< std::string, bool > > updates;
+
+    std::string cmd;
+
+    /* parse command line arguments */
+    while (!sinput.eof () ){
+        sinput >> cmd;
+        debugStream << "\t-ExecutingCommand: " << cmd << std::endl;
+
+        if ( cmd == "kinbody" ){
+            sinput >> name;
+        }else if ( cmd == "sdf" ){
+            sinput >> sdf_index;
+        }else if ( cmd == "add" || cmd == "remove" ){
+            std::string body_name;
+            sinput >> body_name;
+
+            //a body that is removed does not have to be in the
+            //  environment any more, see updateOccupancy.
+            if ( cmd == "add" &&
+                 !environment->GetKinBody( body_name ).get() ){
+                std::string error = 
+                        "Could not find kinbody named: " + body_name;
+                throw OpenRAVE::openrave_exception( error );
+            }
+            updates.push_back( std::make_pair( body_name, cmd == "add" ));
+        }else if (cmd == "band"){
+            sinput >> band;
+        }
+        
+        //handle bad arguments
+        else{
+            while ( !sinput.eof() ){
+                std::string argument;
+                sinput >> argument;
+                RAVELOG_ERROR("argument %s not known!\n", argument.c_str());
+                throw OpenRAVE::openrave_exception("Bad arguments!");
+            }
+        }
+    }
+
+    if ( !name.empty() ){
+        for ( size_t i = 0; i < sdfs.size(); i ++ ){
+            if ( sdfs[i].kinbody.get() && 
+                 sdfs[i].kinbody->GetName() == name ){
+                sdf_index = i;
+            }
+        }
+        if ( sdf_index < 0 ){
+            std::string error = 
+                    "There is no distance field for kinbody: " + name;
+            throw OpenRAVE::openrave_exception( error );
+        }
+    }
+
+    if ( sdf_index < 0 || sdf_index >= int( sdfs.size() )){
+        throw OpenRAVE::openrave_exception(
+                "Need a kinbody, or an sdf index, to update a distance field!");
+    }
+
+    for ( size_t i = 0; i < updates.size(); i ++ ){
+        sdfs[sdf_index].updateOccupancy( updates[i].first,
+                                         updates[i].second, band );
+    }
+}
+
+void mod::parsePointCloud(std::ostream & sout, std::istream& sinput)
+{
+    bool start = false, stop = false, status = false, wait = false;
+    OpenRAVE::Vector lower, upper;
+    double cube_extent( 0.02 ), band( 0.2 );
+    size_t persistence( 1 ), n_threads( 1 );
+    bool store_gradients = true;
+    bool tiled = false;
+    std::string frame_file;
+    size_t count( 0 );
+    OpenRAVE::Transform pose;
+
+    std::string cmd;
+
+    /* parse command line arguments */
+    while (!sinput.eof () ){
+        sinput >> cmd;
+        debugStream << "\t-ExecutingCommand: " << cmd << std::endl;
+
+        if ( cmd == "start" ){
+            start = true;
+        }else if ( cmd == "stop" ){
+            stop = true;
+        }else if ( cmd == "status" ){
+            status = true;
+        }else if ( cmd == "lower" ){
+            sinput >> lower[0] >> lower[1] >> lower[2];
+        }else if ( cmd == "upper" ){
+            sinput >> upper[0] >> upper[1] >> upper[2];
+        }else if (cmd == "cube_extent"){
+            sinput >> cube_extent;
+        }else if (cmd == "band"){
+            sinput >> band;
+        }else if (cmd == "persistence"){
+            sinput >> persistence;
+        }else if (cmd == "n_threads"){
+            sinput >> n_threads;
+        }else if (cmd == "nogradients"){
+            store_gradients = false;
+        }else if (cmd == "tiled"){
+            tiled = true;
+        }else if ( cmd == "frame" ){
+            sinput >> frame_file;
+        }else if ( cmd == "count" ){
+            sinput >> count;
+        }else if ( cmd == "pose" ){
+            sinput >> pose.rot[0] >> pose.rot[1] >> pose.rot[2] >> pose.rot[3]
+                   >> pose.trans[0] >> pose.trans[1] >> pose.trans[2];
+        }else if ( cmd == "wait" ){
+            wait = true;
+        }
+        
+        //handle bad arguments
+        else{
+            while ( !sinput.eof() ){
+                std::string argument;
+                sinput >> argument;
+                RAVELOG_ERROR("argument %s not known!\n", argument.c_str());
+                throw OpenRAVE::openrave_exception("Bad arguments!");
+            }
+        }
+    }
+
+    if ( start ){
+        OpenRAVE::EnvironmentMutex::scoped_lock lock(environment->GetMutex());
+        ScopedLock stream_lock( &pointcloud_mutex );
+
+        //the collision helper keeps track of the fields by index.
+        if ( sphere_collider ){
+            throw OpenRAVE::openrave_exception(
+                "A point cloud must be started before create, or after destroy!");
+        }
+        if ( pointcloud_stream ){
+            throw OpenRAVE::openrave_exception(
+                "A point cloud has already been started!");
+        }
+        for ( int i = 0; i < 3; i ++ ){
+            if ( upper[i] <= lower[i] ){
+                throw OpenRAVE::openrave_exception(
+                    "The upper corner of a point cloud must be above the lower!");
+            }
+        }
+
+        sdfs.resize( sdfs.size() + 1 );
+        DistanceField & field = sdfs.back();
+        field.store_gradients = store_gradients;
+        field.tiled = tiled;
+        field.createEmpty( environment, lower, upper, cube_extent, band );
+
+        pointcloud_sdf = sdfs.size() - 1;
+        pointcloud_stream = new PointCloudStream( field, band, persistence,
+                                                  n_threads );
+
+        RAVELOG_INFO( "Fusing point clouds into distance field %d\n",
+                      int( pointcloud_sdf ));
+    }
+
+    if ( !frame_file.empty() ){
+        ScopedLock stream_lock( &pointcloud_mutex );
+        if ( !pointcloud_stream ){
+            throw OpenRAVE::openrave_exception(
+                    "The point cloud has not been started!");
+        }
+
+        MappedFile file;
+        if ( !file.open( frame_file.c_str() )){
+            throw OpenRAVE::openrave_exception(
+                    "Could not map point cloud frame: " + frame_file );
+        }
+
+        const size_t n_points = file.size() / ( 3*sizeof( float ));
+        if ( count == 0 || count > n_points ){ count = n_points; }
+
+        pointcloud_stream->addFrame(
+                reinterpret_cast< const float * >( file.data() ),
+                count, pose );
+    }
+
+    if ( wait ){
+        {
+            ScopedLock stream_lock( &pointcloud_mutex );
+            if ( pointcloud_stream ){ pointcloud_stream->sync(); }
+        }
+
+        //without a CHOMP run to publish the frame, publish it here.
+        OpenRAVE::EnvironmentMutex::scoped_lock lock(environment->GetMutex());
+        ScopedLock stream_lock( &pointcloud_mutex );
+        if ( pointcloud_stream ){
+            pointcloud_stream->publish( sdfs[ pointcloud_sdf ], true );
+        }
+    }
+
+    if ( status ){
+        ScopedLock stream_lock( &pointcloud_mutex );
+        if ( pointcloud_stream ){ pointcloud_stream->printStatus( sout ); }
+    }
+
+    if ( stop ){
+        OpenRAVE::EnvironmentMutex::scoped_lock lock(environment->GetMutex());
+        ScopedLock stream_lock( &pointcloud_mutex );
+        if ( pointcloud_stream ){
+            delete pointcloud_stream;
+            pointcloud_stream = NULL;
+        }
+    }
+}
+
 void mod::parseAddFieldFromObsArray(std::ostream & sout, std::istream& sinput)
 {
 }
@@ -115,10 +115,9 @@ void mod::getIthStateAsVector( size_t i,
 
 void mod::setActiveDOFValues( const chomp::MatX & qt ){
 
-    std::vector< OpenRAVE::dReal > vec;
-    getStateAsVector( qt, vec );
+    getStateAsVector( qt, active_dof_values );
 
-    robot->SetActiveDOFValues( vec, false );
+    robot->SetActiveDOFValues( active_dof_values, false );
 }
 
 bool mod::areAdjacent( int first, int second ) const {
@@ -0,0 +1,250 @@
+
+#include "orchomp_pointcloud.h"
+
+namespace orchomp {
+
+void PointCloudStream::CellBox::add( const vec3u & s ){
+    if ( empty() ){
+        lo = s;
+        hi = s + vec3u( 1,1,1 );
+        return;
+    }
+    for ( int i = 0; i < 3; i ++ ){
+        lo[i] = std::min( lo[i], s[i] );
+        hi[i] = std::max( hi[i], s[i] + 1 );
+    }
+}
+
+void PointCloudStream::CellBox::add( const CellBox & other ){
+    if ( other.empty() ){ return; }
+    if ( empty() ){
+        *this = other;
+        return;
+    }
+    for ( int i = 0; i < 3; i ++ ){
+        lo[i] = std::min( lo[i], other.lo[i] );
+        hi[i] = std::max( hi[i], other.hi[i] );
+    }
+}
+
+PointCloudStream::PointCloudStream( const DistanceField & field,
+                                    double band, size_t persistence,
+                                    size_t n_threads ) :
+    pose_grid_world( field.pose_grid_world ),
+    cell_size( field.grid.cellSize() ),
+    band( band ),
+    band_cells( size_t( ceil( band / field.grid.cellSize() ))),
+    persistence( std::max( persistence, size_t( 1 ) )),
+    last_hit( field.grid.size(), 0 ),
+    occupied( field.grid.size(), false ),
+    frame( 0 ),
+    frame_cells( this->persistence ),
+    back( field.grid ),
+    ready( false ),
+    has_pending( false ), busy( false ), stopping( false ),
+    frames_fused( 0 ), frames_dropped( 0 ), fuse_time( 0 ),
+    started( false )
+{
+    if ( field.isSparse() || field.grid.empty() ){
+        throw OpenRAVE::openrave_exception(
+                "A point cloud needs a dense distance field!");
+    }
+
+    back.setNumThreads( n_threads );
+
+    pthread_mutex_init( &buffer_mutex, NULL );
+    pthread_mutex_init( &frame_mutex, NULL );
+    pthread_cond_init( &frame_cond, NULL );
+    pthread_cond_init( &fused_cond, NULL );
+
+    started = ( pthread_create( &thread, NULL, &fuseThread, this ) == 0 );
+    if ( !started ){
+        throw OpenRAVE::openrave_exception(
+                "Could not start the point cloud thread!");
+    }
+}
+
+PointCloudStream::~PointCloudStream(){
+
+    pthread_mutex_lock( &frame_mutex );
+    stopping = true;
+    pthread_cond_signal( &frame_cond );
+    pthread_mutex_unlock( &frame_mutex );
+
+    if ( started ){ pthread_join( thread, NULL ); }
+
+    pthread_cond_destroy( &fused_cond );
+    pthread_cond_destroy( &frame_cond );
+    pthread_mutex_destroy( &frame_mutex );
+    pthread_mutex_destroy( &buffer_mutex );
+}
+
+void PointCloudStream::addFrame( const float * points, size_t n,
+                                 const OpenRAVE::Transform & pose_world_sensor )
+{
+    pthread_mutex_lock( &frame_mutex );
+
+    if ( has_pending ){ frames_dropped ++; }
+
+    pending.assign( points, points + 3*n );
+    pending_pose = pose_world_sensor;
+    has_pending = true;
+
+    pthread_cond_signal( &frame_cond );
+    pthread_mutex_unlock( &frame_mutex );
+}
+
+bool PointCloudStream::publish( DistanceField & field, bool wait )
+{
+    if ( wait ){ pthread_mutex_lock( &buffer_mutex ); }
+    else if ( pthread_mutex_trylock( &buffer_mutex ) != 0 ){
+        return false;
+    }
+
+    const bool changed = ready;
+    if ( ready ){
+        field.grid.swapData( back );
+
+        //the grid that is now the back copy is missing every change
+        //  that was fused since it was swapped out last.
+        back_missed = since_swap;
+        since_swap = CellBox();
+        ready = false;
+    }
+
+    pthread_mutex_unlock( &buffer_mutex );
+
+    return changed;
+}
+
+void PointCloudStream::sync()
+{
+    pthread_mutex_lock( &frame_mutex );
+    while ( has_pending || busy ){
+        pthread_cond_wait( &fused_cond, &frame_mutex );
+    }
+    pthread_mutex_unlock( &frame_mutex );
+}
+
+void PointCloudStream::printStatus( std::ostream & out )
+{
+    pthread_mutex_lock( &frame_mutex );
+    out << frames_fused << " " << frames_dropped << " " << fuse_time;
+    pthread_mutex_unlock( &frame_mutex );
+}
+
+void * PointCloudStream::fuseThread( void * arg ){
+    PointCloudStream & stream = *reinterpret_cast< PointCloudStream * >( arg );
+
+    std::vector< float > points;
+    OpenRAVE::Transform pose;
+
+    pthread_mutex_lock( &stream.frame_mutex );
+    while ( true ){
+        while ( !stream.has_pending && !stream.stopping ){
+            pthread_cond_wait( &stream.frame_cond, &stream.frame_mutex );
+        }
+        if ( stream.stopping ){ break; }
+
+        points.swap( stream.pending );
+        pose = stream.pending_pose;
+        stream.has_pending = false;
+        stream.busy = true;
+        pthread_mutex_unlock( &stream.frame_mutex );
+
+        stream.timer.start( "fuse" );
+        stream.fuse( points, pose );
+        stream.timer.stop( "fuse" );
+
+        pthread_mutex_lock( &stream.frame_mutex );
+        stream.busy = false;
+        stream.frames_fused ++;
+        stream.fuse_time = stream.timer.getWallElapsed( "fuse" );
+        pthread_cond_broadcast( &stream.fused_cond );
+    }
+    pthread_mutex_unlock( &stream.frame_mutex );
+
+    return NULL;
+}
+
+void PointCloudStream::fuse( const std::vector< float > & points,
+                             const OpenRAVE::Transform & pose_world_sensor )
+{
+    frame ++;
+
+    const OpenRAVE::Transform pose_grid_sensor =
+                                pose_grid_world * pose_world_sensor;
+    const vec3u & dims = back.dims();
+
+    //a cell is occupied until persistence frames have gone by without
+    //  a point in it, so the cells that change are the ones hit for
+    //  the first time in a while, and the ones last hit by the frame
+    //  that is dropping out of the window.
+    CellBox changed;
+    hit_cells.clear();
+
+    for ( size_t i = 0; i + 2 < points.size(); i += 3 ){
+        const OpenRAVE::Vector p = pose_grid_sensor *
+                OpenRAVE::Vector( points[i], points[i+1], points[i+2] );
+
+        //skip the points outside of the grid, and the invalid returns
+        //  that some sensors give as NaN.
+        vec3u s;
+        bool inside = true;
+        for ( int j = 0; j < 3; j ++ ){
+            const double c = floor( p[j] / cell_size );
+            inside = inside && c >= 0 && c < double( dims[j] );
+            s[j] = inside ? size_t( c ) : 0;
+        }
+        if ( !inside ){ continue; }
+
+        const size_t index = back.sub2ind( s );
+        if ( last_hit[index] == frame ){ continue; }
+        last_hit[index] = frame;
+        hit_cells.push_back( s );
+
+        if ( !occupied[index] ){
+            occupied[index] = true;
+            changed.add( s );
+        }
+    }
+
+    //the slot of the frame that drops out of the window is reused for
+    //  this one.
+    std::vector< vec3u > & expiring = frame_cells[ frame % persistence ];
+    if ( frame > persistence ){
+        const unsigned int expired = frame - persistence;
+        for ( size_t i = 0; i < expiring.size(); i ++ ){
+            const size_t index = back.sub2ind( expiring[i] );
+            if ( last_hit[index] == expired && occupied[index] ){
+                occupied[index] = false;
+                changed.add( expiring[i] );
+            }
+        }
+    }
+    expiring.swap( hit_cells );
+
+    pthread_mutex_lock( &buffer_mutex );
+
+    CellBox box = changed;
+    box.add( back_missed );
+
+    if ( !box.empty() ){
+        for ( size_t z = box.lo[2]; z < box.hi[2]; z ++ ){
+        for ( size_t y = box.lo[1]; y < box.hi[1]; y ++ ){
+        for ( size_t x = box.lo[0]; x < box.hi[0]; x ++ ){
+            back( x,y,z ) = occupied[ back.sub2ind( x,y,z ) ] ? 0 : 1;
+        }
+        }
+        }
+        back.updateDistsFromBinary( box.lo, box.hi, band_cells, band );
+    }
+
+    back_missed = CellBox();
+    since_swap.add( changed );
+    ready = true;
+
+    pthread_mutex_unlock( &buffer_mutex );
+}
+
+} // orchomp namespace
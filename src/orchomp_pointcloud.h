@@ -0,0 +1,119 @@
+#ifndef _ORCHOMP_POINTCLOUD_H_
+#define _ORCHOMP_POINTCLOUD_H_
+
+#include "orchomp_distancefield.h"
+#include <pthread.h>
+#include <ostream>
+#include <vector>
+
+namespace orchomp{
+
+//Fuses point cloud frames into a world aligned occupancy grid on a
+//  thread of its own, and keeps a distance field of the grid up to
+//  date. Only the distances around the cells that changed are
+//  computed again. The field is double buffered: frames are fused into
+//  a back copy of its grid, which publish swaps into the field between
+//  CHOMP iterations, so that an iteration always sees a single frame.
+class PointCloudStream{
+  public:
+
+    //the field has to have been made by DistanceField::createEmpty,
+    //  with a max_dist of band. A cell is occupied while a point of
+    //  one of the last persistence frames is in it. Distances are
+    //  exact up to band, and band everywhere farther away. n_threads
+    //  is the number of threads used for each distance transform.
+    PointCloudStream( const DistanceField & field, double band,
+                      size_t persistence, size_t n_threads=1 );
+
+    //stops the thread, dropping any frame that is not fused yet.
+    ~PointCloudStream();
+
+    //copy a frame of n points, given as xyz triples in the frame
+    //  pose_world_sensor, for the thread to fuse. If the thread has
+    //  not taken the previous frame yet, that frame is dropped, so a
+    //  slow update falls behind by at most one frame.
+    void addFrame( const float * points, size_t n,
+                   const OpenRAVE::Transform & pose_world_sensor );
+
+    //if a frame has been fused since the last call, swap it into the
+    //  grid of field. Unless wait is true, this never waits for the
+    //  thread: if it is writing the back copy, the field stays as it
+    //  is until the next call. Returns true if the field changed.
+    bool publish( DistanceField & field, bool wait=false );
+
+    //wait until every frame that was added has been fused.
+    void sync();
+
+    //the number of frames fused and dropped, and the time that the
+    //  last frame took to fuse.
+    void printStatus( std::ostream & out );
+
+  private:
+
+    //a box of cells [lo, hi), empty when lo is not below hi.
+    struct CellBox {
+        vec3u lo, hi;
+        CellBox() : lo( 0 ), hi( 0 ) {}
+        bool empty() const {
+            return !( lo[0] < hi[0] && lo[1] < hi[1] && lo[2] < hi[2] );
+        }
+        void add( const vec3u & s );
+        void add( const CellBox & other );
+    };
+
+    //mark the cells of the points, find the cells whose occupancy
+    //  changed, and bring the back copy up to date.
+    void fuse( const std::vector< float > & points,
+               const OpenRAVE::Transform & pose_world_sensor );
+
+    static void * fuseThread( void * arg );
+
+    //the transform from the world to the grid, which is only a
+    //  translation, and the size of a cell.
+    OpenRAVE::Transform pose_grid_world;
+    double cell_size;
+
+    double band;
+    size_t band_cells, persistence;
+
+    //the frame that each cell was last hit in, counting from 1, and
+    //  whether it is occupied. Both are indexed like the grid, and
+    //  only the thread touches them.
+    std::vector< unsigned int > last_hit;
+    std::vector< bool > occupied;
+    unsigned int frame;
+
+    //the cells hit by each of the last persistence frames, with
+    //  frame f at frame_cells[ f % persistence ], and those of the frame
+    //  being fused. Only these cells can change their occupancy, so
+    //  the rest of the grid is never looked at.
+    std::vector< std::vector< vec3u > > frame_cells;
+    std::vector< vec3u > hit_cells;
+
+    //the back copy of the grid, and the cells that it has not seen
+    //  the changes of since it was swapped out of the field. The
+    //  changes that the field does not have are in since_swap.
+    DtGrid back;
+    CellBox back_missed, since_swap;
+    bool ready;
+    pthread_mutex_t buffer_mutex;
+
+    //the frame waiting to be fused, handed to the thread through
+    //  frame_mutex.
+    std::vector< float > pending;
+    OpenRAVE::Transform pending_pose;
+    bool has_pending, busy, stopping;
+    size_t frames_fused, frames_dropped;
+    double fuse_time;
+    pthread_mutex_t frame_mutex;
+    pthread_cond_t frame_cond, fused_cond;
+
+    pthread_t thread;
+    bool started;
+
+    Timer timer;
+};
+
+} // orchomp namespace
+
+#endif
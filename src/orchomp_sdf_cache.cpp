@@ -0,0 +1,126 @@
+#include "orchomp_sdf_cache.h"
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <sstream>
+#include <vector>
+
+namespace orchomp {
+
+//the extension of the fields in the cache directory.
+static const std::string SDF_EXTENSION = ".sdf";
+
+std::string GeometryHash::toString() const {
+    char buffer[17];
+    snprintf( buffer, sizeof( buffer ), "%016llx",
+              (unsigned long long) value );
+    return buffer;
+}
+
+//make the directory, and any of its parents that do not exist.
+static bool makeDirectories( const std::string & directory ){
+    for ( size_t i = 1; i <= directory.size(); i ++ ){
+        if ( i == directory.size() || directory[i] == '/' ){
+            const std::string partial = directory.substr( 0, i );
+            if ( mkdir( partial.c_str(), 0755 ) != 0 && errno != EEXIST ){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool endsWith( const std::string & s, const std::string & suffix ){
+    return s.size() >= suffix.size() &&
+           s.compare( s.size() - suffix.size(), suffix.size(), suffix ) == 0;
+}
+
+SDFCache::SDFCache( const std::string & directory, size_t max_bytes ) :
+    directory( directory ), max_bytes( max_bytes )
+{
+    if ( !isEnabled() ){ return; }
+
+    if ( !makeDirectories( this->directory ) ){
+        RAVELOG_WARN( "Could not create the sdf cache directory '%s', "
+                      "the cache is disabled\n", this->directory.c_str() );
+        this->directory.clear();
+    }
+}
+
+std::string SDFCache::getPath( const GeometryHash & hash ) const {
+    return directory + "/" + hash.toString() + SDF_EXTENSION;
+}
+
+void SDFCache::touch( const std::string & path ) const {
+    //setting the times to now is all that is needed, since the
+    //  eviction goes by modification time.
+    utime( path.c_str(), NULL );
+}
+
+void SDFCache::evict( const std::string & keep ) const {
+
+    if ( !isEnabled() ){ return; }
+
+    DIR * dir = opendir( directory.c_str() );
+    if ( !dir ){ return; }
+
+    //the modification time, size, and path of every field.
+    typedef std::pair< time_t, std::pair< size_t, std::string > > Entry;
+    std::vector< Entry > entries;
+    size_t total = 0;
+
+    for ( struct dirent * d = readdir( dir ); d; d = readdir( dir ) ){
+        const std::string name = d->d_name;
+        if ( !endsWith( name, SDF_EXTENSION ) ){ continue; }
+
+        const std::string path = directory + "/" + name;
+        struct stat st;
+        if ( stat( path.c_str(), &st ) != 0 ){ continue; }
+
+        total += st.st_size;
+        if ( path != keep ){
+            entries.push_back( Entry( st.st_mtime,
+                               std::make_pair( size_t( st.st_size ), path )));
+        }
+    }
+    closedir( dir );
+
+    //oldest first.
+    std::sort( entries.begin(), entries.end() );
+
+    for ( size_t i = 0; i < entries.size() && total > max_bytes; i ++ ){
+        //another process may have removed it already.
+        if ( unlink( entries[i].second.second.c_str() ) == 0 ){
+            RAVELOG_INFO( "Evicted '%s' from the sdf cache\n",
+                          entries[i].second.second.c_str() );
+        }
+        total -= std::min( total, entries[i].second.first );
+    }
+}
+
+bool SDFCache::save( const DtGrid_t< OpenRAVE::dReal > & grid,
+                     const std::string & path )
+{
+    std::stringstream ss;
+    ss << path << ".tmp." << getpid();
+    const std::string tmp = ss.str();
+
+    if ( !grid.saveMappable( tmp.c_str(), grid.hasGradients() ) ){
+        unlink( tmp.c_str() );
+        return false;
+    }
+
+    if ( rename( tmp.c_str(), path.c_str() ) != 0 ){
+        unlink( tmp.c_str() );
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace orchomp
@@ -0,0 +1,80 @@
+#ifndef _ORCHOMP_SDF_CACHE_H_
+#define _ORCHOMP_SDF_CACHE_H_
+
+#include <openrave/openrave.h>
+#include <string>
+#include <stdint.h>
+#include <cmath>
+#include "chomp-multigrid/mzcommon/DtGrid.h"
+
+namespace orchomp{
+
+//A 64 bit FNV-1a hash, used to identify the geometry that a distance
+//  field was computed from.
+class GeometryHash{
+  public:
+    uint64_t value;
+
+    GeometryHash() : value( 14695981039346656037ULL ){}
+
+    void add( const void * data, size_t size ){
+        const unsigned char * bytes = (const unsigned char *) data;
+        for ( size_t i = 0; i < size; i ++ ){
+            value ^= bytes[i];
+            value *= 1099511628211ULL;
+        }
+    }
+
+    template < class T >
+    void add( const T & data ){ add( &data, sizeof( data ) ); }
+
+    //add value rounded to a multiple of step, so that values which
+    //  only differ by floating point error hash the same.
+    void addQuantized( double value, double step ){
+        add( int64_t( floor( value / step + 0.5 ) ) );
+    }
+
+    //the hash as 16 hex digits.
+    std::string toString() const;
+};
+
+//A directory of distance fields, named by the hash of everything that
+//  they were computed from, so a field is only reused when its inputs
+//  are unchanged. Fields are written to a temporary file and renamed
+//  into place, so a field is never seen half written, and several
+//  processes can share the directory. When the fields in the
+//  directory use more than the budget, the least recently used ones
+//  are removed. Loaded fields are mapped into memory, and removing or
+//  replacing a file does not disturb the processes that have it
+//  mapped.
+class SDFCache{
+  public:
+    //an empty directory disables the cache.
+    SDFCache( const std::string & directory, size_t max_bytes );
+
+    bool isEnabled() const { return !directory.empty(); }
+
+    //the path of the field with the given hash.
+    std::string getPath( const GeometryHash & hash ) const;
+
+    //mark the field at path as just used.
+    void touch( const std::string & path ) const;
+
+    //remove the least recently used fields until the directory is
+    //  within the budget. The field at keep is never removed.
+    void evict( const std::string & keep ) const;
+
+    //save the grid, and its gradients if it stores them, to path by
+    //  way of a temporary file in the same directory. Returns false if
+    //  the grid could not be saved.
+    static bool save( const DtGrid_t< OpenRAVE::dReal > & grid,
+                      const std::string & path );
+
+  private:
+    std::string directory;
+    size_t max_bytes;
+};
+
+} // namespace orchomp
+
+#endif
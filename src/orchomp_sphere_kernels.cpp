@@ -0,0 +1,211 @@
+#include "orchomp_sphere_kernels.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace orchomp {
+
+//A few wrappers around the vector instructions, so that each kernel
+//  only has to be written once. vdouble holds WIDTH doubles.
+#if defined(__AVX__)
+
+typedef __m256d vdouble;
+typedef __m256d vmask;
+static const size_t WIDTH = 4;
+
+static inline vdouble vload( const double * p ){ return _mm256_loadu_pd(p); }
+static inline void vstore( double * p, vdouble a ){ _mm256_storeu_pd(p, a); }
+static inline vdouble vset1( double a ){ return _mm256_set1_pd( a ); }
+static inline vdouble vadd( vdouble a, vdouble b ){ return _mm256_add_pd(a,b); }
+static inline vdouble vsub( vdouble a, vdouble b ){ return _mm256_sub_pd(a,b); }
+static inline vdouble vmul( vdouble a, vdouble b ){ return _mm256_mul_pd(a,b); }
+static inline vdouble vdiv( vdouble a, vdouble b ){ return _mm256_div_pd(a,b); }
+static inline vdouble vsqrt( vdouble a ){ return _mm256_sqrt_pd( a ); }
+static inline vmask vlt( vdouble a, vdouble b ){
+    return _mm256_cmp_pd( a, b, _CMP_LT_OQ );
+}
+static inline vdouble vselect( vmask m, vdouble a, vdouble b ){
+    return _mm256_blendv_pd( b, a, m );
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128d vdouble;
+typedef __m128d vmask;
+static const size_t WIDTH = 2;
+
+static inline vdouble vload( const double * p ){ return _mm_loadu_pd( p ); }
+static inline void vstore( double * p, vdouble a ){ _mm_storeu_pd( p, a ); }
+static inline vdouble vset1( double a ){ return _mm_set1_pd( a ); }
+static inline vdouble vadd( vdouble a, vdouble b ){ return _mm_add_pd(a,b); }
+static inline vdouble vsub( vdouble a, vdouble b ){ return _mm_sub_pd(a,b); }
+static inline vdouble vmul( vdouble a, vdouble b ){ return _mm_mul_pd(a,b); }
+static inline vdouble vdiv( vdouble a, vdouble b ){ return _mm_div_pd(a,b); }
+static inline vdouble vsqrt( vdouble a ){ return _mm_sqrt_pd( a ); }
+static inline vmask vlt( vdouble a, vdouble b ){ return _mm_cmplt_pd(a,b); }
+static inline vdouble vselect( vmask m, vdouble a, vdouble b ){
+    return _mm_or_pd( _mm_and_pd( m, a ), _mm_andnot_pd( m, b ) );
+}
+
+#else
+
+typedef double vdouble;
+typedef bool vmask;
+static const size_t WIDTH = 1;
+
+static inline vdouble vload( const double * p ){ return *p; }
+static inline void vstore( double * p, vdouble a ){ *p = a; }
+static inline vdouble vset1( double a ){ return a; }
+static inline vdouble vadd( vdouble a, vdouble b ){ return a + b; }
+static inline vdouble vsub( vdouble a, vdouble b ){ return a - b; }
+static inline vdouble vmul( vdouble a, vdouble b ){ return a * b; }
+static inline vdouble vdiv( vdouble a, vdouble b ){ return a / b; }
+static inline vdouble vsqrt( vdouble a ){ return sqrt( a ); }
+static inline vmask vlt( vdouble a, vdouble b ){ return a < b; }
+static inline vdouble vselect( vmask m, vdouble a, vdouble b ){
+    return m ? a : b;
+}
+
+#endif
+
+//this is computeCostFromDist, without the branches. Inside of an
+//  object, the cost grows linearly, and within epsilon of it, the cost
+//  grows quadratically. The scale is what the unit gradient is
+//  multiplied by.
+static inline void vcostFromDist( vdouble dist, double epsilon,
+                                  vdouble & cost, vdouble & scale )
+{
+    const vdouble zero = vset1( 0.0 );
+    const vdouble eps = vset1( epsilon );
+    const vdouble half_inv_eps = vset1( 0.5 / epsilon );
+
+    const vdouble f = vsub( dist, eps );
+    const vmask inside = vlt( dist, zero );
+    const vmask near = vlt( dist, eps );
+
+    cost = vselect( inside, vsub( vset1( 0.5*epsilon ), dist ),
+                            vmul( vmul( f, f ), half_inv_eps ) );
+    scale = vselect( inside, vset1( -1.0 ), vmul( f, half_inv_eps ) );
+
+    cost = vselect( near, cost, zero );
+    scale = vselect( near, scale, zero );
+}
+
+//the same thing for the leftover elements at the end of a batch.
+static inline void costFromDist( double dist, double epsilon,
+                                 double & cost, double & scale )
+{
+    if ( dist < 0 ){
+        cost = -dist + 0.5*epsilon;
+        scale = -1.0;
+    }
+    else if ( dist < epsilon ){
+        const double f = dist - epsilon;
+        cost = f*f * 0.5/epsilon;
+        scale = f*0.5/epsilon;
+    }
+    else { cost = scale = 0.0; }
+}
+
+void computeCostsFromDists( size_t n, double epsilon,
+                            const double * dists,
+                            double * costs, double * scales )
+{
+    size_t i = 0;
+    for ( ; i + WIDTH <= n; i += WIDTH ){
+        vdouble cost, scale;
+        vcostFromDist( vload( dists + i ), epsilon, cost, scale );
+        vstore( costs + i, cost );
+        vstore( scales + i, scale );
+    }
+    for ( ; i < n; i ++ ){
+        costFromDist( dists[i], epsilon, costs[i], scales[i] );
+    }
+}
+
+void computeSphereSphereCosts( const SphereArrays & centers,
+                               const std::vector< double > & radii,
+                               double epsilon,
+                               CollisionBatch & batch )
+{
+    const size_t n = batch.size();
+    batch.resizeResults();
+
+    //gather the vectors between the centers, and the sum of the radii,
+    //  into contiguous arrays.
+    for ( size_t i = 0; i < n; i ++ ){
+        const int a = batch.first[i];
+        const int b = batch.second[i];
+        batch.gx[i] = centers.x[a] - centers.x[b];
+        batch.gy[i] = centers.y[a] - centers.y[b];
+        batch.gz[i] = centers.z[a] - centers.z[b];
+        batch.dist[i] = radii[a] + radii[b];
+    }
+
+    size_t i = 0;
+    for ( ; i + WIDTH <= n; i += WIDTH ){
+        const vdouble dx = vload( &batch.gx[i] );
+        const vdouble dy = vload( &batch.gy[i] );
+        const vdouble dz = vload( &batch.gz[i] );
+
+        const vdouble dist_between_centers = vsqrt(
+                      vadd( vadd( vmul( dx, dx ), vmul( dy, dy ) ),
+                            vmul( dz, dz ) ) );
+        const vdouble dist = vsub( dist_between_centers,
+                                   vload( &batch.dist[i] ) );
+
+        vdouble cost, scale;
+        vcostFromDist( dist, epsilon, cost, scale );
+
+        //the gradient is the unit vector between the centers, times
+        //  the scale.
+        scale = vdiv( scale, dist_between_centers );
+
+        vstore( &batch.dist[i], dist );
+        vstore( &batch.cost[i], cost );
+        vstore( &batch.scale[i], scale );
+        vstore( &batch.gx[i], vmul( dx, scale ) );
+        vstore( &batch.gy[i], vmul( dy, scale ) );
+        vstore( &batch.gz[i], vmul( dz, scale ) );
+    }
+    for ( ; i < n; i ++ ){
+        const double dist_between_centers = sqrt(
+                                    batch.gx[i]*batch.gx[i] +
+                                    batch.gy[i]*batch.gy[i] +
+                                    batch.gz[i]*batch.gz[i] );
+        batch.dist[i] = dist_between_centers - batch.dist[i];
+        costFromDist( batch.dist[i], epsilon, batch.cost[i],
+                      batch.scale[i] );
+        batch.scale[i] /= dist_between_centers;
+        batch.gx[i] *= batch.scale[i];
+        batch.gy[i] *= batch.scale[i];
+        batch.gz[i] *= batch.scale[i];
+    }
+}
+
+void computeSphereSDFCosts( double epsilon, CollisionBatch & batch )
+{
+    const size_t n = batch.size();
+    if ( n == 0 ){ return; }
+
+    computeCostsFromDists( n, epsilon, &batch.dist[0],
+                           &batch.cost[0], &batch.scale[0] );
+
+    size_t i = 0;
+    for ( ; i + WIDTH <= n; i += WIDTH ){
+        const vdouble scale = vload( &batch.scale[i] );
+        vstore( &batch.gx[i], vmul( vload( &batch.gx[i] ), scale ) );
+        vstore( &batch.gy[i], vmul( vload( &batch.gy[i] ), scale ) );
+        vstore( &batch.gz[i], vmul( vload( &batch.gz[i] ), scale ) );
+    }
+    for ( ; i < n; i ++ ){
+        batch.gx[i] *= batch.scale[i];
+        batch.gy[i] *= batch.scale[i];
+        batch.gz[i] *= batch.scale[i];
+    }
+}
+
+} // namespace orchomp
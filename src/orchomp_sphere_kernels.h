@@ -0,0 +1,89 @@
+#ifndef _ORCHOMP_SPHERE_KERNELS_H_
+#define _ORCHOMP_SPHERE_KERNELS_H_
+
+#include <openrave/openrave.h>
+#include <vector>
+
+namespace orchomp{
+
+//These are batched versions of the sphere collision cost functions.
+//  Everything is stored as a structure of arrays, so that the costs
+//  and gradients of several spheres can be computed at once with
+//  SSE2, or AVX when the plugin is compiled for it.
+
+//the centers of a set of spheres, stored one coordinate per array.
+class SphereArrays{
+  public:
+    std::vector< double > x, y, z;
+
+    void resize( size_t n ){
+        x.resize( n );
+        y.resize( n );
+        z.resize( n );
+    }
+
+    void set( size_t i, const OpenRAVE::Vector & position ){
+        x[i] = position[0];
+        y[i] = position[1];
+        z[i] = position[2];
+    }
+};
+
+//a batch of potential collisions between two spheres, or a sphere and
+//  an sdf. The kernels fill in the cost of each pair, and the
+//  workspace gradient on the first sphere of the pair.
+class CollisionBatch{
+  public:
+    //the indices of the sphere, and the other sphere (or the sdf).
+    std::vector< int > first, second;
+
+    //the distances, the costs, the amount the gradients are scaled by,
+    //  and the gradients.
+    std::vector< double > dist, cost, scale, gx, gy, gz;
+
+    size_t size() const { return first.size(); }
+
+    void clear(){
+        first.clear();
+        second.clear();
+    }
+
+    void push_back( int index1, int index2 ){
+        first.push_back( index1 );
+        second.push_back( index2 );
+    }
+
+    //make room for the results of every pair in the batch.
+    void resizeResults(){
+        const size_t n = first.size();
+        dist.resize( n );
+        cost.resize( n );
+        scale.resize( n );
+        gx.resize( n );
+        gy.resize( n );
+        gz.resize( n );
+    }
+};
+
+//For each distance, compute the cost from computeCostFromDist, and the
+//  amount that the (unit) gradient should be scaled by.
+void computeCostsFromDists( size_t n, double epsilon,
+                            const double * dists,
+                            double * costs, double * scales );
+
+//For each pair of spheres in the batch, compute the cost of the pair
+//  and its gradient with respect to the first sphere.
+void computeSphereSphereCosts( const SphereArrays & centers,
+                               const std::vector< double > & radii,
+                               double epsilon,
+                               CollisionBatch & batch );
+
+//The batch must already hold the sampled distance from each sphere's
+//  surface, and the sdf gradient, as filled in by one batched
+//  getDists call per sdf. This computes the costs, and scales the
+//  gradients.
+void computeSphereSDFCosts( double epsilon, CollisionBatch & batch );
+
+} // namespace orchomp
+
+#endif